@@ -4,71 +4,450 @@
 #include <stdexcept>
 #include <string>
 #include <cstring>
+#include <string_view>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <chrono>
+#include <charconv>
 
 #include "ldsDb.h"
 #include "ldsSnapshot.h"
+#include "ldsAof.h"
+#include "ldsConfig.h"
+#include "ldsStats.h"
+#include "ldsSlowlog.h"
 #include "logger.h"
 
 extern logger LOGGER;
 
+// Max number of consecutive batched commands that run under one shard lock
+#define BATCH_MAX_RUN 64
+// Period of the background checks for automatic saves
+#define CRON_INTERVAL_MS 100
+
 class dbGate {
 public:
+    // Swapped by RESTORE under an exclusive lock on db_mtx, every other user holds db_mtx shared
     ldsDb *ledisDb;
     ldsSnapshot *ledisSnapshot;
+    // nullptr unless append-only persistence is enabled
+    ldsAof *ledisAof = nullptr;
+
+private:
+    ldsConfig config;
+    ldsSlowlog slowlog;
+
+    std::shared_mutex db_mtx;
 
-    dbGate() {
+    std::thread cron;
+    std::mutex cron_mtx;
+    std::condition_variable cron_cv;
+    bool cron_stop = false;
+
+    /* Start a background save whenever one of the automatic save rules is met */
+    void cronLoop() {
+        std::unique_lock<std::mutex> lck(cron_mtx);
+        while (!cron_cv.wait_for(lck, std::chrono::milliseconds(CRON_INTERVAL_MS), [this] { return cron_stop; })) {
+            if (ledisSnapshot->shouldSave(config.save)) {
+                LOG_INFO("[CRON] Save rule met, starting background save");
+                std::shared_lock<std::shared_mutex> db_lck(db_mtx);
+                ledisSnapshot->createSnapshotInBackground(*ledisDb);
+            }
+        }
+    }
+
+    /* Render the INFO sections, with the per-command statistics if commands is true */
+    std::string info(bool commands = true) {
+        std::string ret = "# Memory\r\n";
+        ret += "used_memory:" + std::to_string(ledisDb->usedMemory()) + "\r\n";
+        ret += "maxmemory:" + std::to_string(config.maxmemory) + "\r\n";
+        ret += "maxmemory_policy:" + std::string(MAXMEMORY_POLICY_NAMES[config.maxmemory_policy]) + "\r\n";
+        ret += "evicted_keys:" + std::to_string(ledisDb->evictedKeys()) + "\r\n";
+        ret += "\r\n# Allocator\r\n";
+        for (auto &cls: ldsSlabPool::instance().stats()) {
+            if (cls.reserved == 0) {
+                continue;
+            }
+            ret += "slab" + std::to_string(cls.size) + ":reserved=" + std::to_string(cls.reserved)
+                   + ",active=" + std::to_string(cls.active) + ",active_bytes="
+                   + std::to_string(cls.active * cls.size) + "\r\n";
+        }
+        ret += "\r\n# Persistence\r\n";
+        for (auto &line: ledisSnapshot->status()) {
+            ret += line + "\r\n";
+        }
+        ret += "aof_enabled:" + std::to_string(ledisAof != nullptr) + "\r\n";
+        if (ledisAof != nullptr) {
+            ret += "aof_rewrite_in_progress:" + std::to_string(ledisAof->rewriteInProgress()) + "\r\n";
+            ret += "aof_current_size:" + std::to_string(ledisAof->size()) + "\r\n";
+        }
+        ret += "\r\n# Keyspace\r\n";
+        auto types = ledisDb->keysByType();
+        int64_t keys = 0;
+        for (unsigned type = 0; type < TYPE_COUNT; type++) {
+            ret += std::string(TYPE_NAMES[type]) + "_keys:" + std::to_string(types[type]) + "\r\n";
+            keys += types[type];
+        }
+        ret += "keys:" + std::to_string(keys) + "\r\n";
+        ret += "expired_keys:" + std::to_string(ledisDb->expiredKeys()) + "\r\n";
+        if (commands) {
+            ret += "\r\n# Commandstats\r\n";
+            char buf[256];
+            for (auto &cmd: ldsStats::instance().commands()) {
+                snprintf(buf, sizeof(buf), "cmdstat_%.*s:calls=%llu,failed_calls=%llu,usec=%llu,usec_per_call=%.3f,"
+                                           "p50=%.3f,p99=%.3f,p999=%.3f\r\n",
+                         (int) cmd.name.size(), cmd.name.data(), (unsigned long long) cmd.calls,
+                         (unsigned long long) cmd.failed, (unsigned long long) cmd.total_ns / 1000,
+                         (double) cmd.total_ns / 1000 / (double) cmd.calls, cmd.percentile(0.5) / 1000,
+                         cmd.percentile(0.99) / 1000, cmd.percentile(0.999) / 1000);
+                ret += buf;
+            }
+        }
+        return ret;
+    }
+
+    /* SLOWLOG GET [count] | LEN | RESET */
+    void slowlogCommand(const ldsCmd &cmd, ldsRet &ret) {
+        std::string sub{cmd.argv[0]};
+        for (auto &c: sub) {
+            c = asciiLower(c);
+        }
+        if (sub == "get" && cmd.argv.size() <= 2) {
+            long long count = 10;
+            if (cmd.argv.size() == 2) {
+                auto res = std::from_chars(cmd.argv[1].data(), cmd.argv[1].data() + cmd.argv[1].size(), count);
+                if (res.ec != std::errc{} || res.ptr != cmd.argv[1].data() + cmd.argv[1].size() || count < 0) {
+                    throw std::runtime_error("Count must be a non-negative integer");
+                }
+            }
+            ret.setList(slowlog.get(count));
+        } else if (sub == "len" && cmd.argv.size() == 1) {
+            ret.setInt((long long) slowlog.len());
+        } else if (sub == "reset" && cmd.argv.size() == 1) {
+            slowlog.reset();
+            ret.setOk();
+        } else {
+            throw std::runtime_error("Unknown SLOWLOG subcommand or wrong number of arguments");
+        }
+    }
+
+public:
+    /* Render the INFO fields with numeric values and the per-command statistics
+     * in the Prometheus text exposition format
+     * */
+    std::string metrics() {
+        std::string ret;
+        std::string fields;
+        {
+            std::shared_lock<std::shared_mutex> db_lck(db_mtx);
+            fields = info(false);
+        }
+        size_t pos = 0;
+        while (pos < fields.size()) {
+            auto eol = fields.find("\r\n", pos);
+            std::string_view line{fields.data() + pos, eol - pos};
+            pos = eol + 2;
+            auto colon = line.find(':');
+            if (line.empty() || line[0] == '#' || colon == std::string_view::npos) {
+                continue;
+            }
+            auto val = line.substr(colon + 1);
+            double num;
+            auto res = std::from_chars(val.data(), val.data() + val.size(), num);
+            if (res.ec != std::errc{} || res.ptr != val.data() + val.size()) {
+                continue;
+            }
+            ret += "ledis_" + std::string(line.substr(0, colon)) + " " + std::string(val) + "\n";
+        }
+
+        auto cmds = ldsStats::instance().commands();
+        char buf[256];
+        ret += "# TYPE ledis_commands_total counter\n";
+        for (auto &cmd: cmds) {
+            snprintf(buf, sizeof(buf), "ledis_commands_total{cmd=\"%.*s\"} %llu\n",
+                     (int) cmd.name.size(), cmd.name.data(), (unsigned long long) cmd.calls);
+            ret += buf;
+        }
+        ret += "# TYPE ledis_commands_failed_total counter\n";
+        for (auto &cmd: cmds) {
+            snprintf(buf, sizeof(buf), "ledis_commands_failed_total{cmd=\"%.*s\"} %llu\n",
+                     (int) cmd.name.size(), cmd.name.data(), (unsigned long long) cmd.failed);
+            ret += buf;
+        }
+        ret += "# TYPE ledis_command_duration_seconds summary\n";
+        for (auto &cmd: cmds) {
+            for (double q: {0.5, 0.99, 0.999}) {
+                snprintf(buf, sizeof(buf), "ledis_command_duration_seconds{cmd=\"%.*s\",quantile=\"%g\"} %.9f\n",
+                         (int) cmd.name.size(), cmd.name.data(), q, cmd.percentile(q) / 1e9);
+                ret += buf;
+            }
+            snprintf(buf, sizeof(buf), "ledis_command_duration_seconds_sum{cmd=\"%.*s\"} %.9f\n"
+                                       "ledis_command_duration_seconds_count{cmd=\"%.*s\"} %llu\n",
+                     (int) cmd.name.size(), cmd.name.data(), (double) cmd.total_ns / 1e9,
+                     (int) cmd.name.size(), cmd.name.data(), (unsigned long long) cmd.calls);
+            ret += buf;
+        }
+        return ret;
+    }
+
+    explicit dbGate(const ldsConfig &config = {})
+            : config(config), slowlog(config.slowlog_log_slower_than, config.slowlog_max_len) {
         ledisDb = new ldsDb{};
+        ledisDb->setMaxMemory(config);
         ledisSnapshot = new ldsSnapshot{};
+        if (config.appendonly) {
+            try {
+                ldsAof::load(config.appendfilename, *ledisDb);
+            } catch (...) {
+                delete ledisDb;
+                delete ledisSnapshot;
+                throw;
+            }
+            ledisAof = new ldsAof{config.appendfilename, config.appendfsync};
+            write_hook = [this](const ldsCmd &cmd) {
+                ledisAof->append(cmd);
+            };
+        } else if (config.loadsnapshot != SNAPSHOT_LOAD_NO) {
+            if (!ledisSnapshot->loadSnapshot(*ledisDb, config.loadsnapshot == SNAPSHOT_LOAD_ASYNC)) {
+                LOG_WARNING("[SNAPSHOT] No snapshot loaded, starting with an empty database");
+                delete ledisDb;
+                ledisDb = new ldsDb{};
+                ledisDb->setMaxMemory(config);
+            }
+        }
+        if (!config.save.empty()) {
+            cron = std::thread(&dbGate::cronLoop, this);
+        }
     }
 
     ~dbGate() {
+        if (cron.joinable()) {
+            {
+                std::lock_guard<std::mutex> lck(cron_mtx);
+                cron_stop = true;
+            }
+            cron_cv.notify_all();
+            cron.join();
+        }
+        write_hook = nullptr;
+        ledisSnapshot->waitLoaded();
+        delete ledisAof;
         delete ledisDb;
         delete ledisSnapshot;
     }
 
-    int parseAndExecute(const std::string &cmdStr, ldsRet &ret) {
+    int parseAndExecute(std::string_view cmdStr, ldsRet &ret) {
+        ldsCmd cmd{};
         try {
-            ldsCmd cmd = parseCmd(cmdStr);
-            if (cmd.cmd == CMD_EXIT) {
-                return -1;
+            cmd = parseCmd(cmdStr);
+        } catch (const std::exception &e) {
+            ret.setErr(e.what());
+            LOG_ERROR("[ERROR] " + std::string(e.what()));
+            return 0;
+        }
+        return execute(cmd, ret);
+    }
+
+    int execute(const ldsCmd &cmd, ldsRet &ret) {
+        // RESTORE takes db_mtx exclusively around the swap itself
+        std::shared_lock<std::shared_mutex> db_lck(db_mtx, std::defer_lock);
+        if (cmd.cmd != CMD_RESTORE) {
+            db_lck.lock();
+        }
+        return executeTimed(cmd, ret);
+    }
+
+    /* Execute a command, recording its latency and slow runs
+     * Precondition:
+     * - acquire shared lock on db_mtx, unless cmd is RESTORE
+     * */
+    int executeTimed(const ldsCmd &cmd, ldsRet &ret) {
+        if (cmd.cmd == CMD_EXIT) {
+            return -1;
+        }
+        // a batched command starts with the wait for the batch lock, if any
+        if (batch_shard == nullptr) {
+            lock_waits.clear();
+        }
+        auto start = std::chrono::steady_clock::now();
+        int rc = executeLogged(cmd, ret);
+        // commands of a batch wait once the batch releases its shard lock
+        if (ledisAof != nullptr && batch_shard == nullptr) {
+            ledisAof->waitDurable();
+            if ((cmd.spec->flags & CMDF_WRITE) && ledisAof->shouldRewrite()) {
+                ledisAof->rewriteInBackground(*ledisDb);
+            }
+        }
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+        ldsStats::instance().record(cmd.spec, ns, rc > 0);
+        slowlog.record(cmd, ns);
+        lock_waits.clear();
+        return rc;
+    }
+
+    /* Execute a command, handing it to the append-only file if it writes */
+    int executeLogged(const ldsCmd &cmd, ldsRet &ret) {
+        if (ledisAof != nullptr && (cmd.spec->flags & CMDF_WRITE)) {
+            pending_write = &cmd;
+        }
+        try {
+            {
+                // execute() does not hold db_mtx for RESTORE, which takes it exclusively around the swap below
+                std::shared_lock<std::shared_mutex> db_lck(db_mtx, std::defer_lock);
+                if (cmd.cmd == CMD_RESTORE) {
+                    db_lck.lock();
+                }
+                ledisDb->execute(cmd, ret);
+            }
+            pending_write = nullptr;
+            if (cmd.spec->flags & CMDF_WRITE) {
+                ledisSnapshot->addChanges(1);
             }
-            ledisDb->execute(cmd, ret);
 
             if (ret.type == RET_UNKNOWN) {
                 switch (cmd.cmd) {
                     case CMD_SNAPSHOT:
-                        LOGGER.info("[COMMAND] Save");
-                        if (cmd.args != nullptr && strlen(cmd.args) > 0)
-                            throw std::runtime_error("Save command does not take arguments");
+                        LOG_INFO("[COMMAND] Save");
+                        if (ledisSnapshot->inProgress())
+                            throw std::runtime_error("Background save already in progress");
                         if (!ledisSnapshot->createSnapshot(*ledisDb))
                             throw std::runtime_error("Failed to create snapshot");
-                        ret.type = RET_OK;
-                        ret.ptr = nullptr;
+                        ret.setOk();
+                        break;
+                    case CMD_BGSAVE:
+                        LOG_INFO("[COMMAND] Bgsave");
+                        if (ledisSnapshot->inProgress())
+                            throw std::runtime_error("Background save already in progress");
+                        if (!ledisSnapshot->createSnapshotInBackground(*ledisDb))
+                            throw std::runtime_error("Failed to start background save");
+                        ret.setOk();
+                        break;
+                    case CMD_LASTSAVE:
+                        ret.setInt(ledisSnapshot->lastSave());
+                        break;
+                    case CMD_INFO:
+                        ret.setStr(info());
+                        break;
+                    case CMD_SLOWLOG:
+                        slowlogCommand(cmd, ret);
                         break;
                     case CMD_RESTORE: {
-                        LOGGER.info("[COMMAND] Restore");
+                        LOG_INFO("[COMMAND] Restore");
+                        if (ledisSnapshot->loading())
+                            throw std::runtime_error("Snapshot still loading");
                         auto tmpDb = ledisSnapshot->restoreSnapshot();
-                        if (tmpDb != nullptr) {
-                            delete ledisDb;
-                            ledisDb = tmpDb;
-                            ret.type = RET_OK;
-                            ret.ptr = nullptr;
-                        } else
+                        if (tmpDb == nullptr)
                             throw std::runtime_error("Failed to restore snapshot");
+                        // rewrites start under a shared lock on db_mtx, none can start until the new one below
+                        std::unique_lock<std::shared_mutex> db_lck(db_mtx);
+                        tmpDb->setMaxMemory(config);
+                        delete ledisDb;
+                        ledisDb = tmpDb;
+                        // the log no longer describes the db, rebuild it from the restored one
+                        // once a rewrite of the replaced db, if running, has finished
+                        if (ledisAof != nullptr) {
+                            ledisAof->waitRewrite();
+                            if (!ledisAof->rewriteInBackground(*ledisDb))
+                                throw std::runtime_error("Restored, but cannot rewrite the append-only file");
+                        }
+                        ret.setOk();
                         break;
                     }
+                    case CMD_BGREWRITEAOF:
+                        LOG_INFO("[COMMAND] Bgrewriteaof");
+                        if (ledisAof == nullptr)
+                            throw std::runtime_error("Append-only file is disabled");
+                        if (!ledisAof->rewriteInBackground(*ledisDb))
+                            throw std::runtime_error("Background append-only file rewriting already in progress");
+                        ret.setOk();
+                        break;
                     default:
                         throw std::runtime_error("Unknown command");
                 }
             }
-            ledisSnapshot->addCmd(cmd);
             return 1;
 
         } catch (const std::exception &e) {
-            ret.type = RET_ERR;
-            ret.ptr = new std::string(e.what());
-            LOGGER.error("[ERROR] " + std::string(e.what()));
+            pending_write = nullptr;
+            ret.setErr(e.what());
+            LOG_ERROR("[ERROR] " + std::string(e.what()));
             return 0;
         }
     }
+
+    /* Execute newline-separated commands in order, one result per non-empty line.
+     * A run of consecutive single-key commands on the same shard shares one lock acquisition,
+     * taken exclusively if any command of the run writes.
+     * Execution stops after an EXIT command.
+     * */
+    void parseAndExecuteBatch(std::string_view body, std::vector<ldsRet> &rets) {
+        struct batchItem {
+            ldsCmd cmd{};
+            bool parsed = false;
+            long shard = -1;
+        };
+
+        std::vector<batchItem> items;
+        while (!body.empty()) {
+            auto eol = body.find('\n');
+            auto line = body.substr(0, eol);
+            body = eol == std::string_view::npos ? std::string_view{} : body.substr(eol + 1);
+            if (line.find_first_not_of(" \t\r") == std::string_view::npos) {
+                continue;
+            }
+
+            batchItem item;
+            ldsRet ret;
+            try {
+                item.cmd = parseCmd(line);
+                item.parsed = true;
+                if (item.cmd.spec->flags & CMDF_SINGLE_KEY) {
+                    item.shard = (long) ldsDb::shardIndex(item.cmd.argv[0]);
+                }
+            } catch (const std::exception &e) {
+                ret.setErr(e.what());
+                LOG_ERROR("[ERROR] " + std::string(e.what()));
+            }
+            items.push_back(std::move(item));
+            rets.push_back(std::move(ret));
+        }
+
+        for (size_t i = 0; i < items.size();) {
+            if (!items[i].parsed) {
+                i++;
+                continue;
+            }
+            if (items[i].shard < 0) {
+                if (execute(items[i].cmd, rets[i]) < 0) {
+                    rets.resize(i);
+                    return;
+                }
+                i++;
+                continue;
+            }
+
+            size_t end = i;
+            bool unique = false;
+            while (end < items.size() && end - i < BATCH_MAX_RUN
+                   && items[end].parsed && items[end].shard == items[i].shard) {
+                unique |= (items[end].cmd.spec->flags & CMDF_WRITE) != 0;
+                end++;
+            }
+            {
+                lock_waits.clear();
+                std::shared_lock<std::shared_mutex> db_lck(db_mtx);
+                auto lck = ledisDb->lockForBatch(items[i].cmd.argv[0], unique);
+                for (; i < end; i++) {
+                    executeTimed(items[i].cmd, rets[i]);
+                }
+            }
+            if (ledisAof != nullptr) {
+                ledisAof->waitDurable();
+            }
+        }
+    }
 };
\ No newline at end of file
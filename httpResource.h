@@ -8,6 +8,16 @@ extern logger LOGGER;
 
 using namespace httpserver;
 
+// Reusable per-thread buffer for rendering replies
+inline thread_local std::string reply_buf;
+// Address of the client of the request being served, see current_client
+inline thread_local std::string client_buf;
+
+inline void setClient(const http_request &req) {
+    client_buf = std::string(req.get_requestor()) + ":" + std::to_string(req.get_requestor_port());
+    current_client = client_buf;
+}
+
 class dbQueryResource : public http_resource {
 private:
     dbGate *db;
@@ -16,70 +26,66 @@ public:
 
     std::shared_ptr<http_response> render_POST(const http_request &req) override {
         auto body = req.get_content();
-        LOGGER.info("[REQUEST] Body: " + std::string(body));
-
-        ldsRet ret{};
-        db->parseAndExecute(std::string(body), ret);
-
-        std::string resp;
-        switch (ret.type) {
-            case RET_STR:
-                if (ret.ptr == nullptr) {
-                    resp = "(nil)";
-                    break;
-                }
-                resp = "\"" + *(std::string *) ret.ptr + "\"";
-                delete (std::string *) ret.ptr;
-                break;
-            case RET_INT:
-                if (ret.ptr == nullptr) {
-                    resp = "(nil)";
-                    break;
-                }
-                resp = "(integer) " + std::to_string(*(int *) ret.ptr);
-                delete (int *) ret.ptr;
-                break;
-            case RET_BOOL:
-                if (ret.ptr == nullptr) {
-                    resp = "(nil)";
-                    break;
-                }
-                resp = *(bool *) ret.ptr ? "1" : "0";
-                delete (bool *) ret.ptr;
-                break;
-            case RET_OK:
-                resp = "OK";
-                break;
-            case RET_LIST: {
-                if (ret.ptr == nullptr) {
-                    resp = "(empty list)";
-                    break;
-                }
-                auto *list = (std::vector<std::string> *) ret.ptr;
-                if (list->empty()) {
-                    resp = "(empty list)";
-                    break;
-                }
-                resp = "1) \"" + list->at(0) + "\"";
-                for (int i = 1; i < list->size(); i++) {
-                    resp += "\n" + std::to_string(i + 1) + ") \"" + list->at(i) + "\"";
-                }
-                delete list;
-                break;
+        LOG_DEBUG("[REQUEST] Body: " + std::string(body));
+
+        ldsRet ret;
+        setClient(req);
+        db->parseAndExecute(body, ret);
+
+        reply_buf.clear();
+        writeText(ret, reply_buf);
+        return std::shared_ptr<http_response>(new string_response(reply_buf));
+    }
+
+    std::shared_ptr<http_response> render(const http_request &) override {
+        return std::shared_ptr<http_response>(new string_response("Invalid request method. Use POST instead."));
+    }
+};
+
+class dbBatchResource : public http_resource {
+private:
+    dbGate *db;
+public:
+    explicit dbBatchResource(class dbGate *db) : db(db) {}
+
+    /* Execute newline-separated commands, reply with one rendered result per command, in order */
+    std::shared_ptr<http_response> render_POST(const http_request &req) override {
+        auto body = req.get_content();
+        LOG_DEBUG("[REQUEST] Batch body: " + std::string(body));
+
+        std::vector<ldsRet> rets;
+        setClient(req);
+        db->parseAndExecuteBatch(body, rets);
+
+        reply_buf.clear();
+        for (size_t i = 0; i < rets.size(); i++) {
+            if (i > 0) {
+                reply_buf += '\n';
             }
-            case RET_ERR:
-                resp = "ERROR: " + *(std::string *) ret.ptr;
-                delete (std::string *) ret.ptr;
-                break;
-            case RET_UNKNOWN:
-                resp = "ERROR: An error occurred.";
-                break;
+            writeText(rets[i], reply_buf);
         }
 
-        return std::shared_ptr<http_response>(new string_response(resp));
+        return std::shared_ptr<http_response>(new string_response(reply_buf));
     }
 
     std::shared_ptr<http_response> render(const http_request &) override {
         return std::shared_ptr<http_response>(new string_response("Invalid request method. Use POST instead."));
     }
-};
\ No newline at end of file
+};
+
+class dbMetricsResource : public http_resource {
+private:
+    dbGate *db;
+public:
+    explicit dbMetricsResource(class dbGate *db) : db(db) {}
+
+    /* Reply with the server statistics in the Prometheus text exposition format */
+    std::shared_ptr<http_response> render_GET(const http_request &) override {
+        return std::shared_ptr<http_response>(
+                new string_response(db->metrics(), 200, "text/plain; version=0.0.4"));
+    }
+
+    std::shared_ptr<http_response> render(const http_request &) override {
+        return std::shared_ptr<http_response>(new string_response("Invalid request method. Use GET instead."));
+    }
+};
@@ -0,0 +1,257 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <array>
+#include <mutex>
+#include <new>
+#include <iterator>
+#include <cstddef>
+#include <cstdint>
+#include <pthread.h>
+
+// Objects up to SLAB_MAX_OBJECT bytes are carved from slabs of SLAB_BYTES, larger ones use operator new
+#define SLAB_BYTES (64 * 1024)
+#define SLAB_MAX_OBJECT 512
+// Max free objects a thread keeps per size class, and the number moved at once to or from the shared pool
+#define SLAB_CACHE_OBJECTS 128
+#define SLAB_BATCH 32
+
+constexpr size_t SLAB_CLASS_SIZES[] = {16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512};
+constexpr size_t SLAB_CLASS_COUNT = std::size(SLAB_CLASS_SIZES);
+
+// Size class of each size rounded up to a multiple of 16, indexed by size / 16
+constexpr auto SLAB_CLASS_OF_UNITS = [] {
+    std::array<unsigned char, SLAB_MAX_OBJECT / 16 + 1> table{};
+    unsigned cls = 0;
+    for (size_t units = 0; units < table.size(); units++) {
+        while (SLAB_CLASS_SIZES[cls] < units * 16) {
+            cls++;
+        }
+        table[units] = (unsigned char) cls;
+    }
+    return table;
+}();
+
+/* Usage of one size class */
+struct ldsSlabStats {
+    size_t size;
+    // bytes reserved by the slabs of the class
+    size_t reserved;
+    // objects handed out, including those held in the free caches of threads
+    size_t active;
+};
+
+/* Size-class allocator for small objects.
+ * Each class owns slabs cut into objects of its size. Freed objects go to a cache of the freeing thread,
+ * which exchanges them with the shared free list of the class in batches, so that most allocations take no lock.
+ * Slabs are never given back: a class keeps the memory of its peak usage, but objects of different sizes
+ * never share a slab, which keeps long running workloads from fragmenting the heap.
+ * */
+class ldsSlabPool {
+private:
+    struct freeObj {
+        freeObj *next;
+    };
+
+    struct sizeClass {
+        std::mutex mtx;
+        freeObj *free = nullptr;
+        size_t free_count = 0;
+        // unused tail of the last slab
+        char *bump = nullptr;
+        char *bump_end = nullptr;
+        size_t slabs = 0;
+        size_t carved = 0;
+    };
+
+    struct threadCache {
+        struct list {
+            freeObj *head = nullptr;
+            size_t count = 0;
+        };
+
+        list lists[SLAB_CLASS_COUNT];
+
+        ~threadCache() {
+            auto &pool = instance();
+            for (size_t cls = 0; cls < SLAB_CLASS_COUNT; cls++) {
+                pool.release(cls, lists[cls], lists[cls].count);
+            }
+            cache_dead = true;
+        }
+    };
+
+    // set once the cache of the current thread is destroyed, later frees go to the shared lists
+    static inline thread_local bool cache_dead = false;
+
+    sizeClass classes[SLAB_CLASS_COUNT];
+
+    static threadCache *cache() {
+        if (cache_dead) {
+            return nullptr;
+        }
+        static thread_local threadCache tc;
+        return &tc;
+    }
+
+    ldsSlabPool() {
+        // a child forked while another thread holds a class lock would deadlock on its first allocation
+        pthread_atfork([] { instance().lockAll(); }, [] { instance().unlockAll(); }, [] { instance().unlockAll(); });
+    }
+
+    void lockAll() {
+        for (auto &c: classes) {
+            c.mtx.lock();
+        }
+    }
+
+    void unlockAll() {
+        for (auto &c: classes) {
+            c.mtx.unlock();
+        }
+    }
+
+    /* Move up to SLAB_BATCH objects of a class to list, carving a new slab if needed */
+    void refill(size_t cls, threadCache::list &list) {
+        auto &c = classes[cls];
+        size_t size = SLAB_CLASS_SIZES[cls];
+        std::lock_guard<std::mutex> lck(c.mtx);
+        for (size_t n = 0; n < SLAB_BATCH; n++) {
+            freeObj *obj;
+            if (c.free != nullptr) {
+                obj = c.free;
+                c.free = obj->next;
+                c.free_count--;
+            } else {
+                if (c.bump + size > c.bump_end) {
+                    c.bump = static_cast<char *>(::operator new(SLAB_BYTES));
+                    c.bump_end = c.bump + SLAB_BYTES;
+                    c.slabs++;
+                }
+                obj = reinterpret_cast<freeObj *>(c.bump);
+                c.bump += size;
+                c.carved++;
+            }
+            obj->next = list.head;
+            list.head = obj;
+            list.count++;
+        }
+    }
+
+    /* Move n objects from the front of list to the shared free list of a class */
+    void release(size_t cls, threadCache::list &list, size_t n) {
+        if (n == 0) {
+            return;
+        }
+        auto first = list.head, last = list.head;
+        for (size_t k = 1; k < n; k++) {
+            last = last->next;
+        }
+        list.head = last->next;
+        list.count -= n;
+
+        auto &c = classes[cls];
+        std::lock_guard<std::mutex> lck(c.mtx);
+        last->next = c.free;
+        c.free = first;
+        c.free_count += n;
+    }
+
+public:
+    static ldsSlabPool &instance() {
+        // never destroyed, objects may be freed during static destruction
+        static auto *pool = new ldsSlabPool();
+        return *pool;
+    }
+
+    void *allocate(size_t size) {
+        if (size > SLAB_MAX_OBJECT) {
+            return ::operator new(size);
+        }
+        size_t cls = SLAB_CLASS_OF_UNITS[(size + 15) / 16];
+        auto tc = cache();
+        if (tc == nullptr) {
+            threadCache::list tmp;
+            refill(cls, tmp);
+            auto obj = tmp.head;
+            tmp.head = obj->next;
+            tmp.count--;
+            release(cls, tmp, tmp.count);
+            return obj;
+        }
+        auto &list = tc->lists[cls];
+        if (list.head == nullptr) {
+            refill(cls, list);
+        }
+        auto obj = list.head;
+        list.head = obj->next;
+        list.count--;
+        return obj;
+    }
+
+    void deallocate(void *p, size_t size) noexcept {
+        if (size > SLAB_MAX_OBJECT) {
+            ::operator delete(p);
+            return;
+        }
+        size_t cls = SLAB_CLASS_OF_UNITS[(size + 15) / 16];
+        auto obj = static_cast<freeObj *>(p);
+        auto tc = cache();
+        if (tc == nullptr) {
+            threadCache::list tmp{obj, 1};
+            obj->next = nullptr;
+            release(cls, tmp, 1);
+            return;
+        }
+        auto &list = tc->lists[cls];
+        obj->next = list.head;
+        list.head = obj;
+        if (++list.count > SLAB_CACHE_OBJECTS) {
+            release(cls, list, list.count - SLAB_CACHE_OBJECTS / 2);
+        }
+    }
+
+    /* Usage of every size class */
+    std::vector<ldsSlabStats> stats() {
+        std::vector<ldsSlabStats> ret;
+        for (size_t cls = 0; cls < SLAB_CLASS_COUNT; cls++) {
+            auto &c = classes[cls];
+            std::lock_guard<std::mutex> lck(c.mtx);
+            ret.push_back({SLAB_CLASS_SIZES[cls], c.slabs * SLAB_BYTES, c.carved - c.free_count});
+        }
+        return ret;
+    }
+};
+
+/* Standard allocator drawing from ldsSlabPool, for containers of the keyspace */
+template<class T>
+struct ldsAllocator {
+    using value_type = T;
+
+    static_assert(alignof(T) <= 16, "slab objects are 16-byte aligned");
+
+    ldsAllocator() noexcept = default;
+
+    template<class U>
+    ldsAllocator(const ldsAllocator<U> &) noexcept {}
+
+    T *allocate(size_t n) {
+        if (n > SIZE_MAX / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+        return static_cast<T *>(ldsSlabPool::instance().allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T *p, size_t n) noexcept {
+        ldsSlabPool::instance().deallocate(p, n * sizeof(T));
+    }
+
+    template<class U>
+    bool operator==(const ldsAllocator<U> &) const noexcept {
+        return true;
+    }
+};
+
+// String allocating from the slab pool, for keys and members stored in the keyspace
+using ldsString = std::basic_string<char, std::char_traits<char>, ldsAllocator<char>>;
@@ -0,0 +1,561 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <span>
+#include <charconv>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <condition_variable>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "ldsConfig.h"
+#include "ldsDb.h"
+#include "logger.h"
+
+extern logger LOGGER;
+
+// Max time between two fsyncs with AOF_FSYNC_EVERYSEC
+#define AOF_SYNC_INTERVAL_MS 1000
+// Idle period of the writer while unsynced data waits for the next fsync
+#define AOF_IDLE_POLL_MS 10
+// Automatic rewrite once the file is at least this large and has grown by this percentage since the last rewrite
+#define AOF_REWRITE_MIN_SIZE (64 * 1024 * 1024)
+#define AOF_REWRITE_PERCENTAGE 100
+// Max number of list or set members per command in a rewritten file
+#define AOF_REWRITE_ITEMS_PER_CMD 64
+
+/* Append-only file of write commands, one command per line in the text form accepted by parseCmd,
+ * or as a RESP multibulk request if an argument is empty or holds whitespace.
+ * Commands are appended to a lock-free stack while they hold their shard lock, so the file keeps the order
+ * in which they were applied. A writer thread drains the stack and writes each drained batch with a single
+ * write, and with AOF_FSYNC_ALWAYS a single fsync, that every command of the batch then waits for.
+ * The file is compacted in the background by rewriting it from a forked copy of the db, see rewriteInBackground.
+ * */
+class ldsAof {
+private:
+    struct entry {
+        entry *next = nullptr;
+        std::string line;
+        // set once the entry is on disk, with AOF_FSYNC_ALWAYS only
+        std::atomic<bool> durable{false};
+        // marks the point the forked copy of a rewrite was taken at, commands after it go to rewrite_buf
+        bool rewrite_start = false;
+    };
+
+    std::string filename;
+    unsigned fsync_policy;
+
+    // guards fd and the rewrite buffer
+    std::mutex file_mtx;
+    int fd = -1;
+    std::string rewrite_buf;
+    bool rewrite_buffering = false;
+    // notified when the writer reaches the rewrite marker
+    std::condition_variable marker_cv;
+
+    std::atomic<bool> rewriting{false};
+    std::thread rewriter;
+    std::atomic<size_t> file_size{0};
+    // size right after the last rewrite, or at startup
+    std::atomic<size_t> base_size{0};
+
+    // stack of appended entries, newest first
+    std::atomic<entry *> pending{nullptr};
+    // bumped after every batch made durable, waited on by commands waiting for their entry
+    std::atomic<uint64_t> synced_batches{0};
+    std::atomic<bool> stopping{false};
+    std::thread writer;
+
+    // entries appended by the current thread and not waited for yet, with AOF_FSYNC_ALWAYS only
+    static inline thread_local std::vector<entry *> unsynced;
+
+    /* Append a command to out, as a line of text if every argument survives tokenizing, as multibulk otherwise */
+    static void formatWords(std::string &out, std::string_view name, std::span<const std::string_view> args) {
+        bool plain = std::all_of(args.begin(), args.end(), [](std::string_view arg) {
+            return !arg.empty() && std::none_of(arg.begin(), arg.end(), isSpace);
+        });
+        if (plain) {
+            out += name;
+            for (auto &arg: args) {
+                out += ' ';
+                out += arg;
+            }
+            out += '\n';
+            return;
+        }
+        out += '*' + std::to_string(args.size() + 1) + "\r\n";
+        out += '$' + std::to_string(name.size()) + "\r\n";
+        out += name;
+        out += "\r\n";
+        for (auto &arg: args) {
+            out += '$' + std::to_string(arg.size()) + "\r\n";
+            out += arg;
+            out += "\r\n";
+        }
+    }
+
+    static std::string formatCmd(const ldsCmd &cmd) {
+        std::string line;
+        // relative expirations are logged as deadlines, so that replaying them later does not extend them,
+        // an invalid TTL is logged as given so that replaying it fails like the command did
+        long long val = -1;
+        if (cmd.cmd == CMD_GEXPIRE || cmd.cmd == CMD_GPEXPIRE) {
+            auto arg = cmd.argv[1];
+            auto res = std::from_chars(arg.data(), arg.data() + arg.size(), val);
+            if (res.ec != std::errc{} || res.ptr != arg.data() + arg.size()) {
+                val = -1;
+            }
+        }
+        if (val >= 0) {
+            auto ttl = std::chrono::milliseconds(val);
+            if (cmd.cmd == CMD_GEXPIRE) {
+                ttl *= 1000;
+            }
+            auto deadline = std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(
+                    (std::chrono::system_clock::now() + ttl).time_since_epoch()).count());
+            std::string_view args[] = {cmd.argv[0], deadline};
+            formatWords(line, "pexpireat", args);
+        } else {
+            formatWords(line, cmd.spec->name, cmd.argv.from(0));
+        }
+        return line;
+    }
+
+    /* Read the bulk strings of a multibulk command into words, after its header line was read
+     * Return false if the file ends first, add the bytes read to size
+     * */
+    static bool readMultibulk(std::istream &in, const std::string &header, std::vector<std::string> &words,
+                              size_t &size) {
+        auto count = parseInt(std::string_view{header}.substr(1, header.size() - 1 - (header.back() == '\r')));
+        if (count < 0 || count > 1024 * 1024) {
+            throw std::runtime_error("Invalid multibulk length in append-only file: " + header);
+        }
+        words.clear();
+        std::string line;
+        for (long long i = 0; i < count; i++) {
+            if (!std::getline(in, line) || in.eof()) {
+                return false;
+            }
+            size += line.size() + 1;
+            if (line.size() < 3 || line[0] != '$' || line.back() != '\r') {
+                throw std::runtime_error("Invalid bulk header in append-only file: " + line);
+            }
+            auto len = parseInt(std::string_view{line}.substr(1, line.size() - 2));
+            if (len < 0 || len > 512 * 1024 * 1024) {
+                throw std::runtime_error("Invalid bulk length in append-only file: " + line);
+            }
+            std::string word((size_t) len + 2, '\0');
+            if (!in.read(word.data(), (std::streamsize) word.size())) {
+                return false;
+            }
+            size += word.size();
+            if (word[len] != '\r' || word[len + 1] != '\n') {
+                throw std::runtime_error("Bulk string not terminated by CRLF in append-only file");
+            }
+            word.resize(len);
+            words.push_back(std::move(word));
+        }
+        return true;
+    }
+
+    static bool writeAll(int fd, const std::string &buf) {
+        size_t off = 0;
+        while (off < buf.size()) {
+            auto n = ::write(fd, buf.data() + off, buf.size() - off);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                LOG_ERROR("[AOF] write failed: " + std::string(strerror(errno)));
+                return false;
+            }
+            off += n;
+        }
+        return true;
+    }
+
+    void sync() {
+        std::lock_guard<std::mutex> lck(file_mtx);
+        if (fdatasync(fd) != 0) {
+            LOG_ERROR("[AOF] fdatasync failed: " + std::string(strerror(errno)));
+        }
+    }
+
+    void writerLoop() {
+        std::string buf;
+        auto last_sync = std::chrono::steady_clock::now();
+        auto interval = std::chrono::milliseconds(AOF_SYNC_INTERVAL_MS);
+        bool dirty = false;
+
+        while (true) {
+            auto batch = pending.exchange(nullptr, std::memory_order_acquire);
+            if (batch == nullptr) {
+                if (stopping.load()) {
+                    break;
+                }
+                if (dirty && fsync_policy == AOF_FSYNC_EVERYSEC) {
+                    if (std::chrono::steady_clock::now() - last_sync >= interval) {
+                        sync();
+                        dirty = false;
+                        last_sync = std::chrono::steady_clock::now();
+                    } else {
+                        std::this_thread::sleep_for(std::chrono::milliseconds(AOF_IDLE_POLL_MS));
+                    }
+                    continue;
+                }
+                pending.wait(nullptr, std::memory_order_acquire);
+                continue;
+            }
+
+            // reverse the stack into append order
+            entry *ordered = nullptr;
+            while (batch != nullptr) {
+                auto next = batch->next;
+                batch->next = ordered;
+                ordered = batch;
+                batch = next;
+            }
+
+            buf.clear();
+            {
+                std::lock_guard<std::mutex> lck(file_mtx);
+                for (auto e = ordered; e != nullptr; e = e->next) {
+                    if (e->rewrite_start) {
+                        rewrite_buffering = true;
+                        marker_cv.notify_all();
+                        continue;
+                    }
+                    buf += e->line;
+                    if (rewrite_buffering) {
+                        rewrite_buf += e->line;
+                    }
+                }
+                writeAll(fd, buf);
+            }
+            file_size += buf.size();
+            dirty = true;
+            if (fsync_policy == AOF_FSYNC_ALWAYS
+                || (fsync_policy == AOF_FSYNC_EVERYSEC && std::chrono::steady_clock::now() - last_sync >= interval)) {
+                sync();
+                dirty = false;
+                last_sync = std::chrono::steady_clock::now();
+            }
+
+            for (auto e = ordered; e != nullptr;) {
+                auto next = e->next;
+                if (fsync_policy == AOF_FSYNC_ALWAYS && !e->line.empty()) {
+                    // owned by the command waiting for it, which may free it as soon as it is marked
+                    e->durable.store(true, std::memory_order_release);
+                } else {
+                    delete e;
+                }
+                e = next;
+            }
+            if (fsync_policy == AOF_FSYNC_ALWAYS) {
+                synced_batches.fetch_add(1, std::memory_order_release);
+                synced_batches.notify_all();
+            }
+        }
+
+        if (dirty && fsync_policy != AOF_FSYNC_NO) {
+            sync();
+        }
+    }
+
+    void push(entry *e) {
+        e->next = pending.load(std::memory_order_relaxed);
+        while (!pending.compare_exchange_weak(e->next, e, std::memory_order_release, std::memory_order_relaxed)) {}
+        // the writer only sleeps on an empty stack
+        if (e->next == nullptr) {
+            pending.notify_one();
+        }
+    }
+
+    /* Write commands rebuilding every live key of db to of, one command per value chunk plus one per expiry
+     * Precondition:
+     * - run in a process forked while holding locks on every shard
+     * */
+    static void writeRewrite(std::ofstream &of, ldsDb &db) {
+        std::string out;
+        std::vector<std::string> items;
+        std::vector<std::string_view> args;
+        db.forEachKey([&](const ldsString &key, const ldsKey &entry) {
+            auto &val = entry.val;
+            out.clear();
+            if (val.type() == STRING_T) {
+                std::string_view kv[] = {key, std::get<STRING_T>(val.data)};
+                formatWords(out, "set", kv);
+            } else {
+                const char *cmd = val.type() == LIST_T ? "rpush" : "sadd";
+                auto flush = [&] {
+                    args.assign({key});
+                    args.insert(args.end(), items.begin(), items.end());
+                    formatWords(out, cmd, args);
+                    items.clear();
+                };
+                auto emit = [&](std::string_view member) {
+                    items.emplace_back(member);
+                    if (items.size() == AOF_REWRITE_ITEMS_PER_CMD) {
+                        flush();
+                    }
+                };
+                if (val.type() == LIST_T) {
+                    std::get<LIST_T>(val.data).forEach(emit);
+                } else {
+                    std::get<SET_T>(val.data).forEach(emit);
+                }
+                if (!items.empty()) {
+                    flush();
+                }
+            }
+            if (entry.ttl.has_value()) {
+                auto deadline = std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(
+                        entry.ttl.value().time_since_epoch()).count());
+                std::string_view kd[] = {key, deadline};
+                formatWords(out, "pexpireat", kd);
+            }
+            of << out;
+        });
+    }
+
+    /* Wait for the rewriting child, then append the commands buffered meanwhile and swap the new file in */
+    void finishRewrite(pid_t pid, const std::string &tmp_filename) {
+        int status;
+        waitpid(pid, &status, 0);
+        bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+        std::unique_lock<std::mutex> lck(file_mtx);
+        // commands queued before the marker are in the new file already, they must have gone to the old one
+        marker_cv.wait(lck, [this] { return rewrite_buffering; });
+        int new_fd = -1;
+        if (ok) {
+            new_fd = open(tmp_filename.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+            ok = new_fd >= 0 && writeAll(new_fd, rewrite_buf) && fdatasync(new_fd) == 0
+                 && rename(tmp_filename.c_str(), filename.c_str()) == 0;
+        }
+        if (ok) {
+            close(fd);
+            fd = new_fd;
+            struct stat st{};
+            fstat(fd, &st);
+            file_size = st.st_size;
+            base_size = st.st_size;
+            LOG_INFO("[AOF] Rewrite done, new size " + std::to_string(st.st_size) + " bytes");
+        } else {
+            if (new_fd >= 0) {
+                close(new_fd);
+            }
+            remove(tmp_filename.c_str());
+            LOG_ERROR("[AOF] Rewrite failed");
+        }
+        rewrite_buf.clear();
+        rewrite_buf.shrink_to_fit();
+        rewrite_buffering = false;
+        rewriting = false;
+    }
+
+public:
+    ldsAof(const std::string &filename, unsigned fsync_policy) : filename(filename), fsync_policy(fsync_policy) {
+        fd = open(filename.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("Cannot open append-only file " + filename + ": " + strerror(errno));
+        }
+        struct stat st{};
+        fstat(fd, &st);
+        file_size = st.st_size;
+        base_size = st.st_size;
+        writer = std::thread(&ldsAof::writerLoop, this);
+    }
+
+    ldsAof(const ldsAof &) = delete;
+
+    ldsAof &operator=(const ldsAof &) = delete;
+
+    ~ldsAof() {
+        stopping.store(true);
+        // wake the writer with an empty entry
+        push(new entry{});
+        writer.join();
+        if (rewriter.joinable()) {
+            rewriter.join();
+        }
+        close(fd);
+    }
+
+    /* Queue a write command, called while the command holds its exclusive shard lock. Never blocks */
+    void append(const ldsCmd &cmd) {
+        auto e = new entry{nullptr, formatCmd(cmd)};
+        push(e);
+        if (fsync_policy == AOF_FSYNC_ALWAYS) {
+            unsynced.push_back(e);
+        }
+    }
+
+    /* Start compacting the file into the minimal commands rebuilding the current db.
+     * A child forked while every shard is held writes them to a temporary file. Commands appended meanwhile
+     * are buffered, then added to the new file, which atomically replaces the old one.
+     * Return false if a rewrite is already running or the fork failed.
+     * */
+    bool rewriteInBackground(ldsDb &db) {
+        if (rewriting.exchange(true)) {
+            return false;
+        }
+        if (rewriter.joinable()) {
+            rewriter.join();
+        }
+
+        std::string tmp_filename = filename + ".rewrite." + std::to_string(getpid());
+        pid_t pid;
+        {
+            auto locks = db.lockAll(false);
+            // no write command runs while every shard is held, so the marker splits them exactly at the fork
+            auto marker = new entry{};
+            marker->rewrite_start = true;
+            push(marker);
+            pid = fork();
+        }
+        if (pid < 0) {
+            LOG_ERROR("[AOF] fork failed: " + std::string(strerror(errno)));
+            std::unique_lock<std::mutex> lck(file_mtx);
+            marker_cv.wait(lck, [this] { return rewrite_buffering; });
+            rewrite_buf.clear();
+            rewrite_buffering = false;
+            rewriting = false;
+            return false;
+        }
+
+        if (pid == 0) {
+            std::ofstream of(tmp_filename, std::ios::out | std::ios::binary | std::ios::trunc);
+            if (!of.is_open()) _exit(1);
+            writeRewrite(of, db);
+            of.flush();
+            if (!of.good()) _exit(1);
+            of.close();
+            int tmp_fd = open(tmp_filename.c_str(), O_WRONLY | O_CLOEXEC);
+            _exit(tmp_fd >= 0 && fsync(tmp_fd) == 0 ? 0 : 1);
+        }
+
+        LOG_INFO("[AOF] Rewrite started by child " + std::to_string(pid));
+        rewriter = std::thread(&ldsAof::finishRewrite, this, pid, tmp_filename);
+        return true;
+    }
+
+    /* Wait for a running rewrite to finish and install its file
+     * Precondition:
+     * - no other thread starts a rewrite meanwhile
+     * */
+    void waitRewrite() {
+        if (rewriter.joinable()) {
+            rewriter.join();
+        }
+    }
+
+    bool rewriteInProgress() const {
+        return rewriting.load();
+    }
+
+    size_t size() const {
+        return file_size.load(std::memory_order_relaxed);
+    }
+
+    /* Check if the file has grown enough since the last rewrite to be rewritten automatically */
+    bool shouldRewrite() const {
+        if (rewriting.load(std::memory_order_relaxed)) {
+            return false;
+        }
+        size_t size = file_size.load(std::memory_order_relaxed);
+        size_t base = base_size.load(std::memory_order_relaxed);
+        return size >= AOF_REWRITE_MIN_SIZE && size >= base + base * AOF_REWRITE_PERCENTAGE / 100;
+    }
+
+    /* With AOF_FSYNC_ALWAYS, wait until every command appended by the current thread is on disk.
+     * Must not be called while holding a shard lock.
+     * */
+    void waitDurable() {
+        if (unsynced.empty()) {
+            return;
+        }
+        // entries of one thread are drained in order, so the last one is durable only after all others
+        auto last = unsynced.back();
+        while (!last->durable.load(std::memory_order_acquire)) {
+            auto seen = synced_batches.load(std::memory_order_acquire);
+            if (last->durable.load(std::memory_order_acquire)) {
+                break;
+            }
+            synced_batches.wait(seen, std::memory_order_acquire);
+        }
+        for (auto e: unsynced) {
+            delete e;
+        }
+        unsynced.clear();
+    }
+
+    /* Replay an append-only file into db, return the number of commands replayed.
+     * A final line cut short by a crash is dropped from the file.
+     * Throw std::runtime_error naming the file and offset if a command is malformed or the file cannot be cut.
+     * */
+    static size_t load(const std::string &filename, ldsDb &db) {
+        std::ifstream ifile(filename, std::ios::in | std::ios::binary);
+        if (!ifile.is_open()) {
+            return 0;
+        }
+
+        size_t replayed = 0;
+        size_t good_size = 0;
+        std::string line;
+        std::vector<std::string> words;
+        while (std::getline(ifile, line)) {
+            size_t size = line.size() + 1;
+            bool complete = !ifile.eof();
+            words.clear();
+            if (complete && !line.empty() && line[0] == '*') {
+                try {
+                    complete = readMultibulk(ifile, line, words, size);
+                } catch (const std::exception &e) {
+                    throw std::runtime_error("Corrupted command at offset " + std::to_string(good_size)
+                                             + " of append-only file " + filename + ": " + e.what());
+                }
+            }
+            if (!complete) {
+                LOG_WARNING("[AOF] Dropping truncated command at the end of " + filename);
+                ifile.close();
+                if (truncate(filename.c_str(), (off_t) good_size) != 0) {
+                    throw std::runtime_error("Cannot truncate append-only file " + filename + " at offset "
+                                             + std::to_string(good_size) + ": " + std::strerror(errno));
+                }
+                break;
+            }
+            good_size += size;
+            if (line.empty()) {
+                continue;
+            }
+            ldsRet ret;
+            try {
+                if (words.empty()) {
+                    db.execute(parseCmd(line), ret);
+                } else {
+                    std::vector<std::string_view> views{words.begin(), words.end()};
+                    db.execute(makeCmd(views), ret);
+                }
+            } catch (const std::exception &e) {
+                // commands are logged before they run and invalid ones as given, so one that failed then fails now too
+                LOG_DEBUG("[AOF] Replayed command \"" + line + "\" failed: " + e.what());
+            }
+            replayed++;
+        }
+        LOG_INFO("[AOF] Replayed " + std::to_string(replayed) + " commands from " + filename);
+        return replayed;
+    }
+};
@@ -1,7 +1,15 @@
 #pragma once
 
 #include <string>
-#include <cstring>
+#include <string_view>
+#include <array>
+#include <vector>
+#include <span>
+#include <cstdint>
+#include <charconv>
+#include <stdexcept>
+
+#include "ldsReply.h"
 
 #define CMD_SSET 0
 #define CMD_SGET 1
@@ -24,102 +32,412 @@
 #define CMD_EXIT 18
 #define CMD_SNAPSHOT 19
 #define CMD_RESTORE 20
+#define CMD_GPEXPIRE 21
+#define CMD_GPTTL 22
+#define CMD_LINDEX 23
+#define CMD_LSET 24
+#define CMD_LTRIM 25
+#define CMD_SISMEMBER 26
+#define CMD_SINTERSTORE 27
+#define CMD_SUNION 28
+#define CMD_SUNIONSTORE 29
+#define CMD_SDIFF 30
+#define CMD_SDIFFSTORE 31
+#define CMD_GPEXPIREAT 32
+#define CMD_BGREWRITEAOF 33
+#define CMD_BGSAVE 34
+#define CMD_LASTSAVE 35
+#define CMD_INFO 36
+#define CMD_OBJECT 37
+#define CMD_SLOWLOG 38
+#define CMD_SCAN 39
+#define CMD_SSCAN 40
+
+// Command flags
+#define CMDF_WRITE 1        // modifies the keyspace
+#define CMDF_READONLY 2     // only reads the keyspace
+#define CMDF_SINGLE_KEY 4   // touches only the key given as first argument
+#define CMDF_DENYOOM 8      // may grow memory, refused when over maxmemory and nothing can be evicted
+
+class ldsDb;
+
+struct ldsCmd;
+
+typedef void (*ldsHandler)(ldsDb &, const ldsCmd &, ldsRet &);
+
+struct ldsCmdSpec {
+    std::string_view name;
+    unsigned short cmd;
+    // exact number of arguments if >= 0, minimum number of arguments -arity otherwise
+    int arity;
+    unsigned flags;
+    // nullptr for commands executed by dbGate instead of ldsDb
+    ldsHandler handler;
+};
+
+#define CMD_INLINE_ARGS 8
+
+/* Arguments of a command, as views into the text they were parsed from.
+ * Up to CMD_INLINE_ARGS arguments are stored inline, without allocating.
+ * */
+class ldsArgs {
+private:
+    std::array<std::string_view, CMD_INLINE_ARGS> small{};
+    std::vector<std::string_view> large;
+    size_t count = 0;
+
+public:
+    void push_back(std::string_view arg) {
+        if (count < CMD_INLINE_ARGS) {
+            small[count++] = arg;
+            return;
+        }
+        if (count == CMD_INLINE_ARGS) {
+            large.assign(small.begin(), small.end());
+        }
+        large.push_back(arg);
+        count++;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    bool empty() const {
+        return count == 0;
+    }
+
+    const std::string_view *data() const {
+        return count <= CMD_INLINE_ARGS ? small.data() : large.data();
+    }
+
+    const std::string_view &operator[](size_t i) const {
+        return data()[i];
+    }
 
+    const std::string_view *begin() const {
+        return data();
+    }
+
+    const std::string_view *end() const {
+        return data() + count;
+    }
+
+    /* Arguments from index first on */
+    std::span<const std::string_view> from(size_t first) const {
+        return {data() + first, count - first};
+    }
+};
+
+/* A parsed command. args and argv point into the text the command was parsed from,
+ * which must outlive the command.
+ * */
 struct ldsCmd {
     unsigned short cmd;
-    char *args;
+    const ldsCmdSpec *spec;
+    // raw argument text, without the command name, empty for commands built from separate words
+    std::string_view args;
+    ldsArgs argv;
 };
 
-#define RET_STR 0
-#define RET_INT 1
-#define RET_LIST 2
-#define RET_BOOL 3
-#define RET_OK 4
-#define RET_ERR 5
-#define RET_UNKNOWN 6
-
-struct ldsRet {
-    void *ptr;
-    unsigned short type;
+void handleKeys(ldsDb &, const ldsCmd &, ldsRet &);
+
+void handleScan(ldsDb &, const ldsCmd &, ldsRet &);
+
+void handleDel(ldsDb &, const ldsCmd &, ldsRet &);
+
+void handleFlushdb(ldsDb &, const ldsCmd &, ldsRet &);
+
+void handleTtl(ldsDb &, const ldsCmd &, ldsRet &);
+
+void handlePttl(ldsDb &, const ldsCmd &, ldsRet &);
+
+void handleExpire(ldsDb &, const ldsCmd &, ldsRet &);
+
+void handlePexpire(ldsDb &, const ldsCmd &, ldsRet &);
+
+void handlePexpireat(ldsDb &, const ldsCmd &, ldsRet &);
+
+void handleObject(ldsDb &, const ldsCmd &, ldsRet &);
+
+void handleGet(ldsDb &, const ldsCmd &, ldsRet &);
+
+void handleSet(ldsDb &, const ldsCmd &, ldsRet &);
+
+void handleLlen(ldsDb &, const ldsCmd &, ldsRet &);
+
+void handlePush(ldsDb &, const ldsCmd &, ldsRet &);
+
+void handlePop(ldsDb &, const ldsCmd &, ldsRet &);
+
+void handleLrange(ldsDb &, const ldsCmd &, ldsRet &);
+
+void handleLindex(ldsDb &, const ldsCmd &, ldsRet &);
+
+void handleLset(ldsDb &, const ldsCmd &, ldsRet &);
+
+void handleLtrim(ldsDb &, const ldsCmd &, ldsRet &);
+
+void handleSadd(ldsDb &, const ldsCmd &, ldsRet &);
+
+void handleSrem(ldsDb &, const ldsCmd &, ldsRet &);
+
+void handleScard(ldsDb &, const ldsCmd &, ldsRet &);
+
+void handleSmembers(ldsDb &, const ldsCmd &, ldsRet &);
+
+void handleSscan(ldsDb &, const ldsCmd &, ldsRet &);
+
+void handleSismember(ldsDb &, const ldsCmd &, ldsRet &);
+
+void handleSetOp(ldsDb &, const ldsCmd &, ldsRet &);
+
+void handleSetOpStore(ldsDb &, const ldsCmd &, ldsRet &);
+
+constexpr ldsCmdSpec CMD_TABLE[] = {
+        {"set",          CMD_SSET,         2,  CMDF_WRITE | CMDF_DENYOOM | CMDF_SINGLE_KEY, handleSet},
+        {"get",          CMD_SGET,         1,  CMDF_READONLY | CMDF_SINGLE_KEY,             handleGet},
+        {"llen",         CMD_LLEN,         1,  CMDF_READONLY | CMDF_SINGLE_KEY,             handleLlen},
+        {"lpush",        CMD_LPUSH,        -2, CMDF_WRITE | CMDF_DENYOOM | CMDF_SINGLE_KEY, handlePush},
+        {"rpush",        CMD_RPUSH,        -2, CMDF_WRITE | CMDF_DENYOOM | CMDF_SINGLE_KEY, handlePush},
+        {"lpop",         CMD_LPOP,         1,  CMDF_WRITE | CMDF_SINGLE_KEY,                handlePop},
+        {"rpop",         CMD_RPOP,         1,  CMDF_WRITE | CMDF_SINGLE_KEY,                handlePop},
+        {"lrange",       CMD_LRANGE,       3,  CMDF_READONLY | CMDF_SINGLE_KEY,             handleLrange},
+        {"sadd",         CMD_SADD,         -2, CMDF_WRITE | CMDF_DENYOOM | CMDF_SINGLE_KEY, handleSadd},
+        {"srem",         CMD_SREM,         -2, CMDF_WRITE | CMDF_SINGLE_KEY,                handleSrem},
+        {"smembers",     CMD_SMEMBERS,     1,  CMDF_READONLY | CMDF_SINGLE_KEY,             handleSmembers},
+        {"sinter",       CMD_SINTER,       -2, CMDF_READONLY,                               handleSetOp},
+        {"scard",        CMD_SCARD,        1,  CMDF_READONLY | CMDF_SINGLE_KEY,             handleScard},
+        {"del",          CMD_GDEL,         1,  CMDF_WRITE | CMDF_SINGLE_KEY,                handleDel},
+        {"expire",       CMD_GEXPIRE,      2,  CMDF_WRITE | CMDF_SINGLE_KEY,                handleExpire},
+        {"ttl",          CMD_GTTL,         1,  CMDF_READONLY | CMDF_SINGLE_KEY,             handleTtl},
+        {"keys",         CMD_GKEYS,        0,  CMDF_READONLY,                               handleKeys},
+        {"flushdb",      CMD_GFLUSHDB,     0,  CMDF_WRITE,                                  handleFlushdb},
+        {"exit",         CMD_EXIT,         0,  0,                                           nullptr},
+        {"save",         CMD_SNAPSHOT,     0,  0,                                           nullptr},
+        {"restore",      CMD_RESTORE,      0,  0,                                           nullptr},
+        {"pexpire",      CMD_GPEXPIRE,     2,  CMDF_WRITE | CMDF_SINGLE_KEY,                handlePexpire},
+        {"pttl",         CMD_GPTTL,        1,  CMDF_READONLY | CMDF_SINGLE_KEY,             handlePttl},
+        {"lindex",       CMD_LINDEX,       2,  CMDF_READONLY | CMDF_SINGLE_KEY,             handleLindex},
+        {"lset",         CMD_LSET,         3,  CMDF_WRITE | CMDF_DENYOOM | CMDF_SINGLE_KEY, handleLset},
+        {"ltrim",        CMD_LTRIM,        3,  CMDF_WRITE | CMDF_SINGLE_KEY,                handleLtrim},
+        {"sismember",    CMD_SISMEMBER,    2,  CMDF_READONLY | CMDF_SINGLE_KEY,             handleSismember},
+        {"sinterstore",  CMD_SINTERSTORE,  -2, CMDF_WRITE | CMDF_DENYOOM,                   handleSetOpStore},
+        {"sunion",       CMD_SUNION,       -1, CMDF_READONLY,                               handleSetOp},
+        {"sunionstore",  CMD_SUNIONSTORE,  -2, CMDF_WRITE | CMDF_DENYOOM,                   handleSetOpStore},
+        {"sdiff",        CMD_SDIFF,        -1, CMDF_READONLY,                               handleSetOp},
+        {"sdiffstore",   CMD_SDIFFSTORE,   -2, CMDF_WRITE | CMDF_DENYOOM,                   handleSetOpStore},
+        {"pexpireat",    CMD_GPEXPIREAT,   2,  CMDF_WRITE | CMDF_SINGLE_KEY,                handlePexpireat},
+        {"bgrewriteaof", CMD_BGREWRITEAOF, 0,  0,                                           nullptr},
+        {"bgsave",       CMD_BGSAVE,       0,  0,                                           nullptr},
+        {"lastsave",     CMD_LASTSAVE,     0,  0,                                           nullptr},
+        {"info",         CMD_INFO,         0,  0,                                           nullptr},
+        {"object",       CMD_OBJECT,       2,  CMDF_READONLY,                               handleObject},
+        {"slowlog",      CMD_SLOWLOG,      -1, 0,                                           nullptr},
+        {"scan",         CMD_SCAN,         -1, CMDF_READONLY,                               handleScan},
+        {"sscan",        CMD_SSCAN,        -2, CMDF_READONLY | CMDF_SINGLE_KEY,             handleSscan},
 };
 
+constexpr size_t CMD_COUNT = sizeof(CMD_TABLE) / sizeof(CMD_TABLE[0]);
+
+// Number of slots of the command hash table, must be a power of two
+#define CMD_SLOTS 256
+
+constexpr char asciiLower(char c) {
+    return c >= 'A' && c <= 'Z' ? (char) (c - 'A' + 'a') : c;
+}
+
+/* Case-insensitive FNV-1a hash of a command name */
+constexpr uint32_t cmdHash(std::string_view name, uint32_t seed) {
+    uint32_t h = 2166136261u ^ seed;
+    for (auto c: name) {
+        h = (h ^ (unsigned char) asciiLower(c)) * 16777619u;
+    }
+    return h;
+}
+
+/* Find the first seed for which every command name hashes to a distinct slot */
+constexpr uint32_t findCmdSeed() {
+    for (uint32_t seed = 0;; seed++) {
+        std::array<bool, CMD_SLOTS> used{};
+        bool ok = true;
+        for (auto &spec: CMD_TABLE) {
+            auto slot = cmdHash(spec.name, seed) & (CMD_SLOTS - 1);
+            if (used[slot]) {
+                ok = false;
+                break;
+            }
+            used[slot] = true;
+        }
+        if (ok) {
+            return seed;
+        }
+    }
+}
+
+constexpr uint32_t CMD_SEED = findCmdSeed();
+
+constexpr std::array<short, CMD_SLOTS> buildCmdSlots() {
+    std::array<short, CMD_SLOTS> slots{};
+    for (auto &slot: slots) {
+        slot = -1;
+    }
+    for (size_t i = 0; i < CMD_COUNT; i++) {
+        slots[cmdHash(CMD_TABLE[i].name, CMD_SEED) & (CMD_SLOTS - 1)] = (short) i;
+    }
+    return slots;
+}
+
+// Perfect hash of command names to indices in CMD_TABLE
+constexpr std::array<short, CMD_SLOTS> CMD_SLOT_TABLE = buildCmdSlots();
+
+constexpr std::array<const ldsCmdSpec *, CMD_COUNT> buildCmdIds() {
+    std::array<const ldsCmdSpec *, CMD_COUNT> ids{};
+    for (auto &spec: CMD_TABLE) {
+        ids[spec.cmd] = &spec;
+    }
+    return ids;
+}
+
+// Command specs indexed by command id
+constexpr std::array<const ldsCmdSpec *, CMD_COUNT> CMD_BY_ID = buildCmdIds();
+
+/* Look up a command by name, case-insensitively. Return nullptr if there is no such command */
+constexpr const ldsCmdSpec *lookupCmd(std::string_view name) {
+    auto idx = CMD_SLOT_TABLE[cmdHash(name, CMD_SEED) & (CMD_SLOTS - 1)];
+    if (idx < 0) {
+        return nullptr;
+    }
+    auto &spec = CMD_TABLE[idx];
+    if (spec.name.size() != name.size()) {
+        return nullptr;
+    }
+    for (size_t i = 0; i < name.size(); i++) {
+        if (asciiLower(name[i]) != spec.name[i]) {
+            return nullptr;
+        }
+    }
+    return &spec;
+}
+
+static_assert(lookupCmd("GET") != nullptr && lookupCmd("GET")->cmd == CMD_SGET);
+static_assert(lookupCmd("sinter") != nullptr && lookupCmd("sinter")->cmd == CMD_SINTER);
+static_assert(lookupCmd("gets") == nullptr);
 
-ldsCmd parseCmd(const std::string &line) {
-    // split line into command and arguments
-    std::istringstream iss{line};
-    std::string cmd;
-    iss >> cmd;
-    std::string args;
-    std::getline(iss, args);
-
-    // convert command to lowercase
-    for (auto &c: cmd) {
-        c = std::tolower(c);
-    }
-
-    // parse command
-    ldsCmd lds_cmd{};
-    if (cmd == "set")
-        lds_cmd.cmd = CMD_SSET;
-    else if (cmd == "get")
-        lds_cmd.cmd = CMD_SGET;
-    else if (cmd == "llen")
-        lds_cmd.cmd = CMD_LLEN;
-    else if (cmd == "lpush")
-        lds_cmd.cmd = CMD_LPUSH;
-    else if (cmd == "rpush")
-        lds_cmd.cmd = CMD_RPUSH;
-    else if (cmd == "lpop")
-        lds_cmd.cmd = CMD_LPOP;
-    else if (cmd == "rpop")
-        lds_cmd.cmd = CMD_RPOP;
-    else if (cmd == "lrange")
-        lds_cmd.cmd = CMD_LRANGE;
-    else if (cmd == "sadd")
-        lds_cmd.cmd = CMD_SADD;
-    else if (cmd == "srem")
-        lds_cmd.cmd = CMD_SREM;
-    else if (cmd == "smembers")
-        lds_cmd.cmd = CMD_SMEMBERS;
-    else if (cmd == "sinter")
-        lds_cmd.cmd = CMD_SINTER;
-    else if (cmd == "scard")
-        lds_cmd.cmd = CMD_SCARD;
-    else if (cmd == "del")
-        lds_cmd.cmd = CMD_GDEL;
-    else if (cmd == "expire")
-        lds_cmd.cmd = CMD_GEXPIRE;
-    else if (cmd == "ttl")
-        lds_cmd.cmd = CMD_GTTL;
-    else if (cmd == "keys")
-        lds_cmd.cmd = CMD_GKEYS;
-    else if (cmd == "flushdb")
-        lds_cmd.cmd = CMD_GFLUSHDB;
-    else if (cmd == "exit")
-        lds_cmd.cmd = CMD_EXIT;
-    else if (cmd == "save")
-        lds_cmd.cmd = CMD_SNAPSHOT;
-    else if (cmd == "restore")
-        lds_cmd.cmd = CMD_RESTORE;
-    else
+inline bool isSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+/* Split text into whitespace-separated tokens, without copying */
+inline void tokenize(std::string_view text, ldsArgs &out) {
+    size_t i = 0;
+    while (true) {
+        while (i < text.size() && isSpace(text[i])) {
+            i++;
+        }
+        if (i == text.size()) {
+            return;
+        }
+        size_t start = i;
+        while (i < text.size() && !isSpace(text[i])) {
+            i++;
+        }
+        out.push_back(text.substr(start, i - start));
+    }
+}
+
+/* Find a command by name, throw if there is none */
+inline const ldsCmdSpec &findCmd(std::string_view name) {
+    auto spec = lookupCmd(name);
+    if (spec == nullptr) {
+        std::string cmd{name};
+        for (auto &c: cmd) {
+            c = asciiLower(c);
+        }
         throw std::runtime_error("Unknown command: " + cmd);
+    }
+    return *spec;
+}
+
+inline void checkArity(const ldsCmdSpec &spec, const ldsArgs &argv) {
+    auto argc = (int) argv.size();
+    if (spec.arity >= 0 ? argc != spec.arity : argc < -spec.arity) {
+        std::string name{spec.name};
+        for (auto &c: name) {
+            c = std::toupper(c);
+        }
+        throw std::runtime_error("Invalid number of arguments for " + name + " command");
+    }
+}
 
-    lds_cmd.args = strdup(args.c_str());
+/* Build a command from its id and argument text, checking the number of arguments */
+inline ldsCmd makeCmd(const ldsCmdSpec &spec, std::string_view args) {
+    ldsCmd lds_cmd{spec.cmd, &spec, args, {}};
+    tokenize(args, lds_cmd.argv);
+    checkArity(spec, lds_cmd.argv);
     return lds_cmd;
 }
 
-std::vector<std::string> parseArgs(char *args) {
-    if (args == nullptr) {
-        return {};
+/* Build a command from separate words, the command name first.
+ * Unlike text commands, arguments may be empty and hold any bytes, including whitespace.
+ * */
+inline ldsCmd makeCmd(std::span<const std::string_view> words) {
+    if (words.empty()) {
+        throw std::runtime_error("Empty command");
     }
-    auto arg_str = std::string{args};
+    auto &spec = findCmd(words[0]);
+    ldsCmd lds_cmd{spec.cmd, &spec, {}, {}};
+    for (auto &word: words.subspan(1)) {
+        lds_cmd.argv.push_back(word);
+    }
+    checkArity(spec, lds_cmd.argv);
+    return lds_cmd;
+}
+
+ldsCmd parseCmd(std::string_view line) {
+    size_t i = 0;
+    while (i < line.size() && isSpace(line[i])) {
+        i++;
+    }
+    size_t start = i;
+    while (i < line.size() && !isSpace(line[i])) {
+        i++;
+    }
+    auto name = line.substr(start, i - start);
+    while (i < line.size() && isSpace(line[i])) {
+        i++;
+    }
+    return makeCmd(findCmd(name), line.substr(i));
+}
+
+/* Arguments of a command joined with spaces, cut after max bytes */
+inline std::string formatArgs(const ldsCmd &cmd, size_t max = SIZE_MAX) {
+    std::string ret;
+    size_t total = 0;
+    for (size_t i = 0; i < cmd.argv.size(); i++) {
+        if (i > 0) {
+            if (ret.size() < max) {
+                ret += ' ';
+            }
+            total++;
+        }
+        if (ret.size() < max) {
+            ret += cmd.argv[i].substr(0, max - ret.size());
+        }
+        total += cmd.argv[i].size();
+    }
+    if (total > ret.size()) {
+        ret += "... (" + std::to_string(total - ret.size()) + " more bytes)";
+    }
+    return ret;
+}
 
-    // arguments are separated by spaces
-    std::istringstream iss{arg_str};
-    std::vector<std::string> parsed_args;
-    std::string arg;
-    while (iss >> arg) {
-        parsed_args.push_back(arg);
+/* Parse a whole-string integer argument */
+long long parseInt(std::string_view arg) {
+    long long val;
+    auto res = std::from_chars(arg.data(), arg.data() + arg.size(), val);
+    if (res.ec != std::errc{} || res.ptr != arg.data() + arg.size()) {
+        throw std::runtime_error("Invalid integer argument: " + std::string(arg));
     }
-    return parsed_args;
+    return val;
 }
@@ -0,0 +1,210 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <stdexcept>
+#include <vector>
+#include <utility>
+#include <charconv>
+#include <climits>
+#include <algorithm>
+#include <iterator>
+
+#include "logger.h"
+
+#define AOF_FSYNC_ALWAYS 0
+#define AOF_FSYNC_EVERYSEC 1
+#define AOF_FSYNC_NO 2
+
+#define SNAPSHOT_LOAD_NO 0
+#define SNAPSHOT_LOAD_YES 1
+#define SNAPSHOT_LOAD_ASYNC 2
+
+#define MAXMEMORY_NOEVICTION 0
+#define MAXMEMORY_ALLKEYS_LRU 1
+#define MAXMEMORY_VOLATILE_LRU 2
+#define MAXMEMORY_VOLATILE_TTL 3
+#define MAXMEMORY_ALLKEYS_LFU 4
+#define MAXMEMORY_VOLATILE_LFU 5
+
+// Names of the eviction policies, indexed by id
+constexpr std::string_view MAXMEMORY_POLICY_NAMES[] = {"noeviction", "allkeys-lru", "volatile-lru", "volatile-ttl",
+                                                       "allkeys-lfu", "volatile-lfu"};
+
+// Default slow log threshold in microseconds, and number of entries kept
+#define SLOWLOG_LOG_SLOWER_THAN 10000
+#define SLOWLOG_MAX_LEN 128
+
+// Default LFU tuning: the higher the log factor, the more accesses a counter increment takes,
+// and the decay time in minutes per decrement of an idle counter
+#define LFU_LOG_FACTOR 10
+#define LFU_DECAY_TIME 1
+
+// Names of the log levels, indexed by id
+constexpr std::string_view LOG_LEVEL_NAMES[] = {"debug", "info", "warning", "error"};
+
+/* Server settings, given on the command line as --name value */
+struct ldsConfig {
+    // log every write command to an append-only file and replay it at startup
+    bool appendonly = false;
+    std::string appendfilename = "ledis.aof";
+    unsigned appendfsync = AOF_FSYNC_EVERYSEC;
+    // automatic background saves: save after (seconds, changes) if at least changes writes happened in seconds
+    std::vector<std::pair<long long, long long>> save;
+    // load the snapshot file at startup when the append-only file is off,
+    // async serves requests while loading, blocking only those touching shards not loaded yet
+    unsigned loadsnapshot = SNAPSHOT_LOAD_NO;
+    // memory limit in bytes, 0 for none; past it keys are evicted by maxmemory_policy before writes
+    long long maxmemory = 0;
+    unsigned maxmemory_policy = MAXMEMORY_NOEVICTION;
+    // number of keys sampled to pick each key to evict
+    long long maxmemory_samples = 5;
+    long long lfu_log_factor = LFU_LOG_FACTOR;
+    long long lfu_decay_time = LFU_DECAY_TIME;
+    // least severe messages logged, those below the build's LEDIS_LOG_LEVEL are never logged
+    unsigned loglevel = LOG_LEVEL_INFO;
+    // commands taking at least this many microseconds are kept in the slow log, which holds at most slowlog_max_len
+    long long slowlog_log_slower_than = SLOWLOG_LOG_SLOWER_THAN;
+    long long slowlog_max_len = SLOWLOG_MAX_LEN;
+
+    static ldsConfig fromArgs(int argc, char **argv) {
+        ldsConfig config;
+        for (int i = 1; i < argc; i += 2) {
+            std::string_view name = argv[i];
+            if (i + 1 >= argc) {
+                throw std::runtime_error("Missing value for option " + std::string(name));
+            }
+            std::string_view val = argv[i + 1];
+            config.set(name.substr(0, 2) == "--" ? name.substr(2) : name, val);
+        }
+        return config;
+    }
+
+    void set(std::string_view name, std::string_view val) {
+        if (name == "appendonly") {
+            appendonly = parseBool(name, val);
+        } else if (name == "appendfilename") {
+            appendfilename = val;
+        } else if (name == "appendfsync") {
+            if (val == "always") {
+                appendfsync = AOF_FSYNC_ALWAYS;
+            } else if (val == "everysec") {
+                appendfsync = AOF_FSYNC_EVERYSEC;
+            } else if (val == "no") {
+                appendfsync = AOF_FSYNC_NO;
+            } else {
+                throw std::runtime_error("Invalid value for appendfsync: " + std::string(val));
+            }
+        } else if (name == "loadsnapshot") {
+            if (val == "yes") {
+                loadsnapshot = SNAPSHOT_LOAD_YES;
+            } else if (val == "no") {
+                loadsnapshot = SNAPSHOT_LOAD_NO;
+            } else if (val == "async") {
+                loadsnapshot = SNAPSHOT_LOAD_ASYNC;
+            } else {
+                throw std::runtime_error("Invalid value for loadsnapshot: " + std::string(val));
+            }
+        } else if (name == "maxmemory") {
+            maxmemory = parseMemory(name, val);
+        } else if (name == "maxmemory-policy") {
+            auto it = std::find(std::begin(MAXMEMORY_POLICY_NAMES), std::end(MAXMEMORY_POLICY_NAMES), val);
+            if (it == std::end(MAXMEMORY_POLICY_NAMES)) {
+                throw std::runtime_error("Invalid value for maxmemory-policy: " + std::string(val));
+            }
+            maxmemory_policy = it - std::begin(MAXMEMORY_POLICY_NAMES);
+        } else if (name == "maxmemory-samples") {
+            maxmemory_samples = parseCount(name, val);
+            if (maxmemory_samples == 0) {
+                throw std::runtime_error("Invalid value for maxmemory-samples: " + std::string(val));
+            }
+        } else if (name == "lfu-log-factor") {
+            lfu_log_factor = parseCount(name, val);
+        } else if (name == "lfu-decay-time") {
+            lfu_decay_time = parseCount(name, val);
+        } else if (name == "loglevel") {
+            auto it = std::find(std::begin(LOG_LEVEL_NAMES), std::end(LOG_LEVEL_NAMES), val);
+            if (it == std::end(LOG_LEVEL_NAMES)) {
+                throw std::runtime_error("Invalid value for loglevel: " + std::string(val));
+            }
+            loglevel = it - std::begin(LOG_LEVEL_NAMES);
+        } else if (name == "slowlog-log-slower-than") {
+            slowlog_log_slower_than = parseCount(name, val);
+        } else if (name == "slowlog-max-len") {
+            slowlog_max_len = parseCount(name, val);
+        } else if (name == "save") {
+            save = parseSaveRules(val);
+        } else {
+            throw std::runtime_error("Unknown option: " + std::string(name));
+        }
+    }
+
+private:
+    /* Parse "seconds changes [seconds changes ...]", an empty value disables automatic saves */
+    static std::vector<std::pair<long long, long long>> parseSaveRules(std::string_view val) {
+        std::vector<long long> nums;
+        size_t i = 0;
+        while (i < val.size()) {
+            if (val[i] == ' ') {
+                i++;
+                continue;
+            }
+            long long num;
+            auto res = std::from_chars(val.data() + i, val.data() + val.size(), num);
+            if (res.ec != std::errc{} || num <= 0 || (res.ptr != val.data() + val.size() && *res.ptr != ' ')) {
+                throw std::runtime_error("Invalid value for save: " + std::string(val));
+            }
+            nums.push_back(num);
+            i = res.ptr - val.data();
+        }
+        if (nums.size() % 2 != 0) {
+            throw std::runtime_error("Invalid value for save: " + std::string(val));
+        }
+        std::vector<std::pair<long long, long long>> rules;
+        for (size_t k = 0; k < nums.size(); k += 2) {
+            rules.emplace_back(nums[k], nums[k + 1]);
+        }
+        return rules;
+    }
+
+    /* Parse a non-negative integer */
+    static long long parseCount(std::string_view name, std::string_view val) {
+        long long num;
+        auto res = std::from_chars(val.data(), val.data() + val.size(), num);
+        if (res.ec != std::errc{} || res.ptr != val.data() + val.size() || num < 0 || num > UINT_MAX) {
+            throw std::runtime_error("Invalid value for " + std::string(name) + ": " + std::string(val));
+        }
+        return num;
+    }
+
+    /* Parse a byte count with an optional kb, mb or gb suffix */
+    static long long parseMemory(std::string_view name, std::string_view val) {
+        long long num;
+        auto res = std::from_chars(val.data(), val.data() + val.size(), num);
+        std::string_view unit = val.substr(res.ptr - val.data());
+        long long scale = 1;
+        if (unit == "kb" || unit == "KB") {
+            scale = 1LL << 10;
+        } else if (unit == "mb" || unit == "MB") {
+            scale = 1LL << 20;
+        } else if (unit == "gb" || unit == "GB") {
+            scale = 1LL << 30;
+        } else if (!unit.empty()) {
+            res.ec = std::errc::invalid_argument;
+        }
+        if (res.ec != std::errc{} || num < 0 || num > LLONG_MAX / scale) {
+            throw std::runtime_error("Invalid value for " + std::string(name) + ": " + std::string(val));
+        }
+        return num * scale;
+    }
+
+    static bool parseBool(std::string_view name, std::string_view val) {
+        if (val == "yes") {
+            return true;
+        }
+        if (val == "no") {
+            return false;
+        }
+        throw std::runtime_error("Invalid value for " + std::string(name) + ": " + std::string(val));
+    }
+};
@@ -6,520 +6,910 @@
 #include <chrono>
 #include <optional>
 #include <list>
-
+#include <array>
+#include <vector>
+#include <algorithm>
+#include <string_view>
+#include <span>
+#include <thread>
+#include <condition_variable>
+#include <random>
+
+#include "ldsShard.h"
 #include "ldsKey.h"
 #include "ldsVal.h"
 #include "ldsCmd.h"
+#include "ldsConfig.h"
 #include "logger.h"
 
 extern logger LOGGER;
 
+// Number of keyspace shards, must be a power of two
+#define SHARD_COUNT 64
+// Background expiration: idle period between passes, and max expiry index entries per shard per pass
+#define EXPIRE_INTERVAL_MS 100
+#define EXPIRE_BATCH 128
+// Eviction: max buckets visited per sampled key, before falling back to the expiry index or another shard
+#define EVICT_VISITS_PER_SAMPLE 4
+// Keyspace scan cursor: shard in the low bits, then the bucket, then the low bits of the shard's rehash count
+#define SCAN_SHARD_BITS 6
+#define SCAN_BUCKET_BITS 34
+// Keys or members visited per SCAN call unless COUNT is given, and max buckets visited per key asked for
+#define SCAN_DEFAULT_COUNT 10
+#define SCAN_BUCKETS_PER_KEY 10
+// Larger COUNT hints are clamped, which also keeps count * SCAN_BUCKETS_PER_KEY from overflowing
+#define SCAN_MAX_COUNT (1 << 20)
+
+static_assert(SHARD_COUNT == 1 << SCAN_SHARD_BITS);
+
+/* Check if str matches a glob-style pattern: * and ? wildcards, [abc], [^abc] and [a-z] classes, \ escapes */
+inline bool matchGlob(std::string_view pattern, std::string_view str) {
+    // match one character of str against the pattern element at p, set next to the element after it
+    auto matchOne = [&pattern](size_t p, char c, size_t &next) {
+        if (pattern[p] == '?') {
+            next = p + 1;
+            return true;
+        }
+        if (pattern[p] == '\\' && p + 1 < pattern.size()) {
+            next = p + 2;
+            return pattern[p + 1] == c;
+        }
+        if (pattern[p] != '[') {
+            next = p + 1;
+            return pattern[p] == c;
+        }
+        size_t i = p + 1;
+        bool negate = i < pattern.size() && pattern[i] == '^';
+        if (negate) {
+            i++;
+        }
+        bool matched = false;
+        while (i < pattern.size() && pattern[i] != ']') {
+            if (pattern[i] == '\\' && i + 1 < pattern.size()) {
+                matched |= pattern[i + 1] == c;
+                i += 2;
+            } else if (i + 2 < pattern.size() && pattern[i + 1] == '-' && pattern[i + 2] != ']') {
+                auto lo = (unsigned char) std::min(pattern[i], pattern[i + 2]);
+                auto hi = (unsigned char) std::max(pattern[i], pattern[i + 2]);
+                matched |= (unsigned char) c >= lo && (unsigned char) c <= hi;
+                i += 3;
+            } else {
+                matched |= pattern[i] == c;
+                i++;
+            }
+        }
+        next = std::min(i + 1, pattern.size());
+        return matched != negate;
+    };
+
+    // on a mismatch, retry from the last * letting it consume one more character
+    size_t p = 0, s = 0, star = std::string_view::npos, star_s = 0;
+    while (s < str.size()) {
+        size_t next;
+        if (p < pattern.size() && pattern[p] == '*') {
+            star = ++p;
+            star_s = s;
+        } else if (p < pattern.size() && matchOne(p, str[s], next)) {
+            p = next;
+            s++;
+        } else if (star != std::string_view::npos) {
+            p = star;
+            s = ++star_s;
+        } else {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == '*') {
+        p++;
+    }
+    return p == pattern.size();
+}
+
 class ldsDb {
 public:
     typedef unsigned int llen_t;
     typedef size_t slen_t;
 #define LFRONT 0
 #define LBACK 1
+#define SETOP_INTER 0
+#define SETOP_UNION 1
+#define SETOP_DIFF 2
 
 private:
-#define ULOCK(lock, mutex) std::unique_lock<std::shared_timed_mutex> lock(mutex)
-#define SLOCK(lock, mutex) std::shared_lock<std::shared_timed_mutex> lock(mutex)
-#define UNLOCK(lock) lock.unlock()
+    using ckey_type = ldsShard::ckey_type;
 
-    using cval_type = std::list<ldsVal>;
-    using ckey_type = std::unordered_map<std::string, ldsKey>;
-    using cla_type = std::unordered_map<std::string, std::chrono::system_clock::time_point>;
+    std::array<ldsShard, SHARD_COUNT> shards;
 
-    ckey_type keys;
-    cval_type vals;
-    cla_type last_access;
+    // Background expiration
+    std::thread reaper;
+    std::mutex reaper_mtx;
+    std::condition_variable reaper_cv;
+    bool reaper_stop = false;
 
-    std::shared_timed_mutex vals_mtx{}, keys_mtx{}, last_access_mtx{};
+    // Memory accounting and eviction
+    std::atomic<int64_t> used_memory{0};
+    std::atomic<uint64_t> evicted_keys{0};
+    int64_t maxmemory = 0;
+    unsigned maxmemory_policy = MAXMEMORY_NOEVICTION;
+    size_t maxmemory_samples = 5;
 
-    /* Check if key has expired
-     * Precondition:
-     * - acquire shared lock on keys_mtx
-     * */
-    bool isExpired(ckey_type::iterator key_iter) {
-        if (key_iter == keys.end()) {
-            return false;
-        }
-        if (!key_iter->second.ttl.has_value()) {
-            return false;
-        }
-        return std::chrono::system_clock::now() >= key_iter->second.ttl.value();
+    ldsShard &shardOf(std::string_view key) {
+        return shards[shardIndex(key)];
     }
 
-    /* Get value of a key
-     * Precondition:
-     * - acquire shared lock on keys_mtx
-     * - acquire shared lock on vals_mtx
+    /* Indices of the shards owning the given keys, deduplicated and in ascending order.
+     * Whenever more than one shard is locked, shards must be locked in this order.
      * */
-    cval_type::iterator getValIter(ckey_type::iterator key_iter) {
-        if (key_iter == keys.end()) {
-            return vals.end();
+    static std::vector<size_t> shardsOf(std::span<const std::string_view> keys) {
+        std::vector<size_t> ret;
+        ret.reserve(keys.size());
+        for (auto &key: keys) {
+            ret.push_back(shardIndex(key));
         }
-        return key_iter->second.val_iter;
+        std::sort(ret.begin(), ret.end());
+        ret.erase(std::unique(ret.begin(), ret.end()), ret.end());
+        return ret;
     }
 
-    /* Delete a value from db.vals
-     * Precondition:
-     * - acquire unique lock on vals_mtx
+    /* BACKGROUND EXPIRATION */
+
+    /* Periodically free expired keys using the per-shard expiry index.
+     * Each pass holds a shard lock for at most EXPIRE_BATCH index entries,
+     * and a pass that leaves due keys behind is followed immediately by another one.
      * */
-    bool deleteVal(cval_type::iterator val_iter) {
-        if (val_iter == vals.end()) {
-            return false;
-        }
+    void reap() {
+        while (true) {
+            bool more = false;
+            auto now = std::chrono::system_clock::now();
+            for (auto &shard: shards) {
+                {
+                    SLOCK(slock, shard.mtx);
+                    if (!shard.hasDue(now)) {
+                        continue;
+                    }
+                }
+                ULOCK(ulock, shard.mtx);
+                more |= shard.expireDue(now, EXPIRE_BATCH);
+            }
 
-        switch (val_iter->type) {
-            case STRING_T:
-                delete (std::string *) val_iter->ptr;
-                break;
-            case LIST_T:
-                delete (std::list<std::string> *) val_iter->ptr;
-                break;
-            case SET_T:
-                delete (std::set<std::string> *) val_iter->ptr;
-                break;
-            default:
-                throw std::runtime_error("Invalid value type id: " + std::to_string(val_iter->type));
+            std::unique_lock<std::mutex> lck(reaper_mtx);
+            if (more) {
+                if (reaper_stop) {
+                    return;
+                }
+                continue;
+            }
+            if (reaper_cv.wait_for(lck, std::chrono::milliseconds(EXPIRE_INTERVAL_MS), [this] { return reaper_stop; })) {
+                return;
+            }
         }
-
-        vals.erase(val_iter);
-        return true;
     }
 
-    /* Write a new key-value pair to db, overwrite last value if necessary
-     * Precondition:
-     * - acquire unique lock on keys_mtx
-     * - acquire unique lock on vals_mtx
-     * - acquire unique lock on last_access_mtx
-     * */
-    std::tuple<ckey_type::iterator, cval_type::iterator> writeKV(const std::string &key, void *val, unsigned type) {
-        ldsKey new_key;
-        new_key.key = key;
+    /* EVICTION */
 
-        auto key_iter = keys.find(key);
-        auto it = getValIter(key_iter);
-        deleteVal(it);
-        new_key.val_iter = vals.insert(vals.end(), ldsVal{val, type});
-
-        keys[key] = new_key;
-        last_access[key] = std::chrono::system_clock::now();
-
-        return {keys.find(key), new_key.val_iter};
-    }
-
-    /* Modify value of a key
-     * Precondition:
-     * - acquire shared lock on keys_mtx
-     * - acquire unique lock on vals_mtx
+    /* Eviction order of a key under an LRU or LFU policy, lowest first.
+     * LFU compares frequency counters, breaking ties by access time.
      * */
-    cval_type::iterator modifyVal(ckey_type::iterator key_iter, const std::function<void(ldsVal &)> &modifier) {
-        if (key_iter == keys.end()) {
-            return vals.end();
+    int64_t evictionRank(const ldsKey &entry) const {
+        auto access = entry.last_access.load(std::memory_order_relaxed);
+        if (maxmemory_policy == MAXMEMORY_ALLKEYS_LFU || maxmemory_policy == MAXMEMORY_VOLATILE_LFU) {
+            // milliseconds since epoch fit in 42 bits until the year 2109
+            return ((int64_t) entry.frequency() << 42) | access;
         }
-        modifier(*key_iter->second.val_iter);
-        return key_iter->second.val_iter;
+        return access;
     }
 
-    /* Delete key if it has expired
+    /* Pick the key of a shard to evict under the eviction policy, std::nullopt if none is eligible.
+     * LRU and LFU policies sample random buckets and take the lowest ranked of maxmemory_samples keys,
+     * volatile-ttl takes the key with the nearest deadline from the expiry index.
      * Precondition:
-     * - acquire unique lock on keys_mtx
-     * - acquire unique lock on vals_mtx
-
-     * - acquire unique lock on last_access_mtx
+     * - acquire unique lock on shard.mtx
      * */
-    bool deleteKV(const std::string &key) {
-        auto key_iter = keys.find(key);
-        if (key_iter == keys.end()) {
-            return false;
-        }
-        // Delete value
-        auto val_iter = key_iter->second.val_iter;
-        deleteVal(val_iter);
-
-        // Delete key
-        keys.erase(key_iter);
-        last_access.erase(key);
-        return true;
-    }
-
-    /* PRE/POST-COMMAND OPERATIONS */
-
-    void preCommand(const std::vector<std::string> &keys, bool all_keys = false) {
-        SLOCK(slock_key, keys_mtx);
-        std::vector<ckey_type::iterator> to_delete;
-        auto process = [this, &to_delete](ckey_type::iterator key_iter) {
-            if (key_iter == this->keys.end()) {
-                return;
-            }
-            if (isExpired(key_iter)) {
-                to_delete.push_back(key_iter);
+    std::optional<std::string> evictionCandidate(ldsShard &shard, std::mt19937_64 &rng) {
+        if (maxmemory_policy != MAXMEMORY_VOLATILE_TTL && !shard.keys.empty()) {
+            bool volatile_only = maxmemory_policy == MAXMEMORY_VOLATILE_LRU
+                                 || maxmemory_policy == MAXMEMORY_VOLATILE_LFU;
+            const ldsString *best = nullptr;
+            int64_t best_rank = 0;
+            size_t sampled = 0;
+            size_t buckets = shard.keys.bucket_count();
+            for (size_t visits = 0; sampled < maxmemory_samples
+                                    && visits < maxmemory_samples * EVICT_VISITS_PER_SAMPLE; visits++) {
+                size_t b = rng() % buckets;
+                for (auto it = shard.keys.begin(b); it != shard.keys.end(b) && sampled < maxmemory_samples; it++) {
+                    if (volatile_only && !it->second.ttl.has_value()) {
+                        continue;
+                    }
+                    sampled++;
+                    auto rank = evictionRank(it->second);
+                    if (best == nullptr || rank < best_rank) {
+                        best = &it->first;
+                        best_rank = rank;
+                    }
+                }
             }
-        };
-        if (all_keys) {
-            for (auto it = this->keys.begin(); it != this->keys.end(); it++) {
-                process(it);
+            if (best != nullptr) {
+                return std::string{*best};
             }
-        } else {
-            for (auto &key: keys) {
-                process(this->keys.find(key));
+            if (!volatile_only) {
+                return std::nullopt;
             }
         }
-        if (!to_delete.empty()) {
-            UNLOCK(slock_key);
-            ULOCK(ulock_key, keys_mtx);
-            ULOCK(ulock_val, vals_mtx);
-            ULOCK(ulock_la, last_access_mtx);
-            for (auto &key_iter: to_delete) {
-                deleteKV(key_iter->first);
+
+        // keys with the nearest deadline first, dropping index entries of keys since deleted or re-expired
+        while (!shard.expires.empty()) {
+            auto &[when, key] = shard.expires.top();
+            auto key_iter = shard.keys.find(key);
+            if (key_iter != shard.keys.end() && key_iter->second.ttl == when) {
+                return std::string{key};
             }
+            shard.addMemory(-ldsShard::expirySize(key));
+            shard.expires.pop();
         }
+        return std::nullopt;
     }
 
-    void postAccessCommand(const std::vector<std::string> &keys, bool all_keys = false) {
-        ULOCK(ulock_key, keys_mtx);
-        ULOCK(ulock_la, last_access_mtx);
-        auto now = std::chrono::system_clock::now();
-        auto process = [this, &now](ckey_type::iterator key_iter) {
-            if (key_iter == this->keys.end()) {
-                return;
+    /* Evict one key, starting from a random shard. Evictions are passed to write_hook as DEL commands.
+     * While the current thread holds a batch shard, other shards are only tried without waiting,
+     * since waiting could deadlock with commands locking several shards in order.
+     * Return false if no shard had an eligible key
+     * */
+    bool evictOne(std::mt19937_64 &rng) {
+        size_t first = rng() & (SHARD_COUNT - 1);
+        for (size_t k = 0; k < SHARD_COUNT; k++) {
+            auto &shard = shards[(first + k) & (SHARD_COUNT - 1)];
+            std::unique_lock<std::shared_timed_mutex> ulock;
+            if (batch_shard == &shard) {
+                if (!batch_unique) {
+                    continue;
+                }
+            } else if (batch_shard == nullptr) {
+                lockShardTimed(shard, true);
+                ulock = std::unique_lock<std::shared_timed_mutex>{shard.mtx, std::adopt_lock};
+            } else {
+                ulock = std::unique_lock<std::shared_timed_mutex>{shard.mtx, std::try_to_lock};
+                if (!ulock.owns_lock()) {
+                    continue;
+                }
             }
-            this->last_access[key_iter->first] = now;
-        };
-        if (all_keys) {
-            for (auto it = this->keys.begin(); it != this->keys.end(); it++) {
-                process(it);
+
+            auto key = evictionCandidate(shard, rng);
+            if (!key.has_value()) {
+                continue;
             }
-        } else {
-            for (auto &key: keys) {
-                process(this->keys.find(key));
+            if (write_hook) {
+                write_hook(makeCmd(*lookupCmd("del"), key.value()));
+            }
+            shard.deleteKV(key.value());
+            evicted_keys.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+        return false;
+    }
+
+    /* Evict keys until used memory is back under maxmemory
+     * Return false if it is still over, because the policy forbids eviction or no key is eligible
+     * */
+    bool freeMemory() {
+        if (maxmemory == 0) {
+            return true;
+        }
+        thread_local std::mt19937_64 rng{std::random_device{}()};
+        while (used_memory.load(std::memory_order_relaxed) > maxmemory) {
+            if (maxmemory_policy == MAXMEMORY_NOEVICTION || !evictOne(rng)) {
+                return false;
             }
         }
+        return true;
     }
 
     /* GENERIC OPERATIONS */
 
-    /* Get list of keys */
+    /* Get list of keys
+     * Copies the whole keyspace, SCAN walks it in bounded steps instead
+     * */
     std::vector<std::string> getKeys() {
-        SLOCK(slock_key, keys_mtx);
         std::vector<std::string> ret;
-        for (auto &[key, _]: keys) {
-            ret.push_back(key);
+        auto now = std::chrono::system_clock::now();
+        for (auto &shard: shards) {
+            SHARD_SLOCK(slock, shard);
+            for (auto it = shard.keys.begin(); it != shard.keys.end(); it++) {
+                if (!shard.isExpired(it, now)) {
+                    ret.emplace_back(it->first);
+                }
+            }
         }
         return ret;
     }
 
+    /* Append the live keys matching pattern of the buckets following cursor, return the cursor to continue from,
+     * 0 once every shard was scanned.
+     * Holds one shared shard lock at a time and stops after count keys or count * SCAN_BUCKETS_PER_KEY buckets.
+     * Keys present for the whole scan are returned at least once. A shard whose keys were redistributed
+     * since the cursor was returned is scanned again from its first bucket, returning some keys twice.
+     * As with any restartable scan, it only ends if the number of keys stays bounded.
+     * Precondition:
+     * - count <= SCAN_MAX_COUNT
+     * */
+    uint64_t scanKeys(uint64_t cursor, size_t count, std::string_view pattern, std::vector<std::string> &out) {
+        size_t idx = cursor & ((1ull << SCAN_SHARD_BITS) - 1);
+        size_t bucket = (cursor >> SCAN_SHARD_BITS) & ((1ull << SCAN_BUCKET_BITS) - 1);
+        uint64_t rehashes = cursor >> (SCAN_SHARD_BITS + SCAN_BUCKET_BITS);
+        size_t keys = 0, buckets = 0;
+        bool match_all = pattern == "*";
+        auto now = std::chrono::system_clock::now();
+
+        for (; idx < SHARD_COUNT; idx++, bucket = 0) {
+            auto &shard = shards[idx];
+            SHARD_SLOCK(slock, shard);
+            uint64_t shard_rehashes = shard.rehashes & ((1ull << (64 - SCAN_SHARD_BITS - SCAN_BUCKET_BITS)) - 1);
+            if (shard_rehashes != rehashes) {
+                bucket = 0;
+            }
+            for (; bucket < shard.keys.bucket_count(); bucket++) {
+                if (keys >= count || buckets >= count * SCAN_BUCKETS_PER_KEY) {
+                    return shard_rehashes << (SCAN_SHARD_BITS + SCAN_BUCKET_BITS)
+                           | (uint64_t) bucket << SCAN_SHARD_BITS | idx;
+                }
+                buckets++;
+                for (auto it = shard.keys.begin(bucket); it != shard.keys.end(bucket); it++) {
+                    keys++;
+                    if (!shard.isExpired(it->second, now) && (match_all || matchGlob(pattern, it->first))) {
+                        out.emplace_back(it->first);
+                    }
+                }
+            }
+        }
+        return 0;
+    }
+
     /* Delete a key from db */
-    bool del(const std::string &key) {
-        ULOCK(ulock_key, keys_mtx);
-        ULOCK(ulock_val, vals_mtx);
-        ULOCK(ulock_la, last_access_mtx);
-        return deleteKV(key);
+    bool del(std::string_view key) {
+        auto &shard = shardOf(key);
+        SHARD_ULOCK(ulock, shard);
+        if (shard.findForWrite(key) == shard.keys.end()) {
+            return false;
+        }
+        return shard.deleteKV(key);
+    }
+
+    /* Get the access frequency counter of a key, without counting this as an access */
+    std::optional<long long> getFrequency(std::string_view key) {
+        auto &shard = shardOf(key);
+        SHARD_SLOCK(slock, shard);
+        auto key_iter = shard.findLive(key);
+        if (key_iter == shard.keys.end()) {
+            return std::nullopt;
+        }
+        return key_iter->second.frequency();
     }
 
     /* Remove all keys from db */
     void flush() {
-        ULOCK(ulock_key, keys_mtx);
-        keys.clear();
-
-        ULOCK(ulock_val, vals_mtx);
-        while (!vals.empty()) {
-            deleteVal(vals.begin());
+        // hold every shard so that no reader sees a partially flushed db
+        auto locks = lockAll(true);
+        for (auto &shard: shards) {
+            shard.clear();
         }
-
-        ULOCK(ulock_la, last_access_mtx);
-        last_access.clear();
     }
 
     /* TTL OPERATIONS */
 
-    /* Get time-to-live of a key */
-    int getTTL(const std::string &key) {
-        SLOCK(slock_key, keys_mtx);
-        auto key_iter = keys.find(key);
-        if (key_iter == keys.end()) {
+    /* Get time-to-live of a key in milliseconds */
+    long long getTTL(std::string_view key) {
+        auto &shard = shardOf(key);
+        SHARD_SLOCK(slock, shard);
+        auto key_iter = shard.findLive(key);
+        if (key_iter == shard.keys.end()) {
             return -2;
         }
         if (!key_iter->second.ttl.has_value()) {
             return -1;
         }
         auto ret = key_iter->second.ttl.value() - std::chrono::system_clock::now();
-        return std::chrono::duration_cast<std::chrono::seconds>(ret).count();
+        return std::chrono::duration_cast<std::chrono::milliseconds>(ret).count();
     }
 
-    /* Set time-to-live of a key */
-    int setTTL(const std::string &key, int ttl) {
-        if (ttl < 0) {
-            throw std::runtime_error("Invalid TTL value: " + std::to_string(ttl) + " (must be >= 0)");
+    /* Set time-to-live of a key, return the remaining time-to-live in milliseconds */
+    long long setTTL(std::string_view key, std::chrono::milliseconds ttl) {
+        if (ttl.count() < 0) {
+            throw std::runtime_error("Invalid TTL value: " + std::to_string(ttl.count()) + " (must be >= 0)");
         }
-        ULOCK(ulock_key, keys_mtx);
-        auto key_iter = keys.find(key);
-        if (key_iter == keys.end()) {
+        auto &shard = shardOf(key);
+        SHARD_ULOCK(ulock, shard);
+        auto key_iter = shard.findForWrite(key);
+        if (key_iter == shard.keys.end()) {
             return -2;
         }
-        if (ttl < 0) {
-            key_iter->second.ttl = std::chrono::system_clock::now();
-        } else
-            key_iter->second.ttl = std::chrono::system_clock::now() + std::chrono::seconds(ttl);
-        return std::chrono::duration_cast<std::chrono::seconds>(
-                key_iter->second.ttl.value() - std::chrono::system_clock::now()).count();
+        auto now = std::chrono::system_clock::now();
+        shard.setExpiry(key_iter, now + ttl);
+        return ttl.count();
+    }
+
+    /* Set the expiry deadline of a key, return false if it does not exist */
+    bool setExpireAt(std::string_view key, ldsShard::time_point when) {
+        auto &shard = shardOf(key);
+        SHARD_ULOCK(ulock, shard);
+        auto key_iter = shard.findForWrite(key);
+        if (key_iter == shard.keys.end()) {
+            return false;
+        }
+        shard.setExpiry(key_iter, when);
+        return true;
     }
 
     /* STRING OPERATIONS */
 
-    std::optional<std::string> getStr(const std::string &key) {
-        SLOCK(slock_key, keys_mtx);
-        SLOCK(slock_val, vals_mtx);
-        auto it = getValIter(keys.find(key));
-        if (it == vals.end()) {
+    std::optional<std::string> getStr(std::string_view key) {
+        auto &shard = shardOf(key);
+        SHARD_SLOCK(slock, shard);
+        auto key_iter = shard.findLive(key);
+        auto val = shard.getVal(key_iter);
+        if (val == nullptr) {
             return std::nullopt;
         }
 
-        return *ldsValToStr(*it);
+        key_iter->second.touch();
+        return std::string{*ldsValToStr(*val)};
     }
 
-    void setStr(const std::string &key, const std::string &val) {
-        ULOCK(ulock_key, keys_mtx);
-        ULOCK(ulock_val, vals_mtx);
-        ULOCK(ulock_la, last_access_mtx);
-        writeKV(key, new std::string{val}, STRING_T);
+    void setStr(std::string_view key, std::string_view val) {
+        auto &shard = shardOf(key);
+        SHARD_ULOCK(ulock, shard);
+        shard.writeKV(key, ldsVal{ldsString{val}});
     }
 
     /* LIST OPERATIONS */
 
     /* Get length of list */
-    llen_t getListLen(const std::string &key) {
-        SLOCK(slock_key, keys_mtx);
-        SLOCK(slock_val, vals_mtx);
-        auto key_iter = keys.find(key);
-        auto it = getValIter(key_iter);
-        if (it == vals.end()) {
+    llen_t getListLen(std::string_view key) {
+        auto &shard = shardOf(key);
+        SHARD_SLOCK(slock, shard);
+        auto key_iter = shard.findLive(key);
+        auto val = shard.getVal(key_iter);
+        if (val == nullptr) {
             return 0;
         }
-        return ldsValToList(*it)->size();
+        key_iter->second.touch();
+        return ldsValToList(*val)->size();
     }
 
     /* Push a value to the front/back of a list */
-    llen_t pushList(const std::string &key, const std::vector<std::string> &vals, unsigned where) {
-        ULOCK(ulock_key, keys_mtx);
-        ULOCK(ulock_val, vals_mtx);
-        auto key_iter = keys.find(key);
-        auto it = getValIter(key_iter);
-        if (it == this->vals.end()) {
+    llen_t pushList(std::string_view key, std::span<const std::string_view> vals, unsigned where) {
+        if (where != LFRONT && where != LBACK) {
+            throw std::runtime_error("Invalid push location id: " + std::to_string(where));
+        }
+        auto &shard = shardOf(key);
+        SHARD_ULOCK(ulock, shard);
+        auto key_iter = shard.findForWrite(key);
+        if (key_iter == shard.keys.end()) {
             // key does not exist, create a new list
-            LOGGER.debug("Key does not exist, creating new list");
-            ULOCK(ulock_la, last_access_mtx);
-            auto [_, val_iter] = writeKV(key, where == LBACK ? new std::list<std::string>{vals.begin(), vals.end()}
-                                                             : new std::list<std::string>{vals.rbegin(), vals.rend()},
-                                         LIST_T);
-            return ldsValToList(*val_iter)->size();
+            LOG_DEBUG("Key does not exist, creating new list");
+            key_iter = shard.writeKV(key, ldsVal{ldsQuicklist{}});
         }
 
-        auto ldsVal = *modifyVal(key_iter, [&vals, where](struct ldsVal &v) {
+        auto modified = shard.modifyVal(key_iter, [&vals, where](struct ldsVal &v) {
             auto list = ldsValToList(v);
-            if (where == LFRONT) {
-                list->insert(list->begin(), vals.rbegin(), vals.rend());
-            } else if (where == LBACK) {
-                list->insert(list->end(), vals.begin(), vals.end());
-            } else {
-                throw std::runtime_error("Invalid push location id: " + std::to_string(where));
+            for (auto &val: vals) {
+                where == LFRONT ? list->pushFront(val) : list->pushBack(val);
             }
         });
+        key_iter->second.touch();
 
-        return ldsValToList(ldsVal)->size();
+        return ldsValToList(*modified)->size();
     }
 
-    std::optional<std::string> popList(const std::string &key, unsigned where) {
-        SLOCK(slock_key, keys_mtx);
-        ULOCK(ulock_val, vals_mtx);
-        auto key_iter = keys.find(key);
-        auto it = getValIter(key_iter);
-        if (it == vals.end()) {
+    std::optional<std::string> popList(std::string_view key, unsigned where) {
+        auto &shard = shardOf(key);
+        SHARD_ULOCK(ulock, shard);
+        auto key_iter = shard.findForWrite(key);
+        auto val = shard.getVal(key_iter);
+        if (val == nullptr) {
             return std::nullopt;
         }
 
         std::string ret;
-        auto ldsVal = *modifyVal(key_iter, [where, &ret](struct ldsVal &v) {
+        auto modified = shard.modifyVal(key_iter, [where, &ret](struct ldsVal &v) {
             auto list = ldsValToList(v);
             if (list->empty()) {
                 return;
             }
             if (where == LFRONT) {
-                ret = list->front();
-                list->pop_front();
+                ret = list->popFront();
             } else if (where == LBACK) {
-                ret = list->back();
-                list->pop_back();
+                ret = list->popBack();
             } else {
                 throw std::runtime_error("Invalid pop location id: " + std::to_string(where));
             }
         });
-        if (ldsValToList(ldsVal)->empty()) {
-            ULOCK(ulock_la, last_access_mtx);
-            deleteKV(key);
+        if (ldsValToList(*modified)->empty()) {
+            shard.deleteKV(key);
+        } else {
+            key_iter->second.touch();
         }
 
         return ret;
     }
 
-    std::vector<std::string> rangeList(const std::string &key, int start, int stop) {
-        SLOCK(slock_key, keys_mtx);
-        SLOCK(slock_val, vals_mtx);
-        auto key_iter = keys.find(key);
-        auto it = getValIter(key_iter);
-        if (it == vals.end()) {
-            return {};
-        }
-
-        auto list = ldsValToList(*it);
+    /* Clamp a start/stop index pair, negative indices counting from the end.
+     * Return false if the range is empty
+     * */
+    static bool clampRange(long long &start, long long &stop, size_t size) {
+        auto n = (long long) size;
         if (start < 0) {
-            start += list->size();
+            start += n;
         }
         if (start < 0) {
             start = 0;
         }
         if (stop < 0) {
-            stop += list->size();
+            stop += n;
         }
-        if (stop >= list->size()) {
-            stop = list->size() - 1;
+        if (stop >= n) {
+            stop = n - 1;
         }
-        if (start >= list->size()) {
+        return start < n && start <= stop;
+    }
+
+    std::vector<std::string> rangeList(std::string_view key, long long start, long long stop) {
+        auto &shard = shardOf(key);
+        SHARD_SLOCK(slock, shard);
+        auto key_iter = shard.findLive(key);
+        auto val = shard.getVal(key_iter);
+        if (val == nullptr) {
             return {};
         }
-        if (start > stop) {
+        key_iter->second.touch();
+
+        auto list = ldsValToList(*val);
+        if (!clampRange(start, stop, list->size())) {
             return {};
         }
 
         std::vector<std::string> ret;
-        auto it2 = std::next(list->begin(), start);
-        for (int i = start; i <= stop && it2 != list->end(); i++, it2++) {
-            ret.push_back(*it2);
+        list->range(start, stop, ret);
+        return ret;
+    }
+
+    /* Get the element at an index of a list, negative indices counting from the end */
+    std::optional<std::string> indexList(std::string_view key, long long idx) {
+        auto &shard = shardOf(key);
+        SHARD_SLOCK(slock, shard);
+        auto key_iter = shard.findLive(key);
+        auto val = shard.getVal(key_iter);
+        if (val == nullptr) {
+            return std::nullopt;
         }
+        key_iter->second.touch();
 
-        return ret;
+        auto list = ldsValToList(*val);
+        if (idx < 0) {
+            idx += (long long) list->size();
+        }
+        if (idx < 0 || idx >= (long long) list->size()) {
+            return std::nullopt;
+        }
+        return std::string{list->at(idx)};
+    }
+
+    /* Replace the element at an index of a list, negative indices counting from the end */
+    void setList(std::string_view key, long long idx, std::string_view data) {
+        auto &shard = shardOf(key);
+        SHARD_ULOCK(ulock, shard);
+        auto key_iter = shard.findForWrite(key);
+        if (key_iter == shard.keys.end()) {
+            throw std::runtime_error("No such key");
+        }
+
+        shard.modifyVal(key_iter, [&idx, &data](struct ldsVal &v) {
+            auto list = ldsValToList(v);
+            if (idx < 0) {
+                idx += (long long) list->size();
+            }
+            if (idx < 0 || idx >= (long long) list->size()) {
+                throw std::runtime_error("Index out of range");
+            }
+            list->set(idx, data);
+        });
+        key_iter->second.touch();
+    }
+
+    /* Keep only the elements of a list between start and stop, both inclusive */
+    void trimList(std::string_view key, long long start, long long stop) {
+        auto &shard = shardOf(key);
+        SHARD_ULOCK(ulock, shard);
+        auto key_iter = shard.findForWrite(key);
+        auto val = shard.getVal(key_iter);
+        if (val == nullptr) {
+            return;
+        }
+
+        if (!clampRange(start, stop, ldsValToList(*val)->size())) {
+            shard.deleteKV(key);
+            return;
+        }
+        shard.modifyVal(key_iter, [start, stop](struct ldsVal &v) {
+            ldsValToList(v)->trim(start, stop);
+        });
+        key_iter->second.touch();
     }
 
     /* SET OPERATIONS */
 
-    slen_t getSetLen(const std::string &key) {
-        SLOCK(slock_key, keys_mtx);
-        SLOCK(slock_val, vals_mtx);
-        auto key_iter = keys.find(key);
-        auto it = getValIter(key_iter);
-        if (it == vals.end()) {
+    slen_t getSetLen(std::string_view key) {
+        auto &shard = shardOf(key);
+        SHARD_SLOCK(slock, shard);
+        auto key_iter = shard.findLive(key);
+        auto val = shard.getVal(key_iter);
+        if (val == nullptr) {
             return 0;
         }
+        key_iter->second.touch();
 
-        return ldsValToSet(*it)->size();
+        return ldsValToSet(*val)->size();
     }
 
-    std::vector<std::string> getSetMems(const std::string &key) {
-        SLOCK(slock_key, keys_mtx);
-        SLOCK(slock_val, vals_mtx);
-        auto key_iter = keys.find(key);
-        auto it = getValIter(key_iter);
-        if (it == vals.end()) {
+    std::vector<std::string> getSetMems(std::string_view key) {
+        auto &shard = shardOf(key);
+        SHARD_SLOCK(slock, shard);
+        auto key_iter = shard.findLive(key);
+        auto val = shard.getVal(key_iter);
+        if (val == nullptr) {
             return {};
         }
+        key_iter->second.touch();
 
-        auto set = ldsValToSet(*it);
-        return {set->begin(), set->end()};
+        std::vector<std::string> ret;
+        auto set = ldsValToSet(*val);
+        ret.reserve(set->size());
+        set->forEach([&ret](std::string_view member) {
+            ret.emplace_back(member);
+        });
+        return ret;
     }
 
-    std::vector<std::string> getSetInter(const std::vector<std::string> &keys) {
-        SLOCK(slock_key, keys_mtx);
-        SLOCK(slock_val, vals_mtx);
-        std::vector<std::set<std::string> *> sets;
-        for (auto &key: keys) {
-            auto key_iter = this->keys.find(key);
-            auto it = getValIter(key_iter);
-            if (it == vals.end()) {
-                return {};
+    /* Append the members of a set matching pattern of about count home slots following cursor,
+     * return the cursor to continue from, 0 once every member was visited
+     * */
+    uint64_t scanSet(std::string_view key, uint64_t cursor, size_t count, std::string_view pattern,
+                     std::vector<std::string> &out) {
+        auto &shard = shardOf(key);
+        SHARD_SLOCK(slock, shard);
+        auto key_iter = shard.findLive(key);
+        auto val = shard.getVal(key_iter);
+        if (val == nullptr) {
+            return 0;
+        }
+        key_iter->second.touch();
+
+        bool match_all = pattern == "*";
+        return ldsValToSet(*val)->scan(cursor, count, [&](std::string_view member) {
+            if (match_all || matchGlob(pattern, member)) {
+                out.emplace_back(member);
             }
-            sets.push_back(ldsValToSet(*it));
+        });
+    }
+
+    bool isSetMember(std::string_view key, std::string_view member) {
+        auto &shard = shardOf(key);
+        SHARD_SLOCK(slock, shard);
+        auto key_iter = shard.findLive(key);
+        auto val = shard.getVal(key_iter);
+        if (val == nullptr) {
+            return false;
         }
+        key_iter->second.touch();
 
-        if (sets.empty()) {
-            return {};
+        return ldsValToSet(*val)->contains(member);
+    }
+
+    /* Lock the shards owning the given keys in ascending order.
+     * The shard owning dest, if given, is locked uniquely and the others shared,
+     * the write is published only once every one of them is held.
+     * */
+    std::list<ldsShardLock> lockShards(std::span<const std::string_view> keys,
+                                       std::optional<std::string_view> dest = std::nullopt) {
+        std::vector<std::string_view> all(keys.begin(), keys.end());
+        if (dest) {
+            all.push_back(*dest);
+        }
+        std::list<ldsShardLock> locks;
+        for (auto idx: shardsOf(all)) {
+            locks.emplace_back(shards[idx], dest && idx == shardIndex(*dest), false);
         }
+        if (dest) {
+            notifyWrite();
+        }
+        return locks;
+    }
 
-        std::vector<std::string> ret(sets[0]->begin(), sets[0]->end());
-        for (int i = 1; i < sets.size(); i++) {
-            std::vector<std::string> tmp;
-            std::set_intersection(ret.begin(), ret.end(), sets[i]->begin(), sets[i]->end(), std::back_inserter(tmp));
-            ret = std::move(tmp);
+    /* Intersection, union or difference of the sets at the given keys, missing keys being empty sets.
+     * Intersections start from the smallest set and probe the larger ones,
+     * with a sorted merge when every set is an intset.
+     * Precondition:
+     * - acquire at least shared locks on the shards owning keys
+     * */
+    std::vector<std::string> combineSets(std::span<const std::string_view> keys, unsigned op) {
+        std::vector<ldsSet *> sets;
+        for (auto &key: keys) {
+            auto &shard = shardOf(key);
+            auto key_iter = shard.findLive(key);
+            auto val = shard.getVal(key_iter);
+            if (val == nullptr) {
+                sets.push_back(nullptr);
+                continue;
+            }
+            key_iter->second.touch();
+            sets.push_back(ldsValToSet(*val));
+        }
+
+        std::vector<std::string> ret;
+        if (op == SETOP_INTER) {
+            if (std::find(sets.begin(), sets.end(), nullptr) != sets.end()) {
+                return {};
+            }
+            std::sort(sets.begin(), sets.end(), [](ldsSet *a, ldsSet *b) {
+                return a->size() < b->size();
+            });
+
+            bool all_ints = std::all_of(sets.begin(), sets.end(), [](ldsSet *set) {
+                return set->ints() != nullptr;
+            });
+            if (all_ints) {
+                std::vector<int64_t> acc = *sets[0]->ints();
+                for (size_t i = 1; i < sets.size() && !acc.empty(); i++) {
+                    std::vector<int64_t> tmp;
+                    intersectInts(acc.data(), acc.size(), sets[i]->ints()->data(), sets[i]->ints()->size(), tmp);
+                    acc = std::move(tmp);
+                }
+                ret.reserve(acc.size());
+                for (auto v: acc) {
+                    ret.push_back(std::to_string(v));
+                }
+                return ret;
+            }
+
+            sets[0]->forEach([&sets, &ret](std::string_view member) {
+                for (size_t i = 1; i < sets.size(); i++) {
+                    if (!sets[i]->contains(member)) {
+                        return;
+                    }
+                }
+                ret.emplace_back(member);
+            });
+        } else if (op == SETOP_UNION) {
+            ldsSet acc;
+            for (auto set: sets) {
+                if (set != nullptr) {
+                    set->forEach([&acc](std::string_view member) {
+                        acc.insert(member);
+                    });
+                }
+            }
+            ret.reserve(acc.size());
+            acc.forEach([&ret](std::string_view member) {
+                ret.emplace_back(member);
+            });
+        } else if (op == SETOP_DIFF) {
+            if (sets[0] == nullptr) {
+                return {};
+            }
+            sets[0]->forEach([&sets, &ret](std::string_view member) {
+                for (size_t i = 1; i < sets.size(); i++) {
+                    if (sets[i] != nullptr && sets[i]->contains(member)) {
+                        return;
+                    }
+                }
+                ret.emplace_back(member);
+            });
+        } else {
+            throw std::runtime_error("Invalid set operation id: " + std::to_string(op));
         }
 
-        return {ret.begin(), ret.end()};
+        return ret;
     }
 
-    slen_t insertSet(const std::string &key, const std::vector<std::string> &vals) {
-        ULOCK(ulock_key, keys_mtx);
-        ULOCK(ulock_val, vals_mtx);
-        auto key_iter = keys.find(key);
-        auto it = getValIter(key_iter);
-        if (it == this->vals.end()) {
+    std::vector<std::string> getSetOp(std::span<const std::string_view> keys, unsigned op) {
+        auto locks = lockShards(keys);
+        return combineSets(keys, op);
+    }
+
+    /* Store the result of a set operation at dest, replacing any value, and return its size */
+    slen_t storeSetOp(std::string_view dest, std::span<const std::string_view> keys, unsigned op) {
+        auto locks = lockShards(keys, dest);
+        auto members = combineSets(keys, op);
+
+        auto &shard = shardOf(dest);
+        shard.deleteKV(dest);
+        if (members.empty()) {
+            return 0;
+        }
+        ldsSet set;
+        for (auto &member: members) {
+            set.insert(member);
+        }
+        shard.writeKV(dest, ldsVal{std::move(set)});
+        return members.size();
+    }
+
+    slen_t insertSet(std::string_view key, std::span<const std::string_view> vals) {
+        auto &shard = shardOf(key);
+        SHARD_ULOCK(ulock, shard);
+        auto key_iter = shard.findForWrite(key);
+        if (key_iter == shard.keys.end()) {
             // key does not exist, create a new set
-            ULOCK(ulock_la, last_access_mtx);
-            auto [_, val_iter] = writeKV(key, new std::set<std::string>{vals.begin(), vals.end()}, SET_T);
-            return ldsValToSet(*val_iter)->size();
+            key_iter = shard.writeKV(key, ldsVal{ldsSet{}});
         }
 
         slen_t ret = 0;
-        auto ldsVal = *modifyVal(key_iter, [&vals, &ret](struct ldsVal &v) {
+        shard.modifyVal(key_iter, [&vals, &ret](struct ldsVal &v) {
             auto set = ldsValToSet(v);
-            ret = set->size();
-            set->insert(vals.begin(), vals.end());
-            ret = set->size() - ret;
+            for (auto &val: vals) {
+                ret += set->insert(val);
+            }
         });
+        key_iter->second.touch();
 
         return ret;
     }
 
-    slen_t removeSet(const std::string &key, const std::vector<std::string> &vals) {
-        ULOCK(ulock_key, keys_mtx);
-        ULOCK(ulock_val, vals_mtx);
-        auto key_iter = keys.find(key);
-        auto it = getValIter(key_iter);
-        if (it == this->vals.end()) {
+    slen_t removeSet(std::string_view key, std::span<const std::string_view> vals) {
+        auto &shard = shardOf(key);
+        SHARD_ULOCK(ulock, shard);
+        auto key_iter = shard.findForWrite(key);
+        auto val = shard.getVal(key_iter);
+        if (val == nullptr) {
             return 0;
         }
 
         slen_t ret = 0;
-        auto ldsVal = *modifyVal(key_iter, [&vals, &ret](struct ldsVal &v) {
+        auto modified = shard.modifyVal(key_iter, [&vals, &ret](struct ldsVal &v) {
             auto set = ldsValToSet(v);
             for (auto &val: vals) {
                 ret += set->erase(val);
             }
         });
-        if (ldsValToSet(ldsVal)->empty()) {
-            ULOCK(ulock_la, last_access_mtx);
-            deleteKV(key);
+        if (ldsValToSet(*modified)->empty()) {
+            shard.deleteKV(key);
+        } else {
+            key_iter->second.touch();
         }
 
         return ret;
     }
 
 public:
-    ldsDb() = default;
+    static size_t shardIndex(std::string_view key) {
+        return std::hash<std::string_view>{}(key) & (SHARD_COUNT - 1);
+    }
+
+    ldsDb() {
+        for (unsigned idx = 0; idx < SHARD_COUNT; idx++) {
+            shards[idx].idx = idx;
+            shards[idx].used_memory = &used_memory;
+        }
+        reaper = std::thread(&ldsDb::reap, this);
+    }
 
     ~ldsDb() {
-        while (!vals.empty()) {
-            deleteVal(vals.begin());
+        {
+            std::lock_guard<std::mutex> lck(reaper_mtx);
+            reaper_stop = true;
         }
+        reaper_cv.notify_all();
+        reaper.join();
     }
 
     /* GENERIC OPERATIONS */
     std::vector<std::string> cmdKeys() {
-        preCommand({}, true);
         return getKeys();
     }
 
-    bool cmdDel(const std::string &key) {
-        preCommand({key});
+    uint64_t cmdScan(uint64_t cursor, size_t count, std::string_view pattern, std::vector<std::string> &out) {
+        return scanKeys(cursor, count, pattern, out);
+    }
+
+    bool cmdDel(std::string_view key) {
         return del(key);
     }
 
@@ -527,245 +917,415 @@ public:
         flush();
     }
 
-    int cmdTTL(const std::string &key) {
-        preCommand({key});
+    std::optional<long long> cmdObjectFreq(std::string_view key) {
+        return getFrequency(key);
+    }
+
+    long long cmdTTL(std::string_view key) {
+        auto ret = getTTL(key);
+        return ret < 0 ? ret : ret / 1000;
+    }
+
+    long long cmdPTTL(std::string_view key) {
         return getTTL(key);
     }
 
-    int cmdExpire(const std::string &key, int ttl) {
-        preCommand({key});
-        return setTTL(key, ttl);
+    long long cmdExpire(std::string_view key, long long ttl) {
+        auto ret = setTTL(key, std::chrono::seconds(ttl));
+        return ret < 0 ? ret : ret / 1000;
+    }
+
+    long long cmdPExpire(std::string_view key, long long ttl) {
+        return setTTL(key, std::chrono::milliseconds(ttl));
+    }
+
+    bool cmdPExpireAt(std::string_view key, long long when) {
+        return setExpireAt(key, ldsShard::time_point{std::chrono::milliseconds(when)});
     }
 
     /* STRING OPERATIONS */
-    std::optional<std::string> cmdGet(const std::string &key) {
-        preCommand({key});
-        auto ret = getStr(key);
-        postAccessCommand({key});
-        return ret;
+    std::optional<std::string> cmdGet(std::string_view key) {
+        return getStr(key);
     }
 
-    void cmdSet(const std::string &key, const std::string &val) {
-        preCommand({key});
+    void cmdSet(std::string_view key, std::string_view val) {
         setStr(key, val);
-        postAccessCommand({key});
     }
 
     /* LIST OPERATIONS */
-    llen_t cmdLlen(const std::string &key) {
-        preCommand({key});
-        auto ret = getListLen(key);
-        postAccessCommand({key});
-        return ret;
+    llen_t cmdLlen(std::string_view key) {
+        return getListLen(key);
     }
 
-    llen_t cmdPush(const std::string &key, const std::vector<std::string> &vals, unsigned where) {
-        preCommand({key});
-        auto ret = pushList(key, vals, where);
-        postAccessCommand({key});
-        return ret;
+    llen_t cmdPush(std::string_view key, std::span<const std::string_view> vals, unsigned where) {
+        return pushList(key, vals, where);
     }
 
-    std::optional<std::string> cmdPop(const std::string &key, unsigned where) {
-        preCommand({key});
-        auto ret = popList(key, where);
-        postAccessCommand({key});
-        return ret;
+    std::optional<std::string> cmdPop(std::string_view key, unsigned where) {
+        return popList(key, where);
     }
 
-    std::vector<std::string> cmdLrange(const std::string &key, int start, int stop) {
-        preCommand({key});
-        auto ret = rangeList(key, start, stop);
-        postAccessCommand({key});
-        return ret;
+    std::vector<std::string> cmdLrange(std::string_view key, long long start, long long stop) {
+        return rangeList(key, start, stop);
+    }
+
+    std::optional<std::string> cmdLindex(std::string_view key, long long idx) {
+        return indexList(key, idx);
+    }
+
+    void cmdLset(std::string_view key, long long idx, std::string_view val) {
+        setList(key, idx, val);
+    }
+
+    void cmdLtrim(std::string_view key, long long start, long long stop) {
+        trimList(key, start, stop);
     }
 
     /* SET OPERATIONS */
-    slen_t cmdScard(const std::string &key) {
-        preCommand({key});
-        auto ret = getSetLen(key);
-        postAccessCommand({key});
-        return ret;
+    slen_t cmdScard(std::string_view key) {
+        return getSetLen(key);
     }
 
-    std::vector<std::string> cmdSmembers(const std::string &key) {
-        preCommand({key});
-        auto ret = getSetMems(key);
-        postAccessCommand({key});
-        return ret;
+    std::vector<std::string> cmdSmembers(std::string_view key) {
+        return getSetMems(key);
     }
 
-    std::vector<std::string> cmdSinter(const std::vector<std::string> &keys) {
-        preCommand(keys);
-        auto ret = getSetInter(keys);
-        postAccessCommand(keys);
-        return ret;
+    uint64_t cmdSscan(std::string_view key, uint64_t cursor, size_t count, std::string_view pattern,
+                      std::vector<std::string> &out) {
+        return scanSet(key, cursor, count, pattern, out);
+    }
+
+    bool cmdSismember(std::string_view key, std::string_view member) {
+        return isSetMember(key, member);
+    }
+
+    std::vector<std::string> cmdSetOp(std::span<const std::string_view> keys, unsigned op) {
+        return getSetOp(keys, op);
+    }
+
+    slen_t cmdSetOpStore(std::string_view dest, std::span<const std::string_view> keys, unsigned op) {
+        return storeSetOp(dest, keys, op);
+    }
+
+    slen_t cmdSadd(std::string_view key, std::span<const std::string_view> vals) {
+        return insertSet(key, vals);
+    }
+
+    slen_t cmdSrem(std::string_view key, std::span<const std::string_view> vals) {
+        return removeSet(key, vals);
     }
 
-    slen_t cmdSadd(const std::string &key, const std::vector<std::string> &vals) {
-        preCommand({key});
-        auto ret = insertSet(key, vals);
-        postAccessCommand({key});
+    /* Execute a command through its handler, leave ret.type as RET_UNKNOWN if ldsDb does not handle it */
+    void execute(const ldsCmd &cmd, ldsRet &ret) {
+        if (cmd.spec->handler == nullptr) {
+            ret.type = RET_UNKNOWN;
+            return;
+        }
+        LOG_DEBUG("[COMMAND] " + std::string(cmd.spec->name) + ", args: " + formatArgs(cmd));
+        // writes make room first, only those that may grow memory are refused when it cannot be made
+        if ((cmd.spec->flags & CMDF_WRITE) && !freeMemory() && (cmd.spec->flags & CMDF_DENYOOM)) {
+            throw std::runtime_error("OOM command not allowed when used memory > 'maxmemory'");
+        }
+        cmd.spec->handler(*this, cmd, ret);
+    }
+
+    /* Lock the shard owning key so that single-key commands on that shard can run without relocking.
+     * Only commands flagged CMDF_SINGLE_KEY whose key maps to the same shard
+     * may be executed while the returned lock is alive.
+     * */
+    ldsBatchLock lockForBatch(std::string_view key, bool unique) {
+        return {shardOf(key), unique};
+    }
+
+    /* Check if a key exists in db */
+    bool findKey(std::string_view key) {
+        auto &shard = shardOf(key);
+        SHARD_SLOCK(slock, shard);
+        return shard.findLive(key) != shard.keys.end();
+    }
+
+    /* Set the memory limit and eviction policy, and the LFU counter tuning shared by all dbs
+     * Precondition:
+     * - db is not used by other threads yet
+     * */
+    void setMaxMemory(const ldsConfig &config) {
+        maxmemory = config.maxmemory;
+        maxmemory_policy = config.maxmemory_policy;
+        maxmemory_samples = config.maxmemory_samples;
+        lfu_log_factor = config.lfu_log_factor;
+        lfu_decay_time = config.lfu_decay_time;
+    }
+
+    /* Estimated memory used by keys and values */
+    int64_t usedMemory() const {
+        return used_memory.load(std::memory_order_relaxed);
+    }
+
+    uint64_t evictedKeys() const {
+        return evicted_keys.load(std::memory_order_relaxed);
+    }
+
+    /* Number of keys of each value type, including expired keys not deleted yet */
+    std::array<int64_t, TYPE_COUNT> keysByType() const {
+        std::array<int64_t, TYPE_COUNT> ret{};
+        for (auto &shard: shards) {
+            for (unsigned type = 0; type < TYPE_COUNT; type++) {
+                ret[type] += shard.type_keys[type].load(std::memory_order_relaxed);
+            }
+        }
         return ret;
     }
 
-    slen_t cmdSrem(const std::string &key, const std::vector<std::string> &vals) {
-        preCommand({key});
-        auto ret = removeSet(key, vals);
-        postAccessCommand({key});
+    uint64_t expiredKeys() const {
+        uint64_t ret = 0;
+        for (auto &shard: shards) {
+            ret += shard.expired_keys.load(std::memory_order_relaxed);
+        }
         return ret;
     }
 
-    void execute(const ldsCmd &cmd, ldsRet &ret) {
-        auto args = parseArgs(cmd.args);
-        switch (cmd.cmd) {
-            case CMD_GKEYS:
-                LOGGER.info(std::string("[COMMAND] Keys, args: ") + cmd.args);
-                if (args.size() != 0) {
-                    throw std::runtime_error("Invalid number of arguments for KEYS command");
-                }
-                ret.ptr = new std::vector<std::string>(cmdKeys());
-                ret.type = RET_LIST;
-                break;
-            case CMD_GDEL:
-                LOGGER.info(std::string("[COMMAND] Del, args: ") + cmd.args);
-                if (args.size() != 1) {
-                    throw std::runtime_error("Invalid number of arguments for DEL command");
-                }
-                ret.ptr = new bool(cmdDel(args[0]));
-                ret.type = RET_BOOL;
-                break;
-            case CMD_GFLUSHDB:
-                LOGGER.info(std::string("[COMMAND] FlushDB, args: ") + cmd.args);
-                if (args.size() != 0) {
-                    throw std::runtime_error("Invalid number of arguments for FLUSHDB command");
-                }
-                cmdFlush();
-                ret.ptr = nullptr;
-                ret.type = RET_OK;
-                break;
-            case CMD_GTTL:
-                LOGGER.info(std::string("[COMMAND] Ttl, args: ") + cmd.args);
-                if (args.size() != 1) {
-                    throw std::runtime_error("Invalid number of arguments for TTL command");
-                }
-                ret.ptr = new int(cmdTTL(args[0]));
-                ret.type = RET_INT;
-                break;
-            case CMD_GEXPIRE:
-                LOGGER.info(std::string("[COMMAND] Expire, args: ") + cmd.args);
-                if (args.size() != 2) {
-                    throw std::runtime_error("Invalid number of arguments for EXPIRE command");
-                }
-                ret.ptr = new int(cmdExpire(args[0], std::stoi(args[1])));
-                ret.type = RET_INT;
-                break;
-            case CMD_RPUSH:
-            case CMD_LPUSH:
-                LOGGER.info(std::string("[COMMAND] Push, args: ") + cmd.args);
-                if (args.size() < 2) {
-                    throw std::runtime_error("Invalid number of arguments for RPUSH/LPUSH command");
-                }
-                ret.ptr = new llen_t(
-                        cmdPush(args[0], {args.begin() + 1, args.end()}, cmd.cmd == CMD_RPUSH ? LBACK : LFRONT));
-                ret.type = RET_INT;
-                break;
-            case CMD_LLEN:
-                LOGGER.info(std::string("[COMMAND] Llen, args: ") + cmd.args);
-                if (args.size() != 1) {
-                    throw std::runtime_error("Invalid number of arguments for LLEN command");
-                }
-                ret.ptr = new llen_t(cmdLlen(args[0]));
-                ret.type = RET_INT;
-                break;
-            case CMD_LPOP:
-            case CMD_RPOP: {
-                LOGGER.info(std::string("[COMMAND] Pop, args: ") + cmd.args);
-                if (args.size() != 1) {
-                    throw std::runtime_error("Invalid number of arguments for LPOP/RPOP command");
-                }
+    /* Lock every shard, in ascending order, publishing a write only once all of them are held */
+    std::list<ldsShardLock> lockAll(bool unique) {
+        std::list<ldsShardLock> locks;
+        for (auto &shard: shards) {
+            locks.emplace_back(shard, unique, false);
+        }
+        if (unique) {
+            notifyWrite();
+        }
+        return locks;
+    }
 
-                auto tmp = cmdPop(args[0], cmd.cmd == CMD_LPOP ? LFRONT : LBACK);
-                ret.ptr = tmp ? new std::string(*tmp) : nullptr;
-                ret.type = RET_STR;
-                break;
+    /* Lock a single shard for writing, without going through the write hook */
+    std::unique_lock<std::shared_timed_mutex> lockShard(size_t idx) {
+        return std::unique_lock<std::shared_timed_mutex>{shards[idx].mtx};
+    }
+
+    /* Call f on every live key of a shard and its entry
+     * Precondition:
+     * - hold a lock on the shard, or run in a process forked while it was held
+     * */
+    void forEachKey(size_t idx, const std::function<void(const ldsString &, const ldsKey &)> &f) {
+        auto now = std::chrono::system_clock::now();
+        auto &shard = shards[idx];
+        for (auto it = shard.keys.begin(); it != shard.keys.end(); it++) {
+            if (!shard.isExpired(it, now)) {
+                f(it->first, it->second);
             }
-            case CMD_LRANGE:
-                LOGGER.info(std::string("[COMMAND] Lrange, args: ") + cmd.args);
-                if (args.size() != 3) {
-                    throw std::runtime_error("Invalid number of arguments for LRANGE command");
-                }
-                ret.ptr = new std::vector<std::string>(cmdLrange(args[0], std::stoi(args[1]), std::stoi(args[2])));
-                ret.type = RET_LIST;
-                break;
-            case CMD_SADD:
-                LOGGER.info(std::string("[COMMAND] Sadd, args: ") + cmd.args);
-                if (args.size() < 2) {
-                    throw std::runtime_error("Invalid number of arguments for SADD command");
-                }
-                ret.ptr = new slen_t(cmdSadd(args[0], {args.begin() + 1, args.end()}));
-                ret.type = RET_INT;
-                break;
-            case CMD_SREM:
-                LOGGER.info(std::string("[COMMAND] Srem, args: ") + cmd.args);
-                if (args.size() < 2) {
-                    throw std::runtime_error("Invalid number of arguments for SREM command");
-                }
-                ret.ptr = new slen_t(cmdSrem(args[0], {args.begin() + 1, args.end()}));
-                ret.type = RET_INT;
-                break;
-            case CMD_SCARD:
-                LOGGER.info(std::string("[COMMAND] Scard, args: ") + cmd.args);
-                if (args.size() != 1) {
-                    throw std::runtime_error("Invalid number of arguments for SCARD command");
-                }
-                ret.ptr = new slen_t(cmdScard(args[0]));
-                ret.type = RET_INT;
-                break;
-            case CMD_SMEMBERS:
-                LOGGER.info(std::string("[COMMAND] Smembers, args: ") + cmd.args);
-                if (args.size() != 1) {
-                    throw std::runtime_error("Invalid number of arguments for SMEMBERS command");
-                }
-                ret.ptr = new std::vector<std::string>(cmdSmembers(args[0]));
-                ret.type = RET_LIST;
-                break;
-            case CMD_SINTER:
-                LOGGER.info(std::string("[COMMAND] Sinter, args: ") + cmd.args);
-                if (args.size() < 2) {
-                    throw std::runtime_error("Invalid number of arguments for SINTER command");
-                }
-                ret.ptr = new std::vector<std::string>(cmdSinter({args.begin(), args.end()}));
-                ret.type = RET_LIST;
-                break;
-            case CMD_SGET: {
-                LOGGER.info(std::string("[COMMAND] Get, args: ") + cmd.args);
-                if (args.size() != 1) {
-                    throw std::runtime_error("Invalid number of arguments for GET command");
-                }
-                auto tmp = cmdGet(args[0]);
-                ret.ptr = tmp ? new std::string(*tmp) : nullptr;
-                ret.type = RET_STR;
-                break;
-            }
-            case CMD_SSET:
-                LOGGER.info(std::string("[COMMAND] Set, args: ") + cmd.args);
-                if (args.size() != 2) {
-                    throw std::runtime_error("Invalid number of arguments for SET command");
-                }
-                cmdSet(args[0], args[1]);
-                ret.ptr = nullptr;
-                ret.type = RET_OK;
-                break;
-            default:
-                ret.ptr = nullptr;
-                ret.type = RET_UNKNOWN;
         }
     }
 
-    /* Check if a key exists in db */
-    bool findKey(const std::string &key) {
-        SLOCK(slock_key, keys_mtx);
-        return keys.find(key) != keys.end();
+    /* Call f on every live key and its entry
+     * Precondition:
+     * - hold locks on every shard, or run in a process forked while they were held
+     * */
+    void forEachKey(const std::function<void(const ldsString &, const ldsKey &)> &f) {
+        for (size_t idx = 0; idx < SHARD_COUNT; idx++) {
+            forEachKey(idx, f);
+        }
+    }
+
+    /* Insert a key read from a snapshot into shard idx, replacing any existing value
+     * Return false if the key does not belong to that shard
+     * Precondition:
+     * - hold the lock returned by lockShard(idx)
+     * */
+    bool loadKey(size_t idx, std::string_view key, ldsVal &&val, std::optional<ldsShard::time_point> ttl) {
+        if (shardIndex(key) != idx) {
+            return false;
+        }
+        auto &shard = shards[idx];
+        auto key_iter = shard.writeKV(key, std::move(val));
+        if (ttl.has_value()) {
+            shard.setExpiry(key_iter, ttl.value());
+        }
+        return true;
+    }
+};
+
+/* COMMAND HANDLERS
+ * Argument counts are checked against CMD_TABLE by the parser.
+ * */
+
+void handleKeys(ldsDb &db, const ldsCmd &, ldsRet &ret) {
+    ret.setList(db.cmdKeys());
+}
+
+/* Options of SCAN and SSCAN, parsed from argument first on: cursor [MATCH pattern] [COUNT count] */
+struct ldsScanArgs {
+    uint64_t cursor = 0;
+    size_t count = SCAN_DEFAULT_COUNT;
+    std::string_view pattern = "*";
+
+    ldsScanArgs(const ldsCmd &cmd, size_t first) {
+        auto arg = cmd.argv[first];
+        auto res = std::from_chars(arg.data(), arg.data() + arg.size(), cursor);
+        if (res.ec != std::errc{} || res.ptr != arg.data() + arg.size()) {
+            throw std::runtime_error("Invalid cursor: " + std::string(arg));
+        }
+        for (size_t i = first + 1; i < cmd.argv.size(); i += 2) {
+            std::string opt{cmd.argv[i]};
+            for (auto &c: opt) {
+                c = asciiLower(c);
+            }
+            if (i + 1 >= cmd.argv.size() || (opt != "match" && opt != "count")) {
+                throw std::runtime_error("Syntax error near: " + std::string(cmd.argv[i]));
+            }
+            if (opt == "match") {
+                pattern = cmd.argv[i + 1];
+            } else {
+                auto val = parseInt(cmd.argv[i + 1]);
+                if (val < 1) {
+                    throw std::runtime_error("COUNT must be positive");
+                }
+                count = std::min<size_t>(val, SCAN_MAX_COUNT);
+            }
+        }
     }
 };
+
+/* Reply with the next cursor and the list of keys or members found */
+void setScanReply(ldsRet &ret, uint64_t cursor, std::vector<std::string> &&found) {
+    std::vector<ldsRet> reply(2);
+    reply[0].setStr(std::to_string(cursor));
+    reply[1].setList(std::move(found));
+    ret.setArray(std::move(reply));
+}
+
+void handleScan(ldsDb &db, const ldsCmd &cmd, ldsRet &ret) {
+    ldsScanArgs args(cmd, 0);
+    std::vector<std::string> found;
+    auto cursor = db.cmdScan(args.cursor, args.count, args.pattern, found);
+    setScanReply(ret, cursor, std::move(found));
+}
+
+void handleSscan(ldsDb &db, const ldsCmd &cmd, ldsRet &ret) {
+    ldsScanArgs args(cmd, 1);
+    std::vector<std::string> found;
+    auto cursor = db.cmdSscan(cmd.argv[0], args.cursor, args.count, args.pattern, found);
+    setScanReply(ret, cursor, std::move(found));
+}
+
+void handleDel(ldsDb &db, const ldsCmd &cmd, ldsRet &ret) {
+    ret.setBool(db.cmdDel(cmd.argv[0]));
+}
+
+void handleFlushdb(ldsDb &db, const ldsCmd &, ldsRet &ret) {
+    db.cmdFlush();
+    ret.setOk();
+}
+
+void handleTtl(ldsDb &db, const ldsCmd &cmd, ldsRet &ret) {
+    ret.setInt(db.cmdTTL(cmd.argv[0]));
+}
+
+void handlePttl(ldsDb &db, const ldsCmd &cmd, ldsRet &ret) {
+    ret.setInt(db.cmdPTTL(cmd.argv[0]));
+}
+
+void handleExpire(ldsDb &db, const ldsCmd &cmd, ldsRet &ret) {
+    ret.setInt(db.cmdExpire(cmd.argv[0], parseInt(cmd.argv[1])));
+}
+
+void handlePexpire(ldsDb &db, const ldsCmd &cmd, ldsRet &ret) {
+    ret.setInt(db.cmdPExpire(cmd.argv[0], parseInt(cmd.argv[1])));
+}
+
+void handlePexpireat(ldsDb &db, const ldsCmd &cmd, ldsRet &ret) {
+    ret.setInt(db.cmdPExpireAt(cmd.argv[0], parseInt(cmd.argv[1])));
+}
+
+void handleObject(ldsDb &db, const ldsCmd &cmd, ldsRet &ret) {
+    std::string sub{cmd.argv[0]};
+    for (auto &c: sub) {
+        c = asciiLower(c);
+    }
+    if (sub != "freq") {
+        throw std::runtime_error("Unknown OBJECT subcommand: " + std::string(cmd.argv[0]));
+    }
+    auto freq = db.cmdObjectFreq(cmd.argv[1]);
+    freq ? ret.setInt(*freq) : ret.setNil();
+}
+
+void handleGet(ldsDb &db, const ldsCmd &cmd, ldsRet &ret) {
+    auto tmp = db.cmdGet(cmd.argv[0]);
+    tmp ? ret.setStr(std::move(*tmp)) : ret.setNil();
+}
+
+void handleSet(ldsDb &db, const ldsCmd &cmd, ldsRet &ret) {
+    db.cmdSet(cmd.argv[0], cmd.argv[1]);
+    ret.setOk();
+}
+
+void handleLlen(ldsDb &db, const ldsCmd &cmd, ldsRet &ret) {
+    ret.setInt(db.cmdLlen(cmd.argv[0]));
+}
+
+void handlePush(ldsDb &db, const ldsCmd &cmd, ldsRet &ret) {
+    ret.setInt(db.cmdPush(cmd.argv[0], cmd.argv.from(1), cmd.cmd == CMD_RPUSH ? LBACK : LFRONT));
+}
+
+void handlePop(ldsDb &db, const ldsCmd &cmd, ldsRet &ret) {
+    auto tmp = db.cmdPop(cmd.argv[0], cmd.cmd == CMD_LPOP ? LFRONT : LBACK);
+    tmp ? ret.setStr(std::move(*tmp)) : ret.setNil();
+}
+
+void handleLrange(ldsDb &db, const ldsCmd &cmd, ldsRet &ret) {
+    ret.setList(db.cmdLrange(cmd.argv[0], parseInt(cmd.argv[1]), parseInt(cmd.argv[2])));
+}
+
+void handleLindex(ldsDb &db, const ldsCmd &cmd, ldsRet &ret) {
+    auto tmp = db.cmdLindex(cmd.argv[0], parseInt(cmd.argv[1]));
+    tmp ? ret.setStr(std::move(*tmp)) : ret.setNil();
+}
+
+void handleLset(ldsDb &db, const ldsCmd &cmd, ldsRet &ret) {
+    db.cmdLset(cmd.argv[0], parseInt(cmd.argv[1]), cmd.argv[2]);
+    ret.setOk();
+}
+
+void handleLtrim(ldsDb &db, const ldsCmd &cmd, ldsRet &ret) {
+    db.cmdLtrim(cmd.argv[0], parseInt(cmd.argv[1]), parseInt(cmd.argv[2]));
+    ret.setOk();
+}
+
+void handleSadd(ldsDb &db, const ldsCmd &cmd, ldsRet &ret) {
+    ret.setInt(db.cmdSadd(cmd.argv[0], cmd.argv.from(1)));
+}
+
+void handleSrem(ldsDb &db, const ldsCmd &cmd, ldsRet &ret) {
+    ret.setInt(db.cmdSrem(cmd.argv[0], cmd.argv.from(1)));
+}
+
+void handleScard(ldsDb &db, const ldsCmd &cmd, ldsRet &ret) {
+    ret.setInt(db.cmdScard(cmd.argv[0]));
+}
+
+void handleSmembers(ldsDb &db, const ldsCmd &cmd, ldsRet &ret) {
+    ret.setList(db.cmdSmembers(cmd.argv[0]));
+}
+
+void handleSismember(ldsDb &db, const ldsCmd &cmd, ldsRet &ret) {
+    ret.setInt(db.cmdSismember(cmd.argv[0], cmd.argv[1]));
+}
+
+static unsigned setOpOf(unsigned short cmd) {
+    switch (cmd) {
+        case CMD_SINTER:
+        case CMD_SINTERSTORE:
+            return SETOP_INTER;
+        case CMD_SUNION:
+        case CMD_SUNIONSTORE:
+            return SETOP_UNION;
+        default:
+            return SETOP_DIFF;
+    }
+}
+
+void handleSetOp(ldsDb &db, const ldsCmd &cmd, ldsRet &ret) {
+    ret.setList(db.cmdSetOp(cmd.argv.from(0), setOpOf(cmd.cmd)));
+}
+
+void handleSetOpStore(ldsDb &db, const ldsCmd &cmd, ldsRet &ret) {
+    ret.setInt(db.cmdSetOpStore(cmd.argv[0], cmd.argv.from(1), setOpOf(cmd.cmd)));
+}
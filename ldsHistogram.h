@@ -0,0 +1,49 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+// Latency histograms: values below 2^LATENCY_SUB_BITS ns have a bucket each, every power of two above is split
+// into 2^LATENCY_SUB_BITS buckets, which bounds the error of a percentile to about 6%.
+// Values of 2^LATENCY_MAX_BITS ns (about a minute) and above fall in the last bucket.
+#define LATENCY_SUB_BITS 4
+#define LATENCY_MAX_BITS 36
+
+constexpr size_t LATENCY_BUCKETS = (LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS;
+
+/* Bucket of a latency in nanoseconds */
+constexpr size_t latencyBucket(uint64_t ns) {
+    ns = std::min<uint64_t>(ns, (1ULL << LATENCY_MAX_BITS) - 1);
+    if (ns < (1ULL << LATENCY_SUB_BITS)) {
+        return ns;
+    }
+    unsigned magnitude = std::bit_width(ns) - 1;
+    unsigned shift = magnitude - LATENCY_SUB_BITS;
+    return ((shift + 1) << LATENCY_SUB_BITS) + ((ns >> shift) & ((1ULL << LATENCY_SUB_BITS) - 1));
+}
+
+/* Middle of the range of latencies in nanoseconds falling in a bucket */
+constexpr double latencyOfBucket(size_t bucket) {
+    if (bucket < (1ULL << LATENCY_SUB_BITS)) {
+        return (double) bucket;
+    }
+    unsigned shift = (bucket >> LATENCY_SUB_BITS) - 1;
+    uint64_t low = ((1ULL << LATENCY_SUB_BITS) + (bucket & ((1ULL << LATENCY_SUB_BITS) - 1))) << shift;
+    return (double) low + (double) (1ULL << shift) / 2;
+}
+
+/* Latency in nanoseconds below which a fraction q of the count values of a histogram fall */
+inline double latencyPercentile(const std::array<uint64_t, LATENCY_BUCKETS> &buckets, uint64_t count, double q) {
+    uint64_t rank = (uint64_t) (q * (double) count);
+    uint64_t seen = 0;
+    for (size_t b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen > rank) {
+            return latencyOfBucket(b);
+        }
+    }
+    return 0;
+}
@@ -1,13 +1,98 @@
 #pragma once
 
+#include <atomic>
 #include <chrono>
-#include <string>
-#include <list>
+#include <cstdint>
+#include <optional>
+#include <random>
 
 #include "ldsVal.h"
+#include "ldsConfig.h"
 
+// LFU counter of new keys, so that they are not evicted before they had a chance to be accessed
+#define LFU_INIT_VAL 5
+
+// LFU counter tuning, set from ldsConfig at startup
+inline unsigned lfu_log_factor = LFU_LOG_FACTOR;
+inline unsigned lfu_decay_time = LFU_DECAY_TIME;
+
+/* A keyspace entry: the value, stored inline, and its metadata */
 struct ldsKey {
-    std::string key;
-    std::list<ldsVal>::iterator val_iter;
+    ldsVal val;
     std::optional<std::chrono::time_point<std::chrono::system_clock>> ttl = std::nullopt;
+    // Access frequency: minutes since epoch of the last decay in the high 16 bits, logarithmic counter in the low 8
+    mutable std::atomic<uint32_t> lfu{0};
+    // Last access time in milliseconds since epoch, may be updated while holding only a shared lock
+    mutable std::atomic<int64_t> last_access{0};
+    // Estimated memory of the entry when its shard last accounted it
+    int64_t mem = 0;
+
+    ldsKey() = default;
+
+    explicit ldsKey(ldsVal &&val) : val(std::move(val)) {
+        auto now = nowMs();
+        last_access.store(now, std::memory_order_relaxed);
+        lfu.store((toMinutes(now) << 8) | LFU_INIT_VAL, std::memory_order_relaxed);
+    }
+
+    ldsKey(ldsKey &&other) noexcept: val(std::move(other.val)), ttl(other.ttl),
+                                     lfu(other.lfu.load(std::memory_order_relaxed)),
+                                     last_access(other.last_access.load(std::memory_order_relaxed)),
+                                     mem(other.mem) {}
+
+    ldsKey &operator=(ldsKey &&other) noexcept {
+        val = std::move(other.val);
+        ttl = other.ttl;
+        lfu.store(other.lfu.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        last_access.store(other.last_access.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        mem = other.mem;
+        return *this;
+    }
+
+    /* Record an access: update the access time and the frequency counter, which grows
+     * with probability 1 / ((counter - LFU_INIT_VAL) * lfu_log_factor + 1) once decayed.
+     * May be called while holding only a shared lock, concurrent updates may be lost.
+     * */
+    void touch() const {
+        auto now = nowMs();
+        last_access.store(now, std::memory_order_relaxed);
+
+        thread_local std::minstd_rand rng{std::random_device{}()};
+        auto minutes = toMinutes(now);
+        uint32_t counter = frequencyAt(minutes);
+        if (counter < 255) {
+            double base = counter > LFU_INIT_VAL ? counter - LFU_INIT_VAL : 0;
+            if (std::uniform_real_distribution<double>{0, 1}(rng) < 1.0 / (base * lfu_log_factor + 1)) {
+                counter++;
+            }
+        }
+        lfu.store((minutes << 8) | counter, std::memory_order_relaxed);
+    }
+
+    /* Frequency counter, decremented by one per lfu_decay_time minutes elapsed since it was last updated */
+    uint32_t frequency() const {
+        return frequencyAt(toMinutes(nowMs()));
+    }
+
+private:
+    static int64_t nowMs() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    // minutes are kept modulo 2^16, about 45 days
+    static uint32_t toMinutes(int64_t ms) {
+        return (uint32_t) (ms / 60000) & 0xffff;
+    }
+
+    uint32_t frequencyAt(uint32_t minutes) const {
+        auto val = lfu.load(std::memory_order_relaxed);
+        uint32_t counter = val & 0xff;
+        if (lfu_decay_time == 0) {
+            return counter;
+        }
+        uint32_t elapsed = (minutes - (val >> 8)) & 0xffff;
+        uint32_t periods = elapsed / lfu_decay_time;
+        return periods >= counter ? 0 : counter - periods;
+    }
 };
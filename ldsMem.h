@@ -0,0 +1,14 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+
+// Estimated bytes a node-based container spends per node beyond the element: links, cached hash, allocator header
+#define MEM_NODE_OVERHEAD 32
+
+/* Heap bytes owned by a string, 0 when it fits in the string's inline buffer */
+template<class Alloc>
+size_t strHeapSize(const std::basic_string<char, std::char_traits<char>, Alloc> &s) {
+    static const size_t inline_capacity = std::basic_string<char, std::char_traits<char>, Alloc>{}.capacity();
+    return s.capacity() > inline_capacity ? s.capacity() + 1 : 0;
+}
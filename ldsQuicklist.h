@@ -0,0 +1,335 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <list>
+#include <vector>
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+
+#include "ldsMem.h"
+#include "ldsAlloc.h"
+
+// Target size in bytes of a packed block; a single larger element gets a block of its own
+#define QL_BLOCK_BYTES 8192
+
+/* A list of strings stored as a doubly linked chain of packed blocks.
+ * Each block holds its elements contiguously, every element encoded as
+ *   <length varint> <bytes> <backlen>
+ * where backlen is the size of the length varint plus the bytes, written so that it can be decoded
+ * from its last byte backwards. Pushing and popping at either end touch only the end block,
+ * and positional access skips whole blocks by their element count.
+ * */
+class ldsQuicklist {
+private:
+    struct block {
+        std::string buf;
+        uint32_t count = 0;
+    };
+
+    using blockList = std::list<block, ldsAllocator<block>>;
+
+    blockList blocks;
+    size_t len = 0;
+    // encoded bytes over all blocks
+    size_t bytes = 0;
+
+    static size_t varintSize(size_t v) {
+        size_t n = 1;
+        while (v >= 0x80) {
+            v >>= 7;
+            n++;
+        }
+        return n;
+    }
+
+    /* Size of an encoded element with n bytes of data */
+    static size_t encodedSize(size_t n) {
+        size_t body = varintSize(n) + n;
+        return body + varintSize(body);
+    }
+
+    static void encode(std::string_view data, std::string &out) {
+        auto putVarint = [&out](size_t v) {
+            while (v >= 0x80) {
+                out += (char) ((v & 0x7f) | 0x80);
+                v >>= 7;
+            }
+            out += (char) v;
+        };
+
+        putVarint(data.size());
+        out += data;
+
+        // backlen: the varint bytes in reverse order, so the lowest group is last
+        size_t body = varintSize(data.size()) + data.size();
+        char tmp[10];
+        size_t n = 0;
+        while (body >= 0x80) {
+            tmp[n++] = (char) ((body & 0x7f) | 0x80);
+            body >>= 7;
+        }
+        tmp[n++] = (char) body;
+        while (n > 0) {
+            out += tmp[--n];
+        }
+    }
+
+    /* Decode the element starting at off, set next to the offset right after it */
+    static std::string_view decode(const std::string &buf, size_t off, size_t &next) {
+        size_t start = off;
+        size_t n = 0;
+        int shift = 0;
+        unsigned char c;
+        do {
+            c = (unsigned char) buf[off++];
+            n |= (size_t) (c & 0x7f) << shift;
+            shift += 7;
+        } while (c & 0x80);
+        std::string_view data{buf.data() + off, n};
+        off += n;
+        next = off + varintSize(off - start);
+        return data;
+    }
+
+    /* Offset of the element that ends right before end */
+    static size_t prevOffset(const std::string &buf, size_t end) {
+        size_t body = 0;
+        int shift = 0;
+        size_t pos = end;
+        unsigned char c;
+        do {
+            c = (unsigned char) buf[--pos];
+            body |= (size_t) (c & 0x7f) << shift;
+            shift += 7;
+        } while (c & 0x80);
+        return pos - body;
+    }
+
+    /* Offset of the i-th element of a block */
+    static size_t offsetOf(const block &b, size_t i) {
+        if (i > b.count / 2) {
+            size_t off = b.buf.size();
+            for (size_t k = b.count; k > i; k--) {
+                off = prevOffset(b.buf, off);
+            }
+            return off;
+        }
+        size_t off = 0;
+        for (size_t k = 0; k < i; k++) {
+            decode(b.buf, off, off);
+        }
+        return off;
+    }
+
+    /* Find the block holding element idx, set local to its index within the block.
+     * Precondition:
+     * - idx < size()
+     * */
+    blockList::iterator seek(size_t idx, size_t &local) {
+        if (idx < len / 2) {
+            auto it = blocks.begin();
+            while (idx >= it->count) {
+                idx -= it->count;
+                it++;
+            }
+            local = idx;
+            return it;
+        }
+        size_t from_back = len - 1 - idx;
+        auto it = std::prev(blocks.end());
+        while (from_back >= it->count) {
+            from_back -= it->count;
+            it--;
+        }
+        local = it->count - 1 - from_back;
+        return it;
+    }
+
+    /* Split a block that has grown past the block size in two halves */
+    void splitIfLarge(blockList::iterator it) {
+        if (it->buf.size() <= QL_BLOCK_BYTES || it->count < 2) {
+            return;
+        }
+        size_t half = it->count / 2;
+        size_t off = offsetOf(*it, half);
+        block tail{it->buf.substr(off), it->count - (uint32_t) half};
+        it->buf.resize(off);
+        it->buf.shrink_to_fit();
+        it->count = half;
+        blocks.insert(std::next(it), std::move(tail));
+    }
+
+public:
+    size_t size() const {
+        return len;
+    }
+
+    bool empty() const {
+        return len == 0;
+    }
+
+    /* Estimated heap bytes used by the list, in constant time */
+    size_t memoryUsage() const {
+        return bytes + blocks.size() * (sizeof(block) + MEM_NODE_OVERHEAD);
+    }
+
+    void pushFront(std::string_view data) {
+        if (blocks.empty() || blocks.front().buf.size() + encodedSize(data.size()) > QL_BLOCK_BYTES) {
+            blocks.emplace_front();
+        }
+        std::string enc;
+        encode(data, enc);
+        auto &b = blocks.front();
+        b.buf.insert(0, enc);
+        b.count++;
+        bytes += enc.size();
+        len++;
+    }
+
+    void pushBack(std::string_view data) {
+        if (blocks.empty() || blocks.back().buf.size() + encodedSize(data.size()) > QL_BLOCK_BYTES) {
+            blocks.emplace_back();
+        }
+        auto &b = blocks.back();
+        auto before = b.buf.size();
+        encode(data, b.buf);
+        bytes += b.buf.size() - before;
+        b.count++;
+        len++;
+    }
+
+    /* Remove and return the first element
+     * Precondition:
+     * - list is not empty
+     * */
+    std::string popFront() {
+        auto &b = blocks.front();
+        size_t next;
+        std::string ret{decode(b.buf, 0, next)};
+        bytes -= next;
+        if (--b.count == 0) {
+            blocks.pop_front();
+        } else {
+            b.buf.erase(0, next);
+        }
+        len--;
+        return ret;
+    }
+
+    /* Remove and return the last element
+     * Precondition:
+     * - list is not empty
+     * */
+    std::string popBack() {
+        auto &b = blocks.back();
+        size_t off = prevOffset(b.buf, b.buf.size());
+        size_t next;
+        std::string ret{decode(b.buf, off, next)};
+        bytes -= b.buf.size() - off;
+        if (--b.count == 0) {
+            blocks.pop_back();
+        } else {
+            b.buf.resize(off);
+        }
+        len--;
+        return ret;
+    }
+
+    /* Get the element at idx, the view is valid until the list is modified
+     * Precondition:
+     * - idx < size()
+     * */
+    std::string_view at(size_t idx) {
+        size_t local;
+        auto it = seek(idx, local);
+        size_t next;
+        return decode(it->buf, offsetOf(*it, local), next);
+    }
+
+    /* Replace the element at idx
+     * Precondition:
+     * - idx < size()
+     * */
+    void set(size_t idx, std::string_view data) {
+        size_t local;
+        auto it = seek(idx, local);
+        size_t off = offsetOf(*it, local);
+        size_t next;
+        decode(it->buf, off, next);
+        std::string enc;
+        encode(data, enc);
+        it->buf.replace(off, next - off, enc);
+        bytes += enc.size() - (next - off);
+        splitIfLarge(it);
+    }
+
+    /* Append elements start to stop, both inclusive, to out
+     * Precondition:
+     * - start <= stop < size()
+     * */
+    void range(size_t start, size_t stop, std::vector<std::string> &out) {
+        size_t local;
+        auto it = seek(start, local);
+        size_t off = offsetOf(*it, local);
+        out.reserve(out.size() + stop - start + 1);
+        for (size_t i = start; i <= stop; i++) {
+            if (local == it->count) {
+                it++;
+                local = 0;
+                off = 0;
+            }
+            out.emplace_back(decode(it->buf, off, off));
+            local++;
+        }
+    }
+
+    /* Call f on each element, front to back. The view passed to f is only valid during the call */
+    void forEach(const std::function<void(std::string_view)> &f) const {
+        for (auto &b: blocks) {
+            size_t off = 0;
+            while (off < b.buf.size()) {
+                f(decode(b.buf, off, off));
+            }
+        }
+    }
+
+    /* Keep only elements start to stop, both inclusive, dropping whole blocks where possible
+     * Precondition:
+     * - start <= stop < size()
+     * */
+    void trim(size_t start, size_t stop) {
+        size_t drop_back = len - 1 - stop;
+        while (drop_back > 0 && blocks.back().count <= drop_back) {
+            drop_back -= blocks.back().count;
+            len -= blocks.back().count;
+            bytes -= blocks.back().buf.size();
+            blocks.pop_back();
+        }
+        if (drop_back > 0) {
+            auto &b = blocks.back();
+            auto off = offsetOf(b, b.count - drop_back);
+            bytes -= b.buf.size() - off;
+            b.buf.resize(off);
+            b.count -= drop_back;
+            len -= drop_back;
+        }
+
+        size_t drop_front = start;
+        while (drop_front > 0 && blocks.front().count <= drop_front) {
+            drop_front -= blocks.front().count;
+            len -= blocks.front().count;
+            bytes -= blocks.front().buf.size();
+            blocks.pop_front();
+        }
+        if (drop_front > 0) {
+            auto &b = blocks.front();
+            auto off = offsetOf(b, drop_front);
+            bytes -= off;
+            b.buf.erase(0, off);
+            b.count -= drop_front;
+            len -= drop_front;
+        }
+    }
+};
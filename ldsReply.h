@@ -0,0 +1,235 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <variant>
+#include <charconv>
+
+#define RET_STR 0
+#define RET_INT 1
+#define RET_LIST 2
+#define RET_BOOL 3
+#define RET_OK 4
+#define RET_ERR 5
+#define RET_UNKNOWN 6
+#define RET_ARRAY 7
+
+/* Result of a command.
+ * Integers and statuses are stored inline; strings, lists and arrays are moved in, never copied.
+ * A RET_STR or RET_INT result holding no value is a nil reply.
+ * A RET_ARRAY result holds nested results, such as the cursor and the keys found by SCAN.
+ * */
+struct ldsRet {
+    unsigned short type = RET_UNKNOWN;
+    std::variant<std::monostate, long long, std::string, std::vector<std::string>, std::vector<ldsRet>> val;
+
+    void setOk() {
+        type = RET_OK;
+        val = std::monostate{};
+    }
+
+    void setNil() {
+        type = RET_STR;
+        val = std::monostate{};
+    }
+
+    void setInt(long long num) {
+        type = RET_INT;
+        val = num;
+    }
+
+    void setBool(bool b) {
+        type = RET_BOOL;
+        val = (long long) b;
+    }
+
+    void setStr(std::string &&str) {
+        type = RET_STR;
+        val = std::move(str);
+    }
+
+    void setList(std::vector<std::string> &&list) {
+        type = RET_LIST;
+        val = std::move(list);
+    }
+
+    void setArray(std::vector<ldsRet> &&array) {
+        type = RET_ARRAY;
+        val = std::move(array);
+    }
+
+    void setErr(std::string msg) {
+        type = RET_ERR;
+        val = std::move(msg);
+    }
+
+    bool isNil() const {
+        return std::holds_alternative<std::monostate>(val);
+    }
+
+    long long num() const {
+        return std::get<long long>(val);
+    }
+
+    const std::string &str() const {
+        return std::get<std::string>(val);
+    }
+
+    const std::vector<std::string> &list() const {
+        return std::get<std::vector<std::string>>(val);
+    }
+
+    const std::vector<ldsRet> &array() const {
+        return std::get<std::vector<ldsRet>>(val);
+    }
+};
+
+inline void appendInt(std::string &out, long long num) {
+    char buf[24];
+    auto res = std::to_chars(buf, buf + sizeof(buf), num);
+    out.append(buf, res.ptr);
+}
+
+/* Append a result to out as human-readable text, as served over HTTP */
+inline void writeText(const ldsRet &ret, std::string &out) {
+    switch (ret.type) {
+        case RET_STR:
+            if (ret.isNil()) {
+                out += "(nil)";
+                break;
+            }
+            out += '"';
+            out += ret.str();
+            out += '"';
+            break;
+        case RET_INT:
+            if (ret.isNil()) {
+                out += "(nil)";
+                break;
+            }
+            out += "(integer) ";
+            appendInt(out, ret.num());
+            break;
+        case RET_BOOL:
+            out += ret.num() ? "1" : "0";
+            break;
+        case RET_OK:
+            out += "OK";
+            break;
+        case RET_LIST: {
+            if (ret.isNil() || ret.list().empty()) {
+                out += "(empty list)";
+                break;
+            }
+            auto &list = ret.list();
+            for (size_t i = 0; i < list.size(); i++) {
+                if (i > 0) {
+                    out += '\n';
+                }
+                appendInt(out, (long long) i + 1);
+                out += ") \"";
+                out += list[i];
+                out += '"';
+            }
+            break;
+        }
+        case RET_ARRAY: {
+            auto &array = ret.array();
+            if (array.empty()) {
+                out += "(empty list)";
+                break;
+            }
+            // lines of an element after its first are indented past its number, as redis-cli does
+            for (size_t i = 0; i < array.size(); i++) {
+                if (i > 0) {
+                    out += '\n';
+                }
+                auto start = out.size();
+                appendInt(out, (long long) i + 1);
+                out += ") ";
+                std::string indent(out.size() - start, ' ');
+                std::string elem;
+                writeText(array[i], elem);
+                for (auto c: elem) {
+                    out += c;
+                    if (c == '\n') {
+                        out += indent;
+                    }
+                }
+            }
+            break;
+        }
+        case RET_ERR:
+            out += "ERROR: ";
+            out += ret.str();
+            break;
+        default:
+            out += "ERROR: An error occurred.";
+    }
+}
+
+/* Append a result to out as a RESP2 reply */
+inline void writeResp(const ldsRet &ret, std::string &out) {
+    auto bulk = [&out](std::string_view s) {
+        out += '$';
+        appendInt(out, (long long) s.size());
+        out += "\r\n";
+        out += s;
+        out += "\r\n";
+    };
+
+    switch (ret.type) {
+        case RET_STR:
+            if (ret.isNil()) {
+                out += "$-1\r\n";
+                break;
+            }
+            bulk(ret.str());
+            break;
+        case RET_INT:
+        case RET_BOOL:
+            if (ret.isNil()) {
+                out += "$-1\r\n";
+                break;
+            }
+            out += ':';
+            appendInt(out, ret.num());
+            out += "\r\n";
+            break;
+        case RET_OK:
+            out += "+OK\r\n";
+            break;
+        case RET_LIST: {
+            if (ret.isNil()) {
+                out += "*0\r\n";
+                break;
+            }
+            auto &list = ret.list();
+            out += '*';
+            appendInt(out, (long long) list.size());
+            out += "\r\n";
+            for (auto &s: list) {
+                bulk(s);
+            }
+            break;
+        }
+        case RET_ARRAY:
+            out += '*';
+            appendInt(out, (long long) ret.array().size());
+            out += "\r\n";
+            for (auto &elem: ret.array()) {
+                writeResp(elem, out);
+            }
+            break;
+        case RET_ERR:
+            out += "-ERR ";
+            for (auto c: ret.str()) {
+                out += (c == '\r' || c == '\n') ? ' ' : c;
+            }
+            out += "\r\n";
+            break;
+        default:
+            out += "-ERR An error occurred.\r\n";
+    }
+}
@@ -0,0 +1,477 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <variant>
+#include <algorithm>
+#include <functional>
+#include <charconv>
+#include <bit>
+#include <cstdint>
+#include <cstddef>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SET_HAVE_AVX2_KERNEL 1
+#endif
+
+#include "ldsMem.h"
+#include "ldsAlloc.h"
+
+// Limits of the compact encodings, a set outgrowing them is converted and never converted back
+#define SET_MAX_INTSET_ENTRIES 512
+#define SET_MAX_SMALL_ENTRIES 128
+#define SET_MAX_SMALL_VALUE 64
+
+#define SET_ENC_INTSET 0
+#define SET_ENC_SMALL 1
+#define SET_ENC_HASH 2
+
+/* A set of strings with an encoding picked from its contents:
+ * - intset: members are all integers, stored as a sorted array of int64
+ * - small: few short members, packed contiguously as <length varint> <bytes>
+ * - hash: open-addressing hash table with linear probing
+ * A set starts as an intset and is upgraded in place when a member or its size no longer fits.
+ * */
+class ldsSet {
+private:
+    struct smallSet {
+        ldsString buf;
+        size_t count = 0;
+    };
+
+    struct hashSet {
+        struct slot {
+            // 0 for an empty slot, hashes are forced odd
+            uint64_t hash = 0;
+            ldsString member;
+        };
+
+        std::vector<slot> slots;
+        size_t count = 0;
+        // heap bytes of the members
+        size_t heap = 0;
+        // slots are indexed by the high bits of the hash
+        int shift = 64;
+    };
+
+    std::variant<std::vector<int64_t>, smallSet, hashSet> data;
+
+    /* Parse a member as an integer, only if it is in canonical form so that it prints back unchanged */
+    static bool toInt(std::string_view s, int64_t &v) {
+        if (s.empty() || s.size() > 20) {
+            return false;
+        }
+        auto res = std::from_chars(s.data(), s.data() + s.size(), v);
+        if (res.ec != std::errc{} || res.ptr != s.data() + s.size()) {
+            return false;
+        }
+        char buf[24];
+        auto out = std::to_chars(buf, buf + sizeof(buf), v);
+        return std::string_view(buf, out.ptr - buf) == s;
+    }
+
+    static uint64_t hashOf(std::string_view s) {
+        return std::hash<std::string_view>{}(s) | 1;
+    }
+
+    /* Call f on each member of a packed small set, stop early if f returns true
+     * Return true if stopped early
+     * */
+    template<class F>
+    static bool walkSmall(const smallSet &set, F &&f) {
+        size_t off = 0;
+        while (off < set.buf.size()) {
+            size_t start = off;
+            size_t n = 0;
+            int shift = 0;
+            unsigned char c;
+            do {
+                c = (unsigned char) set.buf[off++];
+                n |= (size_t) (c & 0x7f) << shift;
+                shift += 7;
+            } while (c & 0x80);
+            if (f(std::string_view(set.buf.data() + off, n), start, off + n)) {
+                return true;
+            }
+            off += n;
+        }
+        return false;
+    }
+
+    static void appendSmall(smallSet &set, std::string_view member) {
+        size_t n = member.size();
+        while (n >= 0x80) {
+            set.buf += (char) ((n & 0x7f) | 0x80);
+            n >>= 7;
+        }
+        set.buf += (char) n;
+        set.buf += member;
+        set.count++;
+    }
+
+    static size_t findHash(const hashSet &set, std::string_view member, uint64_t h) {
+        size_t mask = set.slots.size() - 1;
+        for (size_t i = h >> set.shift;; i = (i + 1) & mask) {
+            auto &s = set.slots[i];
+            if (s.hash == 0 || (s.hash == h && s.member == member)) {
+                return i;
+            }
+        }
+    }
+
+    static void growHash(hashSet &set) {
+        std::vector<hashSet::slot> old;
+        old.swap(set.slots);
+        size_t cap = old.empty() ? 16 : old.size() * 2;
+        while (cap * 3 < (set.count + 1) * 4) {
+            cap *= 2;
+        }
+        set.slots.resize(cap);
+        set.shift = 64 - std::countr_zero(cap);
+        for (auto &s: old) {
+            if (s.hash != 0) {
+                set.slots[findHash(set, s.member, s.hash)] = std::move(s);
+            }
+        }
+    }
+
+    static bool insertHash(hashSet &set, std::string_view member) {
+        if (set.slots.empty() || (set.count + 1) * 4 > set.slots.size() * 3) {
+            growHash(set);
+        }
+        auto h = hashOf(member);
+        auto &s = set.slots[findHash(set, member, h)];
+        if (s.hash != 0) {
+            return false;
+        }
+        s.hash = h;
+        s.member = ldsString{member};
+        set.heap += strHeapSize(s.member);
+        set.count++;
+        return true;
+    }
+
+    /* Remove from a hash set, shifting later entries of the probe run back instead of leaving tombstones */
+    static bool eraseHash(hashSet &set, std::string_view member) {
+        if (set.slots.empty()) {
+            return false;
+        }
+        size_t mask = set.slots.size() - 1;
+        size_t i = findHash(set, member, hashOf(member));
+        if (set.slots[i].hash == 0) {
+            return false;
+        }
+        set.heap -= strHeapSize(set.slots[i].member);
+        for (size_t j = (i + 1) & mask; set.slots[j].hash != 0; j = (j + 1) & mask) {
+            size_t home = set.slots[j].hash >> set.shift;
+            // move j into the hole at i if its home slot is not cyclically in (i, j]
+            if (((j - home) & mask) >= ((j - i) & mask)) {
+                set.slots[i] = std::move(set.slots[j]);
+                i = j;
+            }
+        }
+        set.slots[i] = {};
+        set.count--;
+        return true;
+    }
+
+    /* Convert to the most compact encoding able to hold the current members plus member */
+    void upgrade(std::string_view member) {
+        bool fits_small = member.size() <= SET_MAX_SMALL_VALUE && size() + 1 <= SET_MAX_SMALL_ENTRIES;
+        forEach([&fits_small](std::string_view m) {
+            if (m.size() > SET_MAX_SMALL_VALUE) {
+                fits_small = false;
+            }
+        });
+
+        if (fits_small && encoding() == SET_ENC_INTSET) {
+            smallSet small;
+            forEach([&small](std::string_view m) {
+                appendSmall(small, m);
+            });
+            data = std::move(small);
+            return;
+        }
+
+        hashSet hash;
+        forEach([&hash](std::string_view m) {
+            insertHash(hash, m);
+        });
+        data = std::move(hash);
+    }
+
+public:
+    unsigned encoding() const {
+        return data.index();
+    }
+
+    /* Sorted members of an intset, nullptr for other encodings */
+    const std::vector<int64_t> *ints() const {
+        return std::get_if<SET_ENC_INTSET>(&data);
+    }
+
+    size_t size() const {
+        switch (data.index()) {
+            case SET_ENC_INTSET:
+                return std::get<SET_ENC_INTSET>(data).size();
+            case SET_ENC_SMALL:
+                return std::get<SET_ENC_SMALL>(data).count;
+            default:
+                return std::get<SET_ENC_HASH>(data).count;
+        }
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    /* Estimated heap bytes used by the set, in constant time */
+    size_t memoryUsage() const {
+        switch (data.index()) {
+            case SET_ENC_INTSET:
+                return std::get<SET_ENC_INTSET>(data).capacity() * sizeof(int64_t);
+            case SET_ENC_SMALL:
+                return strHeapSize(std::get<SET_ENC_SMALL>(data).buf);
+            default: {
+                auto &hash = std::get<SET_ENC_HASH>(data);
+                return hash.slots.capacity() * sizeof(hashSet::slot) + hash.heap;
+            }
+        }
+    }
+
+    bool contains(std::string_view member) const {
+        switch (data.index()) {
+            case SET_ENC_INTSET: {
+                int64_t v;
+                if (!toInt(member, v)) {
+                    return false;
+                }
+                auto &ints = std::get<SET_ENC_INTSET>(data);
+                return std::binary_search(ints.begin(), ints.end(), v);
+            }
+            case SET_ENC_SMALL:
+                return walkSmall(std::get<SET_ENC_SMALL>(data), [member](std::string_view m, size_t, size_t) {
+                    return m == member;
+                });
+            default: {
+                auto &hash = std::get<SET_ENC_HASH>(data);
+                if (hash.slots.empty()) {
+                    return false;
+                }
+                return hash.slots[findHash(hash, member, hashOf(member))].hash != 0;
+            }
+        }
+    }
+
+    /* Add a member, return true if it was not present */
+    bool insert(std::string_view member) {
+        if (data.index() == SET_ENC_INTSET) {
+            auto &ints = std::get<SET_ENC_INTSET>(data);
+            int64_t v;
+            if (toInt(member, v)) {
+                auto it = std::lower_bound(ints.begin(), ints.end(), v);
+                if (it != ints.end() && *it == v) {
+                    return false;
+                }
+                if (ints.size() < SET_MAX_INTSET_ENTRIES) {
+                    ints.insert(it, v);
+                    return true;
+                }
+            }
+            upgrade(member);
+        }
+
+        if (data.index() == SET_ENC_SMALL) {
+            if (contains(member)) {
+                return false;
+            }
+            auto &small = std::get<SET_ENC_SMALL>(data);
+            if (member.size() <= SET_MAX_SMALL_VALUE && small.count < SET_MAX_SMALL_ENTRIES) {
+                appendSmall(small, member);
+                return true;
+            }
+            upgrade(member);
+        }
+
+        return insertHash(std::get<SET_ENC_HASH>(data), member);
+    }
+
+    /* Remove a member, return true if it was present */
+    bool erase(std::string_view member) {
+        switch (data.index()) {
+            case SET_ENC_INTSET: {
+                int64_t v;
+                if (!toInt(member, v)) {
+                    return false;
+                }
+                auto &ints = std::get<SET_ENC_INTSET>(data);
+                auto it = std::lower_bound(ints.begin(), ints.end(), v);
+                if (it == ints.end() || *it != v) {
+                    return false;
+                }
+                ints.erase(it);
+                return true;
+            }
+            case SET_ENC_SMALL: {
+                auto &small = std::get<SET_ENC_SMALL>(data);
+                size_t from = 0, to = 0;
+                bool found = walkSmall(small, [&](std::string_view m, size_t start, size_t end) {
+                    from = start;
+                    to = end;
+                    return m == member;
+                });
+                if (!found) {
+                    return false;
+                }
+                small.buf.erase(from, to - from);
+                small.count--;
+                return true;
+            }
+            default:
+                return eraseHash(std::get<SET_ENC_HASH>(data), member);
+        }
+    }
+
+    /* Call f on each member. The view passed to f is only valid during the call */
+    void forEach(const std::function<void(std::string_view)> &f) const {
+        switch (data.index()) {
+            case SET_ENC_INTSET:
+                for (auto v: std::get<SET_ENC_INTSET>(data)) {
+                    char buf[24];
+                    auto out = std::to_chars(buf, buf + sizeof(buf), v);
+                    f(std::string_view(buf, out.ptr - buf));
+                }
+                break;
+            case SET_ENC_SMALL:
+                walkSmall(std::get<SET_ENC_SMALL>(data), [&f](std::string_view m, size_t, size_t) {
+                    f(m);
+                    return false;
+                });
+                break;
+            default:
+                for (auto &s: std::get<SET_ENC_HASH>(data).slots) {
+                    if (s.hash != 0) {
+                        f(s.member);
+                    }
+                }
+        }
+    }
+
+    /* Call f on the members whose hash is at least cursor and below the returned cursor,
+     * visiting about count home slots. Return 0 once every member was visited.
+     * The cursor is a hash value rather than a slot index, so it stays valid when the table grows:
+     * members present for a whole scan are visited exactly once.
+     * Compact encodings are visited at once.
+     * */
+    uint64_t scan(uint64_t cursor, size_t count, const std::function<void(std::string_view)> &f) const {
+        if (data.index() != SET_ENC_HASH) {
+            forEach(f);
+            return 0;
+        }
+        auto &hash = std::get<SET_ENC_HASH>(data);
+        if (hash.slots.empty()) {
+            return 0;
+        }
+        size_t size = hash.slots.size();
+        size_t mask = size - 1;
+        size_t from = cursor >> hash.shift;
+        size_t to = std::min(size, from + std::max<size_t>(count, 1));
+        // a member sits at or cyclically after its home slot, with no empty slot in between
+        for (size_t i = from; i < from + size && (i < to || hash.slots[i & mask].hash != 0); i++) {
+            auto &s = hash.slots[i & mask];
+            size_t home = s.hash >> hash.shift;
+            if (s.hash != 0 && home >= from && home < to) {
+                f(s.member);
+            }
+        }
+        return to == size ? 0 : (uint64_t) to << hash.shift;
+    }
+};
+
+// Size ratio above which intersecting sorted arrays binary searches the larger one instead of merging
+#define SET_GALLOP_RATIO 32
+
+#ifdef SET_HAVE_AVX2_KERNEL
+/* Merge blocks of four elements of a and b with AVX2, advancing i and j up to the last full blocks.
+ * Compiled for AVX2 regardless of the build flags, only call it if the CPU supports AVX2.
+ * */
+__attribute__((target("avx2")))
+inline void intersectBlocksAvx2(const int64_t *a, size_t na, const int64_t *b, size_t nb, size_t &i, size_t &j,
+                                std::vector<int64_t> &out) {
+    // compare each block of a against all rotations of the block of b, then advance the block with the lower max
+    while (i + 4 <= na && j + 4 <= nb) {
+        __m256i va = _mm256_loadu_si256((const __m256i *) (a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *) (b + j));
+        __m256i eq = _mm256_cmpeq_epi64(va, vb);
+        eq = _mm256_or_si256(eq, _mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x39)));
+        eq = _mm256_or_si256(eq, _mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x4e)));
+        eq = _mm256_or_si256(eq, _mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x93)));
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(eq));
+        for (int k = 0; k < 4; k++) {
+            if (mask & (1 << k)) {
+                out.push_back(a[i + k]);
+            }
+        }
+        auto a_max = a[i + 3], b_max = b[j + 3];
+        if (a_max <= b_max) {
+            i += 4;
+        }
+        if (b_max <= a_max) {
+            j += 4;
+        }
+    }
+}
+#endif
+
+/* Check once whether the CPU running the server supports AVX2 */
+inline bool cpuHasAvx2() {
+#ifdef SET_HAVE_AVX2_KERNEL
+    static const bool has = __builtin_cpu_supports("avx2");
+    return has;
+#else
+    return false;
+#endif
+}
+
+/* Append the values present in both sorted, duplicate-free arrays a and b to out, in order.
+ * Arrays of similar size are merged four by four elements with AVX2 if simd is set and the CPU supports it,
+ * a much larger b is binary searched for each element of a instead.
+ * */
+inline void intersectInts(const int64_t *a, size_t na, const int64_t *b, size_t nb, std::vector<int64_t> &out,
+                          bool simd = true) {
+    if (na > nb) {
+        std::swap(a, b);
+        std::swap(na, nb);
+    }
+    size_t i = 0, j = 0;
+
+    if (nb / SET_GALLOP_RATIO > na) {
+        for (; i < na && j < nb; i++) {
+            j = std::lower_bound(b + j, b + nb, a[i]) - b;
+            if (j < nb && b[j] == a[i]) {
+                out.push_back(a[i]);
+            }
+        }
+        return;
+    }
+
+#ifdef SET_HAVE_AVX2_KERNEL
+    if (simd && cpuHasAvx2()) {
+        intersectBlocksAvx2(a, na, b, nb, i, j, out);
+    }
+#endif
+
+    while (i < na && j < nb) {
+        if (a[i] < b[j]) {
+            i++;
+        } else if (b[j] < a[i]) {
+            j++;
+        } else {
+            out.push_back(a[i]);
+            i++;
+            j++;
+        }
+    }
+}
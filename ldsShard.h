@@ -0,0 +1,453 @@
+#pragma once
+
+#include <unordered_map>
+#include <algorithm>
+#include <mutex>
+#include <shared_mutex>
+#include <chrono>
+#include <functional>
+#include <string_view>
+#include <queue>
+#include <vector>
+#include <atomic>
+#include <array>
+
+#include "ldsKey.h"
+#include "ldsVal.h"
+#include "ldsMem.h"
+#include "ldsAlloc.h"
+
+#define ULOCK(lock, mutex) std::unique_lock<std::shared_timed_mutex> lock(mutex)
+#define SLOCK(lock, mutex) std::shared_lock<std::shared_timed_mutex> lock(mutex)
+#define UNLOCK(lock) lock.unlock()
+#define SHARD_ULOCK(lock, shard) ldsShardLock lock(shard, true)
+#define SHARD_SLOCK(lock, shard) ldsShardLock lock(shard, false)
+
+/* Hash for keys, usable for lookups by std::string_view without building a std::string */
+struct ldsKeyHash {
+    using is_transparent = void;
+
+    size_t operator()(std::string_view key) const {
+        return std::hash<std::string_view>{}(key);
+    }
+};
+
+/* An independently locked partition of the keyspace.
+ * Every key lives in exactly one shard, picked by ldsDb::shardIndex.
+ * Values are stored inline in the keys table, guarded by a single mutex.
+ * */
+struct ldsShard {
+    // Nodes, keys and values are allocated from the slab pool
+    using ckey_type = std::unordered_map<ldsString, ldsKey, ldsKeyHash, std::equal_to<>,
+            ldsAllocator<std::pair<const ldsString, ldsKey>>>;
+    using time_point = std::chrono::time_point<std::chrono::system_clock>;
+    // Min-heap of (deadline, key); entries of keys that were since deleted or re-expired are skipped when popped
+    // and dropped by compactExpires once they outnumber the live ones
+    struct cexp_type : std::priority_queue<std::pair<time_point, ldsString>,
+            std::vector<std::pair<time_point, ldsString>>, std::greater<>> {
+        container_type &entries() {
+            return c;
+        }
+    };
+
+    ckey_type keys;
+    cexp_type expires;
+    // Keys with a deadline, each having one live entry in expires
+    size_t volatile_keys = 0;
+
+    std::shared_timed_mutex mtx{};
+    // position in ldsDb, set by it
+    unsigned idx = 0;
+
+    // Estimated memory of the keys and expiry index, also added to *used_memory when set
+    int64_t memory = 0;
+    std::atomic<int64_t> *used_memory = nullptr;
+
+    // Keys of each value type, and keys deleted once expired, written under the unique lock and readable without it
+    std::array<std::atomic<int64_t>, TYPE_COUNT> type_keys{};
+    std::atomic<uint64_t> expired_keys{0};
+
+    // Times keys changed its bucket count, lets a scan cursor notice that buckets were redistributed
+    uint64_t rehashes = 0;
+
+    ldsShard() = default;
+
+    ldsShard(const ldsShard &) = delete;
+
+    ldsShard &operator=(const ldsShard &) = delete;
+
+    static int64_t entrySize(const ldsString &key, const ldsKey &entry) {
+        return (int64_t) (sizeof(ckey_type::value_type) + MEM_NODE_OVERHEAD + sizeof(void *)
+                          + strHeapSize(key) + entry.val.memoryUsage());
+    }
+
+    static int64_t expirySize(const ldsString &key) {
+        return (int64_t) (sizeof(cexp_type::value_type) + strHeapSize(key));
+    }
+
+    /* Precondition:
+     * - acquire unique lock on mtx
+     * */
+    void addMemory(int64_t delta) {
+        memory += delta;
+        if (used_memory != nullptr) {
+            used_memory->fetch_add(delta, std::memory_order_relaxed);
+        }
+    }
+
+    /* Precondition:
+     * - acquire unique lock on mtx
+     * */
+    void countKey(unsigned type, int64_t delta) {
+        type_keys[type].store(type_keys[type].load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+
+    /* Precondition:
+     * - acquire unique lock on mtx
+     * */
+    void countExpired() {
+        expired_keys.store(expired_keys.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    /* Update the memory accounted for a key after its value changed
+     * Precondition:
+     * - acquire unique lock on mtx
+     * */
+    void account(ckey_type::iterator key_iter) {
+        auto size = entrySize(key_iter->first, key_iter->second);
+        addMemory(size - key_iter->second.mem);
+        key_iter->second.mem = size;
+    }
+
+    /* Check if key has expired
+     * Precondition:
+     * - acquire shared lock on mtx
+     * */
+    bool isExpired(ckey_type::iterator key_iter, time_point now) {
+        if (key_iter == keys.end()) {
+            return false;
+        }
+        return isExpired(key_iter->second, now);
+    }
+
+    static bool isExpired(const ldsKey &entry, time_point now) {
+        return entry.ttl.has_value() && now >= entry.ttl.value();
+    }
+
+    bool isExpired(ckey_type::iterator key_iter) {
+        return isExpired(key_iter, std::chrono::system_clock::now());
+    }
+
+    /* Find a key, treating expired keys as absent
+     * Precondition:
+     * - acquire shared lock on mtx
+     * */
+    ckey_type::iterator findLive(std::string_view key) {
+        auto key_iter = keys.find(key);
+        if (isExpired(key_iter)) {
+            return keys.end();
+        }
+        return key_iter;
+    }
+
+    /* Find a key, deleting it first if it has expired
+     * Precondition:
+     * - acquire unique lock on mtx
+     * */
+    ckey_type::iterator findForWrite(std::string_view key) {
+        auto key_iter = keys.find(key);
+        if (isExpired(key_iter)) {
+            deleteKV(key);
+            countExpired();
+            return keys.end();
+        }
+        return key_iter;
+    }
+
+    /* Set expiry deadline of a key and register it in the expiry index
+     * Precondition:
+     * - acquire unique lock on mtx
+     * */
+    void setExpiry(ckey_type::iterator key_iter, time_point when) {
+        if (key_iter->second.ttl == when) {
+            return;
+        }
+        if (!key_iter->second.ttl.has_value()) {
+            volatile_keys++;
+        }
+        key_iter->second.ttl = when;
+        expires.emplace(when, key_iter->first);
+        addMemory(expirySize(key_iter->first));
+        compactExpires();
+    }
+
+    /* Drop the entries of the expiry index left by keys since deleted, overwritten or re-expired,
+     * which would otherwise stay until their old deadline passes, once they outnumber the live ones
+     * Precondition:
+     * - acquire unique lock on mtx
+     * */
+    void compactExpires() {
+        if (expires.size() <= 2 * volatile_keys) {
+            return;
+        }
+        auto &entries = expires.entries();
+        int64_t freed = 0;
+        std::erase_if(entries, [this, &freed](const cexp_type::value_type &entry) {
+            auto key_iter = keys.find(entry.second);
+            if (key_iter != keys.end() && key_iter->second.ttl == entry.first) {
+                return false;
+            }
+            freed += expirySize(entry.second);
+            return true;
+        });
+        // a key re-expired back to an earlier deadline has two live entries, and sorted entries form a heap
+        std::sort(entries.begin(), entries.end());
+        auto dup = std::unique(entries.begin(), entries.end());
+        for (auto it = dup; it != entries.end(); it++) {
+            freed += expirySize(it->second);
+        }
+        entries.erase(dup, entries.end());
+        addMemory(-freed);
+    }
+
+    /* Check if the expiry index has a deadline that has passed
+     * Precondition:
+     * - acquire shared lock on mtx
+     * */
+    bool hasDue(time_point now) const {
+        return !expires.empty() && expires.top().first <= now;
+    }
+
+    /* Delete keys whose deadline has passed, consuming at most limit index entries
+     * Return true if there may be more due entries left
+     * Precondition:
+     * - acquire unique lock on mtx
+     * */
+    bool expireDue(time_point now, size_t limit) {
+        while (limit > 0 && hasDue(now)) {
+            auto [when, key] = expires.top();
+            expires.pop();
+            addMemory(-expirySize(key));
+            limit--;
+            auto key_iter = keys.find(key);
+            if (key_iter != keys.end() && key_iter->second.ttl == when) {
+                deleteKV(key);
+                countExpired();
+            }
+        }
+        return hasDue(now);
+    }
+
+    /* Get value of a key
+     * Precondition:
+     * - acquire shared lock on mtx
+     * */
+    ldsVal *getVal(ckey_type::iterator key_iter) {
+        if (key_iter == keys.end()) {
+            return nullptr;
+        }
+        return &key_iter->second.val;
+    }
+
+    /* Write a new key-value pair to shard, overwrite last value and time-to-live if necessary
+     * Precondition:
+     * - acquire unique lock on mtx
+     * */
+    ckey_type::iterator writeKV(std::string_view key, ldsVal &&val) {
+        auto key_iter = keys.find(key);
+        if (key_iter == keys.end()) {
+            auto buckets = keys.bucket_count();
+            key_iter = keys.emplace(ldsString{key}, ldsKey{std::move(val)}).first;
+            if (keys.bucket_count() != buckets) {
+                rehashes++;
+            }
+            countKey(key_iter->second.val.type(), 1);
+        } else {
+            countKey(key_iter->second.val.type(), -1);
+            countKey(val.type(), 1);
+            bool had_ttl = key_iter->second.ttl.has_value();
+            // overwriting keeps the access frequency and counts as an access
+            auto mem = key_iter->second.mem;
+            auto lfu = key_iter->second.lfu.load(std::memory_order_relaxed);
+            key_iter->second = ldsKey{std::move(val)};
+            key_iter->second.mem = mem;
+            key_iter->second.lfu.store(lfu, std::memory_order_relaxed);
+            key_iter->second.touch();
+            if (had_ttl) {
+                volatile_keys--;
+                compactExpires();
+            }
+        }
+        account(key_iter);
+        return key_iter;
+    }
+
+    /* Modify value of a key
+     * Precondition:
+     * - acquire unique lock on mtx
+     * */
+    ldsVal *modifyVal(ckey_type::iterator key_iter, const std::function<void(ldsVal &)> &modifier) {
+        if (key_iter == keys.end()) {
+            return nullptr;
+        }
+        modifier(key_iter->second.val);
+        account(key_iter);
+        return &key_iter->second.val;
+    }
+
+    /* Delete a key and its value
+     * Precondition:
+     * - acquire unique lock on mtx
+     * */
+    bool deleteKV(std::string_view key) {
+        auto key_iter = keys.find(key);
+        if (key_iter == keys.end()) {
+            return false;
+        }
+        addMemory(-key_iter->second.mem);
+        countKey(key_iter->second.val.type(), -1);
+        bool had_ttl = key_iter->second.ttl.has_value();
+        keys.erase(key_iter);
+        if (had_ttl) {
+            volatile_keys--;
+            compactExpires();
+        }
+        return true;
+    }
+
+    /* Remove all keys
+     * Precondition:
+     * - acquire unique lock on mtx
+     * */
+    void clear() {
+        keys.clear();
+        expires = {};
+        volatile_keys = 0;
+        addMemory(-memory);
+        for (auto &count: type_keys) {
+            count.store(0, std::memory_order_relaxed);
+        }
+    }
+};
+
+struct ldsCmd;
+
+// Write command being executed by the current thread that has not been passed to write_hook yet
+inline thread_local const ldsCmd *pending_write = nullptr;
+// Called with each write command as soon as it holds every shard lock it needs, at least one of them exclusive,
+// so that commands on the same keys reach the hook in the order they are applied
+inline std::function<void(const ldsCmd &)> write_hook;
+
+/* Pass the pending write command of the current thread to write_hook, once
+ * Precondition:
+ * - acquire unique lock on a shard the command writes, and every other shard lock it takes
+ * */
+inline void notifyWrite() {
+    if (pending_write == nullptr) {
+        return;
+    }
+    auto cmd = pending_write;
+    pending_write = nullptr;
+    if (write_hook) {
+        write_hook(*cmd);
+    }
+}
+
+/* Time the current thread waited for a shard lock */
+struct ldsLockWait {
+    unsigned shard;
+    uint64_t ns;
+};
+
+// Contended shard locks taken by the command the current thread runs, one entry per shard, cleared by its caller
+inline thread_local std::vector<ldsLockWait> lock_waits;
+
+/* Lock a shard, recording the wait in lock_waits if the lock is contended */
+inline void lockShardTimed(ldsShard &shard, bool unique) {
+    if (unique ? shard.mtx.try_lock() : shard.mtx.try_lock_shared()) {
+        return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    unique ? shard.mtx.lock() : shard.mtx.lock_shared();
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    for (auto &wait: lock_waits) {
+        if (wait.shard == shard.idx) {
+            wait.ns += ns;
+            return;
+        }
+    }
+    lock_waits.push_back({shard.idx, ns});
+}
+
+// Shard locked by the current thread for a whole run of batched commands, see ldsBatchLock
+inline thread_local ldsShard *batch_shard = nullptr;
+inline thread_local bool batch_unique = false;
+
+/* Lock on a single shard taken by a command.
+ * Acquires nothing if the current thread already holds the shard through an ldsBatchLock.
+ * A unique lock publishes the pending write unless publish is false, for commands taking several shard locks
+ * which call notifyWrite once they hold all of them.
+ * */
+class ldsShardLock {
+private:
+    std::shared_timed_mutex *mtx = nullptr;
+    bool unique;
+
+public:
+    ldsShardLock(ldsShard &shard, bool unique, bool publish = true) : unique(unique) {
+        if (batch_shard == &shard) {
+            if (unique && !batch_unique) {
+                throw std::logic_error("Write command in a read-only batch");
+            }
+            if (unique && publish) {
+                notifyWrite();
+            }
+            return;
+        }
+        mtx = &shard.mtx;
+        lockShardTimed(shard, unique);
+        if (!unique || !publish) {
+            return;
+        }
+        try {
+            notifyWrite();
+        } catch (...) {
+            mtx->unlock();
+            throw;
+        }
+    }
+
+    ldsShardLock(const ldsShardLock &) = delete;
+
+    ldsShardLock &operator=(const ldsShardLock &) = delete;
+
+    ~ldsShardLock() {
+        if (mtx != nullptr) {
+            unique ? mtx->unlock() : mtx->unlock_shared();
+        }
+    }
+};
+
+/* Lock on a shard held across consecutive batched commands that only touch that shard */
+class ldsBatchLock {
+private:
+    ldsShard &shard;
+    bool unique;
+
+public:
+    ldsBatchLock(ldsShard &shard, bool unique) : shard(shard), unique(unique) {
+        lockShardTimed(shard, unique);
+        batch_shard = &shard;
+        batch_unique = unique;
+    }
+
+    ldsBatchLock(const ldsBatchLock &) = delete;
+
+    ldsBatchLock &operator=(const ldsBatchLock &) = delete;
+
+    ~ldsBatchLock() {
+        batch_shard = nullptr;
+        unique ? shard.mtx.unlock() : shard.mtx.unlock_shared();
+    }
+};
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+
+#include "ldsCmd.h"
+#include "ldsShard.h"
+#include "ldsConfig.h"
+
+// Bytes of the arguments kept in an entry
+#define SLOWLOG_MAX_ARGS_LEN 128
+
+// Address of the client whose commands the current thread runs, set by the servers
+inline thread_local std::string_view current_client;
+
+/* A command that ran slower than the threshold */
+struct ldsSlowlogEntry {
+    uint64_t id;
+    // unix time the command completed at
+    long long time;
+    uint64_t duration_us;
+    std::vector<ldsLockWait> lock_waits;
+    std::string cmd;
+    std::string client;
+};
+
+/* Bounded log of the slowest commands, newest first.
+ * Besides the total time, each entry keeps the time the command waited for every contended shard lock,
+ * telling commands that were slow to run from commands stuck behind others.
+ * */
+class ldsSlowlog {
+private:
+    std::mutex mtx;
+    std::deque<ldsSlowlogEntry> entries;
+    uint64_t next_id = 0;
+    uint64_t slower_than_ns;
+    size_t max_len;
+
+public:
+    explicit ldsSlowlog(uint64_t slower_than_us = SLOWLOG_LOG_SLOWER_THAN, size_t max_len = SLOWLOG_MAX_LEN)
+            : slower_than_ns(slower_than_us * 1000), max_len(max_len) {}
+
+    /* Log cmd if it took at least the threshold, with the lock waits recorded by the current thread */
+    void record(const ldsCmd &cmd, uint64_t ns) {
+        if (ns < slower_than_ns || max_len == 0) {
+            return;
+        }
+        ldsSlowlogEntry entry{0, std::chrono::duration_cast<std::chrono::seconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count(), ns / 1000, lock_waits,
+                              std::string(cmd.spec->name), std::string(current_client)};
+        if (!cmd.argv.empty()) {
+            entry.cmd += ' ';
+            entry.cmd += formatArgs(cmd, SLOWLOG_MAX_ARGS_LEN);
+        }
+
+        std::lock_guard<std::mutex> lck(mtx);
+        entry.id = next_id++;
+        entries.push_front(std::move(entry));
+        if (entries.size() > max_len) {
+            entries.pop_back();
+        }
+    }
+
+    /* Render the count newest entries, one line each */
+    std::vector<std::string> get(size_t count) {
+        std::lock_guard<std::mutex> lck(mtx);
+        std::vector<std::string> ret;
+        for (size_t i = 0; i < std::min(count, entries.size()); i++) {
+            auto &entry = entries[i];
+            uint64_t wait_ns = 0;
+            std::string waits;
+            for (auto &wait: entry.lock_waits) {
+                wait_ns += wait.ns;
+                waits += (waits.empty() ? "" : ",") + std::to_string(wait.shard) + ":" + std::to_string(wait.ns / 1000);
+            }
+            ret.push_back("id=" + std::to_string(entry.id) + " time=" + std::to_string(entry.time)
+                          + " duration_us=" + std::to_string(entry.duration_us)
+                          + " lock_wait_us=" + std::to_string(wait_ns / 1000)
+                          + " shard_waits_us=" + (waits.empty() ? "-" : waits)
+                          + " client=" + (entry.client.empty() ? "-" : entry.client)
+                          + " cmd=" + entry.cmd);
+        }
+        return ret;
+    }
+
+    size_t len() {
+        std::lock_guard<std::mutex> lck(mtx);
+        return entries.size();
+    }
+
+    void reset() {
+        std::lock_guard<std::mutex> lck(mtx);
+        entries.clear();
+    }
+};
@@ -1,18 +1,24 @@
 #pragma once
 
-#include <list>
 #include <shared_mutex>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <fcntl.h>
 #include <unistd.h>
 #include <iomanip>
 #include <sstream>
 #include <chrono>
-#include <set>
 #include <fstream>
 #include <iostream>
 #include <cstring>
+#include <memory>
+#include <latch>
 #include <sys/wait.h>
 
-#include "ldsCmd.h"
+#include "ldsDb.h"
 #include "logger.h"
 
 extern logger LOGGER;
@@ -20,9 +26,6 @@ extern logger LOGGER;
 #define SNAPSHOT_FILENAME "ledis"
 #define SNAPSHOT_EXT ".snap"
 
-const std::set MODIFIABLE_COMMANDS = {CMD_SSET, CMD_LPUSH, CMD_RPUSH, CMD_LPOP, CMD_RPOP, CMD_SADD, CMD_SREM, CMD_GDEL,
-                                      CMD_GFLUSHDB};
-
 static std::string getCurrentDateTime() {
     auto now = std::chrono::system_clock::now();
     std::time_t now_time = std::chrono::system_clock::to_time_t(now);
@@ -34,136 +37,620 @@ static std::string getCurrentDateTime() {
 }
 
 
+// Snapshot file layout:
+//   header: SNAPSHOT_MAGIC, SNAPSHOT_VERSION as one byte, the partition count as uint32,
+//           then the file offset of each partition as uint64
+//   one partition per shard, in shard order, so that partitions can be loaded independently:
+//     one record per live key of the shard: type tag byte, absolute expiry in ms since epoch as int64 (-1 for none),
+//                                           key, then the value as a string, or a member count followed by the members
+//     SNAPSHOT_EOF byte
+// Strings are written as a varint length followed by their bytes, integers in host byte order.
+#define SNAPSHOT_MAGIC "LEDIS"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_EOF 0xff
+// Max number of threads loading partitions of a snapshot
+#define SNAPSHOT_LOAD_MAX_THREADS 8
+// Delay before an automatic save is retried after a failure
+#define SNAPSHOT_RETRY_DELAY_SEC 5
+
 class ldsSnapshot {
 private:
-    std::list<ldsCmd> cmds;
-    std::shared_mutex cmds_mtx;
-    std::shared_mutex file_mtx;
+    std::shared_timed_mutex file_mtx;
 
-#define ULOCK(lck, mtx) std::unique_lock<std::shared_mutex> lck{mtx}
-#define SLOCK(lck, mtx) std::shared_lock<std::shared_mutex> lck{mtx}
+    std::atomic<bool> saving{false};
+    std::thread saver;
+    // write commands since the last successful save
+    std::atomic<uint64_t> changes{0};
 
-    /* Preconditions: unique lock on cmds_mtx */
-    void clear() {
-        for (auto &cmd: cmds) {
-            if (cmd.args != nullptr) {
-                delete cmd.args;
-                cmd.args = nullptr;
-            }
+    // guards the save status below
+    std::mutex status_mtx;
+    std::chrono::time_point<std::chrono::system_clock> last_save = std::chrono::system_clock::now();
+    std::chrono::time_point<std::chrono::system_clock> last_save_try = last_save;
+    std::chrono::time_point<std::chrono::steady_clock> save_started;
+    bool last_save_ok = true;
+    long long last_save_duration_ms = -1;
+    uint64_t last_save_bytes = 0;
+    uint64_t last_save_cow_bytes = 0;
+
+    // threads of a background load, see loadSnapshot
+    std::vector<std::thread> loaders;
+    // shards not loaded yet by running loads
+    std::atomic<size_t> loading_shards{0};
+
+    /* State shared by the threads of one load */
+    struct loadState {
+        std::string filename;
+        // start of each partition followed by the file size, partition idx ends where idx + 1 starts
+        std::vector<uint64_t> offsets;
+        // counted down by each thread once it holds all of its shards
+        std::latch locked;
+        std::atomic<size_t> pending;
+        std::atomic<size_t> keys{0};
+        std::atomic<bool> ok{true};
+        std::chrono::time_point<std::chrono::steady_clock> started = std::chrono::steady_clock::now();
+
+        explicit loadState(size_t threads) : locked((std::ptrdiff_t) threads), pending(SHARD_COUNT) {}
+    };
+
+    static void writeLen(std::ofstream &of, size_t len) {
+        while (len >= 0x80) {
+            of.put((char) ((len & 0x7f) | 0x80));
+            len >>= 7;
         }
-        cmds.clear();
+        of.put((char) len);
     }
 
-public:
-    void addCmd(ldsCmd cmd) {
-        if (MODIFIABLE_COMMANDS.find(cmd.cmd) == MODIFIABLE_COMMANDS.end()) {
-            return;
+    static void writeStr(std::ofstream &of, std::string_view str) {
+        writeLen(of, str.size());
+        of.write(str.data(), (std::streamsize) str.size());
+    }
+
+    /* One partition of a snapshot file, reads fail instead of running past its end */
+    struct partReader {
+        std::ifstream &ifile;
+        uint64_t left;
+
+        int get() {
+            if (left == 0) {
+                return EOF;
+            }
+            left--;
+            return ifile.get();
+        }
+
+        bool read(char *buf, size_t len) {
+            if (len > left) {
+                return false;
+            }
+            left -= len;
+            return (bool) ifile.read(buf, (std::streamsize) len);
+        }
+    };
+
+    static bool readLen(partReader &ifile, size_t &len) {
+        len = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            int c = ifile.get();
+            if (c == EOF) {
+                return false;
+            }
+            len |= (size_t) (c & 0x7f) << shift;
+            if (!(c & 0x80)) {
+                return true;
+            }
         }
-        ULOCK(lck, cmds_mtx);
-        if (cmd.cmd == CMD_GFLUSHDB) {
-            LOGGER.info("[SNAPSHOT] Flush log");
-            this->clear();
-        } else {
-            LOGGER.info("[SNAPSHOT] Add to log: " + std::to_string(cmd.cmd) + " " + std::string{cmd.args});
-            cmds.push_back(cmd);
+        return false;
+    }
+
+    template<class S>
+    static bool readStr(partReader &ifile, S &str) {
+        size_t len;
+        // a corrupted length must not allocate more than what is left of the partition
+        if (!readLen(ifile, len) || len > ifile.left) {
+            return false;
         }
+        str.resize(len);
+        return ifile.read(str.data(), len);
     }
 
-    bool createSnapshot(ldsDb &db) {
-        auto writeCmd = [&](std::ofstream &of, ldsCmd &cmd) {
-            LOGGER.info("[SNAPSHOT] Write to file: " + std::to_string(cmd.cmd) + " " + std::string{cmd.args});
-            of.write(reinterpret_cast<const char *>(&cmd.cmd), sizeof(ldsCmd::cmd));
-            size_t len = strlen(cmd.args);
-            of.write(reinterpret_cast<const char *>(&len), sizeof(size_t)); // Write the length
-            of.write(cmd.args, len);
+    /* Write one record for a key and its entry */
+    static void writeKey(std::ofstream &of, const ldsString &key, const ldsKey &entry) {
+        of.put((char) entry.val.type());
+        int64_t expiry = -1;
+        if (entry.ttl.has_value()) {
+            expiry = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    entry.ttl.value().time_since_epoch()).count();
+        }
+        of.write(reinterpret_cast<const char *>(&expiry), sizeof(expiry));
+        writeStr(of, key);
+
+        auto writeMember = [&of](std::string_view member) {
+            writeStr(of, member);
         };
+        switch (entry.val.type()) {
+            case STRING_T:
+                writeStr(of, std::get<STRING_T>(entry.val.data));
+                break;
+            case LIST_T: {
+                auto &list = std::get<LIST_T>(entry.val.data);
+                writeLen(of, list.size());
+                list.forEach(writeMember);
+                break;
+            }
+            case SET_T: {
+                auto &set = std::get<SET_T>(entry.val.data);
+                writeLen(of, set.size());
+                set.forEach(writeMember);
+                break;
+            }
+        }
+    }
 
-        std::string filename = std::string{SNAPSHOT_FILENAME} + SNAPSHOT_EXT;
-        std::string tmp_filename = getCurrentDateTime() + SNAPSHOT_EXT;
-        auto rc = fork();
-        if (rc < 0) return false;
-
-        if (rc == 0) {
-            std::ofstream of(tmp_filename, std::ios::out | std::ios::binary | std::ios::trunc);
-            if (!of.is_open()) exit(1);
-
-            // Snapshot all TTL at this current time point
-            std::list<ldsCmd> expires;
-
-            for (auto &cmd: cmds) {
-                auto key = parseArgs(cmd.args)[0];
-                auto ttl = db.cmdTTL(key);
-                if (ttl < -1) continue;
-                if (ttl > -1) {
-                    expires.push_back({CMD_GEXPIRE, strdup((key + " " + std::to_string(ttl)).c_str())});
+    /* Read the value of a record of the given type, building lists and sets in place */
+    static bool readVal(partReader &ifile, int type, ldsVal &val) {
+        std::string member;
+        size_t count;
+        switch (type) {
+            case STRING_T: {
+                ldsString str;
+                if (!readStr(ifile, str)) {
+                    return false;
+                }
+                val.data = std::move(str);
+                return true;
+            }
+            case LIST_T: {
+                if (!readLen(ifile, count)) {
+                    return false;
+                }
+                ldsQuicklist list;
+                for (size_t i = 0; i < count; i++) {
+                    if (!readStr(ifile, member)) {
+                        return false;
+                    }
+                    list.pushBack(member);
+                }
+                val.data = std::move(list);
+                return true;
+            }
+            case SET_T: {
+                if (!readLen(ifile, count)) {
+                    return false;
+                }
+                ldsSet set;
+                for (size_t i = 0; i < count; i++) {
+                    if (!readStr(ifile, member)) {
+                        return false;
+                    }
+                    set.insert(member);
                 }
-                writeCmd(of, cmd);
+                val.data = std::move(set);
+                return true;
             }
-            for (auto &cmd: expires) {
-                writeCmd(of, cmd);
-                delete cmd.args;
-                cmd.args = nullptr;
+            default:
+                return false;
+        }
+    }
+
+    /* Private dirty memory of the current process in bytes, i.e. pages copied since fork in a child */
+    static size_t privateDirtyBytes() {
+        std::ifstream smaps("/proc/self/smaps_rollup");
+        std::string field;
+        size_t kb, total = 0;
+        while (smaps >> field) {
+            if (field == "Private_Dirty:" && smaps >> kb) {
+                total += kb * 1024;
             }
-            of.close();
-            exit(0);
         }
+        return total;
+    }
+
+    /* Fork a child writing every live key to tmp_filename, then reporting
+     * the bytes written and its copy-on-write memory to report_fd.
+     * All shards are held only while forking, the child writes its copy of the db without locking.
+     * Return the child pid, or -1 if the fork failed.
+     * */
+    static pid_t forkSnapshot(ldsDb &db, const std::string &tmp_filename, int report_fd) {
+        pid_t rc;
+        {
+            auto locks = db.lockAll(false);
+            rc = fork();
+        }
+        if (rc != 0) {
+            return rc;
+        }
+
+        std::ofstream of(tmp_filename, std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!of.is_open()) _exit(1);
+
+        of.write(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC) - 1);
+        of.put((char) SNAPSHOT_VERSION);
+        uint32_t partitions = SHARD_COUNT;
+        of.write(reinterpret_cast<const char *>(&partitions), sizeof(partitions));
+        // offsets are filled in once the partitions are written
+        std::vector<uint64_t> offsets(SHARD_COUNT);
+        auto table = of.tellp();
+        of.write(reinterpret_cast<const char *>(offsets.data()), (std::streamsize) (offsets.size() * sizeof(uint64_t)));
+        for (size_t idx = 0; idx < SHARD_COUNT; idx++) {
+            offsets[idx] = (uint64_t) of.tellp();
+            db.forEachKey(idx, [&of](const ldsString &key, const ldsKey &entry) {
+                writeKey(of, key, entry);
+            });
+            of.put((char) SNAPSHOT_EOF);
+        }
+        uint64_t report[2] = {(uint64_t) of.tellp(), 0};
+        of.seekp(table);
+        of.write(reinterpret_cast<const char *>(offsets.data()), (std::streamsize) (offsets.size() * sizeof(uint64_t)));
+        of.close();
+        if (!of.good()) _exit(1);
+
+        report[1] = privateDirtyBytes();
+        if (write(report_fd, report, sizeof(report)) != sizeof(report)) _exit(1);
+        _exit(0);
+    }
+
+    /* Wait for a snapshot child, install its file on success and record the outcome */
+    bool finishSnapshot(pid_t pid, const std::string &tmp_filename, int report_fd, uint64_t changes_at_start) {
+        std::string filename = std::string{SNAPSHOT_FILENAME} + SNAPSHOT_EXT;
 
         int status;
-        waitpid(rc, &status, 0);
-        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        waitpid(pid, &status, 0);
+        uint64_t report[2] = {0, 0};
+        bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0
+                  && read(report_fd, report, sizeof(report)) == sizeof(report);
+        close(report_fd);
+
+        if (ok) {
+            // rename old snapshot to back up, rename new snapshot, then remove back up
+            ULOCK(lck, file_mtx);
+            if (access(filename.c_str(), F_OK) == 0
+                && rename(filename.c_str(), (std::string{filename} + ".bak").c_str()) != 0) {
+                ok = false;
+            } else if (rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+                ok = false;
+            } else {
+                remove((std::string{filename} + ".bak").c_str());
+            }
+        }
+        if (!ok) {
+            remove(tmp_filename.c_str());
+        }
+
+        std::lock_guard<std::mutex> lck(status_mtx);
+        auto duration = std::chrono::steady_clock::now() - save_started;
+        last_save_duration_ms = std::chrono::duration_cast<std::chrono::milliseconds>(duration).count();
+        last_save_ok = ok;
+        last_save_try = std::chrono::system_clock::now();
+        if (ok) {
+            last_save = last_save_try;
+            last_save_bytes = report[0];
+            last_save_cow_bytes = report[1];
+            changes -= changes_at_start;
+        }
+        LOG_INFO(std::string("[SNAPSHOT] Save ") + (ok ? "done, " + std::to_string(report[0]) + " bytes" : "failed")
+                 + " in " + std::to_string(last_save_duration_ms) + " ms");
+        saving = false;
+        return ok;
+    }
+
+    /* Read the header of a snapshot file and the offsets of its partitions */
+    static bool readHeader(std::ifstream &ifile, std::vector<uint64_t> &offsets) {
+        char magic[sizeof(SNAPSHOT_MAGIC) - 1];
+        uint32_t partitions;
+        if (!ifile.read(magic, sizeof(magic)) || std::memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) != 0
+            || ifile.get() != SNAPSHOT_VERSION
+            || !ifile.read(reinterpret_cast<char *>(&partitions), sizeof(partitions))) {
+            return false;
+        }
+        // partitions map one to one to shards
+        if (partitions != SHARD_COUNT) {
             return false;
         }
+        offsets.resize(partitions);
+        if (!ifile.read(reinterpret_cast<char *>(offsets.data()),
+                        (std::streamsize) (offsets.size() * sizeof(uint64_t)))) {
+            return false;
+        }
+        // partitions follow the header in shard order up to the end of the file
+        auto header = (uint64_t) ifile.tellg();
+        if (!ifile.seekg(0, std::ios::end)) {
+            return false;
+        }
+        offsets.push_back((uint64_t) ifile.tellg());
+        return offsets[0] >= header && std::is_sorted(offsets.begin(), offsets.end());
+    }
+
+    /* Load the partition of shard idx, skipping keys that have expired
+     * Precondition:
+     * - hold the lock returned by db.lockShard(idx)
+     * */
+    static bool loadPartition(std::ifstream &file, const std::vector<uint64_t> &offsets, ldsDb &db, size_t idx,
+                              size_t &loaded) {
+        auto now = std::chrono::system_clock::now();
+        file.clear();
+        file.seekg((std::streamoff) offsets[idx]);
+        partReader ifile{file, offsets[idx + 1] - offsets[idx]};
+        std::string key;
+        while (true) {
+            int type = ifile.get();
+            if (type == SNAPSHOT_EOF) {
+                return true;
+            }
+            int64_t expiry;
+            ldsVal val;
+            if (type == EOF || !ifile.read(reinterpret_cast<char *>(&expiry), sizeof(expiry))
+                || !readStr(ifile, key) || !readVal(ifile, type, val)) {
+                return false;
+            }
 
-        // rename old snapshot to back up, rename new snapshot, then remove back up
-        ULOCK(lck, file_mtx);
-        if (access(filename.c_str(), F_OK) == 0) {
-            if (rename(filename.c_str(), (std::string{filename} + ".bak").c_str()) != 0) {
+            std::optional<ldsShard::time_point> ttl;
+            if (expiry >= 0) {
+                ttl = ldsShard::time_point{std::chrono::milliseconds(expiry)};
+                if (ttl.value() <= now) {
+                    continue;
+                }
+            }
+            if (!db.loadKey(idx, key, std::move(val), ttl)) {
                 return false;
             }
+            loaded++;
+        }
+    }
+
+    /* Loader thread: load the partitions of shards first, first + step, ...
+     * All of these shards are locked before counting down state->locked, each is released once loaded.
+     * Once a partition fails the remaining ones are skipped, and the last thread to finish flushes db.
+     * */
+    void loadPartitions(ldsDb &db, std::ifstream ifile, size_t first, size_t step, std::shared_ptr<loadState> state) {
+        std::vector<std::unique_lock<std::shared_timed_mutex>> locks;
+        for (size_t idx = first; idx < SHARD_COUNT; idx += step) {
+            locks.push_back(db.lockShard(idx));
+        }
+        state->locked.count_down();
+
+        size_t k = 0;
+        for (size_t idx = first; idx < SHARD_COUNT; idx += step, k++) {
+            size_t loaded = 0;
+            if (state->ok) {
+                bool ok = false;
+                try {
+                    ok = loadPartition(ifile, state->offsets, db, idx, loaded);
+                } catch (const std::exception &e) {
+                    LOG_ERROR("[SNAPSHOT] Failed to load partition " + std::to_string(idx) + ": " + e.what());
+                }
+                if (!ok) {
+                    state->ok = false;
+                    LOG_ERROR("[SNAPSHOT] Truncated or corrupted partition " + std::to_string(idx)
+                              + " in snapshot: " + state->filename);
+                }
+            }
+            locks[k].unlock();
+            state->keys += loaded;
+
+            if (--state->pending == 0) {
+                if (state->ok) {
+                    LOG_INFO("[SNAPSHOT] Loaded " + std::to_string(state->keys.load()) + " keys in "
+                             + std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                     std::chrono::steady_clock::now() - state->started).count()) + " ms");
+                } else {
+                    // never leave a partial keyspace behind, a corrupted snapshot loads nothing
+                    db.cmdFlush();
+                    LOG_ERROR("[SNAPSHOT] Discarded the " + std::to_string(state->keys.load())
+                              + " keys loaded from corrupted snapshot: " + state->filename);
+                }
+            }
+            // counted last, RESTORE frees db only once loading() is false
+            loading_shards--;
+        }
+    }
+
+    /* Start a snapshot child, return its pid or -1 on failure
+     * Precondition:
+     * - saving was set by the caller
+     * */
+    pid_t startSnapshot(ldsDb &db, std::string &tmp_filename, int &report_fd, uint64_t &changes_at_start) {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) != 0) {
+            saving = false;
+            return -1;
+        }
+        tmp_filename = getCurrentDateTime() + "_" + std::to_string(getpid()) + SNAPSHOT_EXT;
+        {
+            std::lock_guard<std::mutex> lck(status_mtx);
+            save_started = std::chrono::steady_clock::now();
+        }
+        changes_at_start = changes.load();
+        auto pid = forkSnapshot(db, tmp_filename, fds[1]);
+        close(fds[1]);
+        if (pid < 0) {
+            close(fds[0]);
+            std::lock_guard<std::mutex> lck(status_mtx);
+            last_save_ok = false;
+            last_save_try = std::chrono::system_clock::now();
+            saving = false;
+            return -1;
         }
-        if (rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+        report_fd = fds[0];
+        return pid;
+    }
+
+public:
+    ~ldsSnapshot() {
+        if (saver.joinable()) {
+            saver.join();
+        }
+        waitLoaded();
+    }
+
+    /* Write every live key to the snapshot file, return once it is written */
+    bool createSnapshot(ldsDb &db) {
+        if (saving.exchange(true)) {
+            return false;
+        }
+        std::string tmp_filename;
+        int report_fd;
+        uint64_t changes_at_start;
+        auto pid = startSnapshot(db, tmp_filename, report_fd, changes_at_start);
+        if (pid < 0) {
             return false;
         }
-        remove((std::string{filename} + ".bak").c_str());
+        return finishSnapshot(pid, tmp_filename, report_fd, changes_at_start);
+    }
 
+    /* Start writing the snapshot file in a child process and return immediately.
+     * The child is reaped by a background thread. Return false if a save is already running or the fork failed.
+     * */
+    bool createSnapshotInBackground(ldsDb &db) {
+        if (saving.exchange(true)) {
+            return false;
+        }
+        if (saver.joinable()) {
+            saver.join();
+        }
+        std::string tmp_filename;
+        int report_fd;
+        uint64_t changes_at_start;
+        auto pid = startSnapshot(db, tmp_filename, report_fd, changes_at_start);
+        if (pid < 0) {
+            return false;
+        }
+        LOG_INFO("[SNAPSHOT] Background save started by child " + std::to_string(pid));
+        saver = std::thread(&ldsSnapshot::finishSnapshot, this, pid, tmp_filename, report_fd, changes_at_start);
         return true;
     }
 
-    ldsDb *restoreSnapshot() {
-        auto readCmd = [&](std::ifstream &ifile, ldsCmd &cmd) -> bool {
-            if (!ifile.read(reinterpret_cast<char *>(&cmd.cmd), sizeof(ldsCmd::cmd))) return false;
-            size_t len;
-            if (!ifile.read(reinterpret_cast<char *>(&len), sizeof(size_t))) return false;
-            char *args = new char[len + 1];
-            if (!ifile.read(args, len)) return false;
-            args[len] = '\0';
-            cmd.args = args;
-            LOGGER.info("[SNAPSHOT] Read from file: " + std::to_string(cmd.cmd) + " " + std::string{cmd.args});
-            return true;
-        };
+    bool inProgress() const {
+        return saving.load();
+    }
+
+    /* Count writes since the last successful save */
+    void addChanges(uint64_t n) {
+        changes.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    /* Check the automatic save rules, each a pair of (seconds, changes),
+     * and the retry delay after a failed save
+     * */
+    bool shouldSave(const std::vector<std::pair<long long, long long>> &rules) {
+        if (rules.empty() || saving.load()) {
+            return false;
+        }
+        auto now = std::chrono::system_clock::now();
+        auto dirty = (long long) changes.load(std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lck(status_mtx);
+        if (!last_save_ok && now - last_save_try < std::chrono::seconds(SNAPSHOT_RETRY_DELAY_SEC)) {
+            return false;
+        }
+        for (auto &[seconds, min_changes]: rules) {
+            if (dirty >= min_changes && now - last_save >= std::chrono::seconds(seconds)) {
+                return true;
+            }
+        }
+        return false;
+    }
 
+    /* Unix time of the last successful save */
+    long long lastSave() {
+        std::lock_guard<std::mutex> lck(status_mtx);
+        return std::chrono::duration_cast<std::chrono::seconds>(last_save.time_since_epoch()).count();
+    }
+
+    /* Save status as "name:value" lines */
+    std::vector<std::string> status() {
+        std::vector<std::string> ret;
+        std::lock_guard<std::mutex> lck(status_mtx);
+        bool in_progress = saving.load();
+        ret.push_back("loading:" + std::to_string(loading()));
+        ret.push_back("loading_shards_left:" + std::to_string(loading_shards.load()));
+        ret.push_back("rdb_changes_since_last_save:" + std::to_string(changes.load()));
+        ret.push_back("rdb_bgsave_in_progress:" + std::to_string(in_progress));
+        ret.push_back("rdb_last_save_time:" + std::to_string(
+                std::chrono::duration_cast<std::chrono::seconds>(last_save.time_since_epoch()).count()));
+        ret.push_back(std::string("rdb_last_bgsave_status:") + (last_save_ok ? "ok" : "err"));
+        ret.push_back("rdb_last_bgsave_time_ms:" + std::to_string(last_save_duration_ms));
+        auto current = in_progress ? std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - save_started).count() : -1;
+        ret.push_back("rdb_current_bgsave_time_ms:" + std::to_string(current));
+        ret.push_back("rdb_last_save_bytes:" + std::to_string(last_save_bytes));
+        ret.push_back("rdb_last_cow_size:" + std::to_string(last_save_cow_bytes));
+        return ret;
+    }
+
+    /* Load the snapshot file into db with several threads, each loading the partitions of its own set of shards.
+     * If background is false, return once everything is loaded, false if there is no snapshot or it is corrupted.
+     * If background is true, return as soon as the loaders hold every shard, false if there is no snapshot:
+     * db can then serve requests while loading, commands touching a shard block until its partition is loaded.
+     * Either way a corrupted partition fails the whole load and leaves db empty.
+     * Precondition:
+     * - db is not used by other threads until this returns
+     * */
+    bool loadSnapshot(ldsDb &db, bool background) {
         std::string filename = std::string{SNAPSHOT_FILENAME} + SNAPSHOT_EXT;
-        ULOCK(lck_file, file_mtx);
-        if (access(filename.c_str(), F_OK) != 0) {
-            return nullptr;
+        size_t threads = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, SNAPSHOT_LOAD_MAX_THREADS);
+        auto state = std::make_shared<loadState>(threads);
+        state->filename = filename;
+        std::vector<std::thread> workers;
+        {
+            SLOCK(lck_file, file_mtx);
+            if (access(filename.c_str(), F_OK) != 0) {
+                return false;
+            }
+            std::ifstream ifile(filename, std::ios::in | std::ios::binary);
+            if (!ifile.is_open()) return false;
+            if (!readHeader(ifile, state->offsets)) {
+                LOG_ERROR("[SNAPSHOT] Not a snapshot file: " + filename);
+                return false;
+            }
+
+            // open every file before the lock is released, the snapshot may be replaced afterwards
+            std::vector<std::ifstream> files;
+            files.push_back(std::move(ifile));
+            while (files.size() < threads) {
+                files.emplace_back(filename, std::ios::in | std::ios::binary);
+                if (!files.back().is_open()) return false;
+            }
+            loading_shards += SHARD_COUNT;
+            for (size_t t = 0; t < threads; t++) {
+                workers.emplace_back(&ldsSnapshot::loadPartitions, this, std::ref(db), std::move(files[t]),
+                                     t, threads, state);
+            }
+            state->locked.wait();
+        }
+
+        LOG_INFO("[SNAPSHOT] Loading " + filename + " with " + std::to_string(threads) + " threads"
+                 + (background ? " in background" : ""));
+        if (background) {
+            for (auto &worker: workers) {
+                loaders.push_back(std::move(worker));
+            }
+            return true;
         }
+        for (auto &worker: workers) {
+            worker.join();
+        }
+        return state->ok;
+    }
 
-        std::ifstream ifile(filename, std::ios::in | std::ios::binary);
-        if (!ifile.is_open()) return nullptr;
+    /* Check if a load is still running */
+    bool loading() const {
+        return loading_shards.load() > 0;
+    }
 
-        ldsCmd cmd{};
-        std::list<ldsCmd> cmds;
-        auto *db = new ldsDb();
-        while (readCmd(ifile, cmd)) {
-            cmds.push_back(cmd);
-            ldsRet ret{};
-            db->execute(cmd, ret);
+    /* Wait for a background load to finish */
+    void waitLoaded() {
+        for (auto &loader: loaders) {
+            loader.join();
         }
-        ifile.close();
+        loaders.clear();
+    }
 
-        ULOCK(lck_cmds, cmds_mtx);
-        this->clear();
-        std::copy(cmds.begin(), cmds.end(), std::back_inserter(this->cmds));
+    /* Build a new db from the snapshot file, return nullptr if there is none or it is corrupted */
+    ldsDb *restoreSnapshot() {
+        auto *db = new ldsDb();
+        if (!loadSnapshot(*db, false)) {
+            delete db;
+            return nullptr;
+        }
         return db;
     }
 };
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <cstdint>
+
+#include "ldsCmd.h"
+#include "ldsHistogram.h"
+
+/* Totals of one command over every thread */
+struct ldsCmdSummary {
+    std::string_view name;
+    uint64_t calls = 0;
+    uint64_t failed = 0;
+    uint64_t total_ns = 0;
+    std::array<uint64_t, LATENCY_BUCKETS> buckets{};
+
+    /* Latency in nanoseconds below which a fraction q of the calls completed */
+    double percentile(double q) const {
+        return latencyPercentile(buckets, calls, q);
+    }
+};
+
+/* Per-command call counts and latency histograms.
+ * Every thread records into its own counters, each only ever written by that thread, so recording
+ * takes no lock and no atomic read-modify-write. Readers merge the counters of every thread.
+ * */
+class ldsStats {
+private:
+    struct cmdCounters {
+        std::atomic<uint64_t> calls{0};
+        std::atomic<uint64_t> failed{0};
+        std::atomic<uint64_t> total_ns{0};
+        std::array<std::atomic<uint64_t>, LATENCY_BUCKETS> buckets{};
+    };
+
+    struct threadStats {
+        std::array<cmdCounters, CMD_COUNT> cmds;
+    };
+
+    /* Folds the counters of a thread into the retired totals when the thread exits */
+    struct threadOwner {
+        std::unique_ptr<threadStats> stats;
+
+        ~threadOwner() {
+            if (stats) {
+                instance().retire(stats.get());
+            }
+        }
+    };
+
+    std::mutex mtx;
+    std::vector<threadStats *> threads;
+    // totals of the threads that exited
+    std::array<ldsCmdSummary, CMD_COUNT> retired{};
+
+    ldsStats() = default;
+
+    // Only the owning thread writes, a plain load and store is enough
+    static void bump(std::atomic<uint64_t> &counter, uint64_t delta) {
+        counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+
+    static void addTo(ldsCmdSummary &sum, const cmdCounters &c) {
+        sum.calls += c.calls.load(std::memory_order_relaxed);
+        sum.failed += c.failed.load(std::memory_order_relaxed);
+        sum.total_ns += c.total_ns.load(std::memory_order_relaxed);
+        for (size_t b = 0; b < LATENCY_BUCKETS; b++) {
+            sum.buckets[b] += c.buckets[b].load(std::memory_order_relaxed);
+        }
+    }
+
+    threadStats &local() {
+        thread_local threadOwner owner;
+        if (!owner.stats) {
+            owner.stats = std::make_unique<threadStats>();
+            std::lock_guard<std::mutex> lck(mtx);
+            threads.push_back(owner.stats.get());
+        }
+        return *owner.stats;
+    }
+
+    void retire(threadStats *stats) {
+        std::lock_guard<std::mutex> lck(mtx);
+        for (size_t i = 0; i < CMD_COUNT; i++) {
+            addTo(retired[i], stats->cmds[i]);
+        }
+        std::erase(threads, stats);
+    }
+
+public:
+    static ldsStats &instance() {
+        // never destroyed, threads may exit during static destruction
+        static auto *stats = new ldsStats();
+        return *stats;
+    }
+
+    /* Record a call of a command that took ns nanoseconds */
+    void record(const ldsCmdSpec *spec, uint64_t ns, bool ok) {
+        auto &c = local().cmds[spec->cmd];
+        bump(c.calls, 1);
+        if (!ok) {
+            bump(c.failed, 1);
+        }
+        bump(c.total_ns, ns);
+        bump(c.buckets[latencyBucket(ns)], 1);
+    }
+
+    /* Totals of every command called at least once, by command id */
+    std::vector<ldsCmdSummary> commands() {
+        auto sums = std::make_unique<std::array<ldsCmdSummary, CMD_COUNT>>();
+        {
+            std::lock_guard<std::mutex> lck(mtx);
+            *sums = retired;
+            for (auto stats: threads) {
+                for (size_t i = 0; i < CMD_COUNT; i++) {
+                    addTo((*sums)[i], stats->cmds[i]);
+                }
+            }
+        }
+        std::vector<ldsCmdSummary> ret;
+        for (size_t i = 0; i < CMD_COUNT; i++) {
+            if ((*sums)[i].calls > 0) {
+                (*sums)[i].name = CMD_BY_ID[i]->name;
+                ret.push_back((*sums)[i]);
+            }
+        }
+        return ret;
+    }
+};
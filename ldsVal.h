@@ -1,36 +1,65 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <cassert>
-#include <set>
-#include <list>
+#include <variant>
+#include <stdexcept>
+
+#include "ldsQuicklist.h"
+#include "ldsSet.h"
+#include "ldsMem.h"
+#include "ldsAlloc.h"
 
 #define STRING_T 0
 #define LIST_T 1
 #define SET_T 2
+#define TYPE_COUNT 3
+
+// Names of the value types, indexed by id
+constexpr std::string_view TYPE_NAMES[] = {"string", "list", "set"};
 
+/* A value stored inline in its keyspace entry.
+ * The alternative index is the value type id; short strings need no allocation thanks to SSO,
+ * longer ones are allocated from the slab pool.
+ * */
 struct ldsVal {
-    void *ptr;
-    unsigned type: 2;
+    std::variant<ldsString, ldsQuicklist, ldsSet> data;
+
+    unsigned type() const {
+        return data.index();
+    }
+
+    /* Estimated heap bytes used by the value, not counting the value itself */
+    size_t memoryUsage() const {
+        switch (type()) {
+            case STRING_T:
+                return strHeapSize(std::get<STRING_T>(data));
+            case LIST_T:
+                return std::get<LIST_T>(data).memoryUsage();
+            default:
+                return std::get<SET_T>(data).memoryUsage();
+        }
+    }
 };
 
-std::string *ldsValToStr(ldsVal val) {
-    if (val.type != STRING_T) {
+ldsString *ldsValToStr(ldsVal &val) {
+    if (val.type() != STRING_T) {
         throw std::runtime_error("Attempt to convert non-string value to string");
     }
-    return (std::string *) val.ptr;
+    return std::get_if<STRING_T>(&val.data);
 }
 
-std::list<std::string> *ldsValToList(ldsVal val) {
-    if (val.type != LIST_T) {
+ldsQuicklist *ldsValToList(ldsVal &val) {
+    if (val.type() != LIST_T) {
         throw std::runtime_error("Attempt to convert non-list value to list");
     }
-    return (std::list<std::string> *) val.ptr;
+    return std::get_if<LIST_T>(&val.data);
 }
 
-std::set<std::string> *ldsValToSet(ldsVal val) {
-    if (val.type != SET_T) {
+ldsSet *ldsValToSet(ldsVal &val) {
+    if (val.type() != SET_T) {
         throw std::runtime_error("Attempt to convert non-set value to set");
     }
-    return (std::set<std::string> *) val.ptr;
+    return std::get_if<SET_T>(&val.data);
 }
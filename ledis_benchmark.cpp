@@ -0,0 +1,559 @@
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <array>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <charconv>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "ldsHistogram.h"
+
+/* Closed-loop load generator for ledis.
+ * Each client owns a connection and a thread: it sends a pipeline of commands drawn from the command mix,
+ * waits for every reply, and starts over until the request count or the duration is reached.
+ * The latency of a command runs from the moment its pipeline is sent to the arrival of its reply.
+ * */
+
+#define BENCH_READ_CHUNK 16384
+#define BENCH_PROTOCOL_RESP 0
+#define BENCH_PROTOCOL_HTTP 1
+
+// Commands the mix may contain, with their default weights
+constexpr std::string_view BENCH_CMDS[] = {"get", "set", "lpush", "lpop", "sadd", "sinter", "lrange"};
+constexpr size_t BENCH_CMD_COUNT = std::size(BENCH_CMDS);
+constexpr unsigned BENCH_DEFAULT_MIX[] = {50, 30, 5, 5, 5, 3, 2};
+
+struct benchConfig {
+    std::string host = "127.0.0.1";
+    int port = 0;
+    unsigned protocol = BENCH_PROTOCOL_RESP;
+    long long clients = 50;
+    long long pipeline = 1;
+    long long requests = 100000;
+    // seconds, 0 to stop after requests only
+    long long duration = 0;
+    long long keyspace = 10000;
+    long long value_size = 16;
+    long long lrange_len = 10;
+    long long seed = 0;
+    std::array<unsigned, BENCH_CMD_COUNT> mix{};
+    bool json = false;
+
+    static long long parseCount(std::string_view name, std::string_view val, long long min) {
+        long long num;
+        auto res = std::from_chars(val.data(), val.data() + val.size(), num);
+        if (res.ec != std::errc{} || res.ptr != val.data() + val.size() || num < min) {
+            throw std::runtime_error("Invalid value for " + std::string(name) + ": " + std::string(val));
+        }
+        return num;
+    }
+
+    /* Parse "cmd:weight[,cmd:weight...]" */
+    static std::array<unsigned, BENCH_CMD_COUNT> parseMix(std::string_view val) {
+        std::array<unsigned, BENCH_CMD_COUNT> mix{};
+        while (!val.empty()) {
+            auto comma = val.find(',');
+            auto item = val.substr(0, comma);
+            val = comma == std::string_view::npos ? std::string_view{} : val.substr(comma + 1);
+            auto colon = item.find(':');
+            auto it = std::find(std::begin(BENCH_CMDS), std::end(BENCH_CMDS), item.substr(0, colon));
+            if (colon == std::string_view::npos || it == std::end(BENCH_CMDS)) {
+                throw std::runtime_error("Invalid command mix entry: " + std::string(item));
+            }
+            mix[it - std::begin(BENCH_CMDS)] = parseCount("mix", item.substr(colon + 1), 0);
+        }
+        if (std::all_of(mix.begin(), mix.end(), [](unsigned w) { return w == 0; })) {
+            throw std::runtime_error("Command mix has no command");
+        }
+        return mix;
+    }
+
+    static benchConfig fromArgs(int argc, char **argv) {
+        benchConfig config;
+        std::copy(std::begin(BENCH_DEFAULT_MIX), std::end(BENCH_DEFAULT_MIX), config.mix.begin());
+        for (int i = 1; i < argc; i += 2) {
+            std::string_view name = argv[i];
+            if (i + 1 >= argc) {
+                throw std::runtime_error("Missing value for option " + std::string(name));
+            }
+            std::string_view val = argv[i + 1];
+            name = name.substr(0, 2) == "--" ? name.substr(2) : name;
+            if (name == "host") {
+                config.host = val;
+            } else if (name == "port") {
+                config.port = (int) parseCount(name, val, 1);
+            } else if (name == "protocol") {
+                if (val == "resp") {
+                    config.protocol = BENCH_PROTOCOL_RESP;
+                } else if (val == "http") {
+                    config.protocol = BENCH_PROTOCOL_HTTP;
+                } else {
+                    throw std::runtime_error("Invalid value for protocol: " + std::string(val));
+                }
+            } else if (name == "clients") {
+                config.clients = parseCount(name, val, 1);
+            } else if (name == "pipeline") {
+                config.pipeline = parseCount(name, val, 1);
+            } else if (name == "requests") {
+                config.requests = parseCount(name, val, 0);
+            } else if (name == "duration") {
+                config.duration = parseCount(name, val, 0);
+            } else if (name == "keyspace") {
+                config.keyspace = parseCount(name, val, 1);
+            } else if (name == "value-size") {
+                config.value_size = parseCount(name, val, 1);
+            } else if (name == "lrange-len") {
+                config.lrange_len = parseCount(name, val, 1);
+            } else if (name == "seed") {
+                config.seed = parseCount(name, val, 0);
+            } else if (name == "mix") {
+                config.mix = parseMix(val);
+            } else if (name == "format") {
+                if (val != "text" && val != "json") {
+                    throw std::runtime_error("Invalid value for format: " + std::string(val));
+                }
+                config.json = val == "json";
+            } else {
+                throw std::runtime_error("Unknown option: " + std::string(name));
+            }
+        }
+        if (config.port == 0) {
+            config.port = config.protocol == BENCH_PROTOCOL_RESP ? 6379 : 8080;
+        }
+        if (config.requests == 0 && config.duration == 0) {
+            throw std::runtime_error("One of requests or duration must be positive");
+        }
+        return config;
+    }
+};
+
+/* Calls and latency histogram of one command, owned by a single client */
+struct benchStats {
+    uint64_t calls = 0;
+    uint64_t errors = 0;
+    uint64_t max_ns = 0;
+    std::array<uint64_t, LATENCY_BUCKETS> buckets{};
+
+    void add(uint64_t ns, bool ok) {
+        calls++;
+        errors += !ok;
+        max_ns = std::max(max_ns, ns);
+        buckets[latencyBucket(ns)]++;
+    }
+
+    void merge(const benchStats &other) {
+        calls += other.calls;
+        errors += other.errors;
+        max_ns = std::max(max_ns, other.max_ns);
+        for (size_t b = 0; b < LATENCY_BUCKETS; b++) {
+            buckets[b] += other.buckets[b];
+        }
+    }
+
+    /* Latency in microseconds below which a fraction q of the calls completed */
+    double percentileUs(double q) const {
+        return latencyPercentile(buckets, calls, q) / 1000;
+    }
+};
+
+/* A blocking connection to the server with a read buffer */
+class benchConn {
+private:
+    int fd = -1;
+    std::string buf;
+    size_t pos = 0;
+
+    void fill() {
+        if (pos > 0 && pos == buf.size()) {
+            buf.clear();
+            pos = 0;
+        }
+        char chunk[BENCH_READ_CHUNK];
+        auto n = read(fd, chunk, sizeof(chunk));
+        if (n <= 0) {
+            throw std::runtime_error(n == 0 ? "Connection closed by server" : std::string(strerror(errno)));
+        }
+        buf.append(chunk, n);
+    }
+
+    std::string_view readLine() {
+        size_t end;
+        while ((end = buf.find("\r\n", pos)) == std::string::npos) {
+            fill();
+        }
+        std::string_view line{buf.data() + pos, end - pos};
+        pos = end + 2;
+        return line;
+    }
+
+    void skip(size_t n) {
+        while (buf.size() - pos < n) {
+            fill();
+        }
+        pos += n;
+    }
+
+    static long long toInt(std::string_view s) {
+        long long num = 0;
+        auto res = std::from_chars(s.data(), s.data() + s.size(), num);
+        if (res.ec != std::errc{} || res.ptr != s.data() + s.size()) {
+            throw std::runtime_error("Malformed reply");
+        }
+        return num;
+    }
+
+public:
+    benchConn(const std::string &host, int port) {
+        addrinfo hints{}, *res;
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &res) != 0) {
+            throw std::runtime_error("Cannot resolve " + host);
+        }
+        fd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC, res->ai_protocol);
+        if (fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+            freeaddrinfo(res);
+            throw std::runtime_error("Cannot connect to " + host + ":" + std::to_string(port) + ": " + strerror(errno));
+        }
+        freeaddrinfo(res);
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    benchConn(const benchConn &) = delete;
+
+    benchConn &operator=(const benchConn &) = delete;
+
+    ~benchConn() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    void send(const std::string &out) {
+        size_t off = 0;
+        while (off < out.size()) {
+            auto n = ::send(fd, out.data() + off, out.size() - off, MSG_NOSIGNAL);
+            if (n <= 0) {
+                throw std::runtime_error("send failed: " + std::string(strerror(errno)));
+            }
+            off += n;
+        }
+    }
+
+    /* Read one RESP reply, return false if it is an error */
+    bool readResp() {
+        auto line = readLine();
+        if (line.empty()) {
+            throw std::runtime_error("Malformed reply");
+        }
+        switch (line[0]) {
+            case '+':
+            case ':':
+                return true;
+            case '-':
+                return false;
+            case '$': {
+                auto len = toInt(line.substr(1));
+                if (len >= 0) {
+                    skip(len + 2);
+                }
+                return true;
+            }
+            case '*': {
+                auto count = toInt(line.substr(1));
+                for (long long i = 0; i < count; i++) {
+                    readResp();
+                }
+                return true;
+            }
+            default:
+                throw std::runtime_error("Malformed reply");
+        }
+    }
+
+    /* Read one HTTP response, return its body */
+    std::string_view readHttp() {
+        auto status = readLine();
+        if (status.substr(0, 5) != "HTTP/" || status.find(" 200") == std::string_view::npos) {
+            throw std::runtime_error("Unexpected HTTP status: " + std::string(status));
+        }
+        long long length = -1;
+        while (true) {
+            auto line = readLine();
+            if (line.empty()) {
+                break;
+            }
+            auto colon = line.find(':');
+            std::string name{line.substr(0, colon)};
+            for (auto &c: name) {
+                c = (char) tolower(c);
+            }
+            if (name == "content-length") {
+                length = toInt(line.substr(line.find_first_not_of(' ', colon + 1)));
+            }
+        }
+        if (length < 0) {
+            throw std::runtime_error("HTTP response without Content-Length");
+        }
+        while (buf.size() - pos < (size_t) length) {
+            fill();
+        }
+        std::string_view body{buf.data() + pos, (size_t) length};
+        pos += length;
+        return body;
+    }
+};
+
+/* Random commands following the configured mix */
+class benchGenerator {
+private:
+    const benchConfig &config;
+    std::mt19937_64 rng;
+    std::discrete_distribution<size_t> pick;
+    std::uniform_int_distribution<long long> key;
+    std::string value;
+
+    std::string keyName(std::string_view prefix) {
+        return std::string(prefix) + std::to_string(key(rng));
+    }
+
+public:
+    benchGenerator(const benchConfig &config, uint64_t seed)
+            : config(config), rng(seed), pick(config.mix.begin(), config.mix.end()),
+              key(0, config.keyspace - 1), value(config.value_size, 'x') {
+        for (auto &c: value) {
+            c = (char) ('a' + rng() % 26);
+        }
+    }
+
+    /* Pick the next command, return its index in BENCH_CMDS and fill its arguments */
+    size_t next(std::vector<std::string> &args) {
+        auto cmd = pick(rng);
+        args.assign({std::string(BENCH_CMDS[cmd])});
+        switch (cmd) {
+            case 0:
+                args.push_back(keyName("key:"));
+                break;
+            case 1:
+                args.push_back(keyName("key:"));
+                args.push_back(value);
+                break;
+            case 2:
+                args.push_back(keyName("list:"));
+                args.push_back(value);
+                break;
+            case 3:
+                args.push_back(keyName("list:"));
+                break;
+            case 4:
+                args.push_back(keyName("set:"));
+                args.push_back(keyName("member:"));
+                break;
+            case 5:
+                args.push_back(keyName("set:"));
+                args.push_back(keyName("set:"));
+                break;
+            default:
+                args.push_back(keyName("list:"));
+                args.push_back("0");
+                args.push_back(std::to_string(config.lrange_len - 1));
+        }
+        return cmd;
+    }
+};
+
+/* Append a command as a RESP array of bulk strings */
+void appendResp(std::string &out, const std::vector<std::string> &args) {
+    out += '*' + std::to_string(args.size()) + "\r\n";
+    for (auto &arg: args) {
+        out += '$' + std::to_string(arg.size()) + "\r\n" + arg + "\r\n";
+    }
+}
+
+/* Append a command as a line of a plain text request */
+void appendText(std::string &out, const std::vector<std::string> &args) {
+    if (!out.empty()) {
+        out += '\n';
+    }
+    for (size_t i = 0; i < args.size(); i++) {
+        out += (i > 0 ? " " : "") + args[i];
+    }
+}
+
+/* Split the newline-separated text replies of a batch, telling for each whether it is an error.
+ * Items of a list are rendered as lines "N) ..." and belong to the reply of item 1.
+ * */
+void splitTextReplies(std::string_view body, std::vector<bool> &oks) {
+    oks.clear();
+    while (true) {
+        auto eol = body.find('\n');
+        auto line = body.substr(0, eol);
+        long long item = 0;
+        auto res = std::from_chars(line.data(), line.data() + line.size(), item);
+        bool continued = res.ec == std::errc{} && item > 1 && line.substr(res.ptr - line.data(), 2) == ") ";
+        if (!continued) {
+            oks.push_back(line.substr(0, 6) != "ERROR:");
+        }
+        if (eol == std::string_view::npos) {
+            return;
+        }
+        body = body.substr(eol + 1);
+    }
+}
+
+/* Issue pipelines until the shared request budget or the deadline runs out */
+void runClient(const benchConfig &config, uint64_t seed, std::atomic<long long> &budget,
+               std::chrono::steady_clock::time_point deadline, std::array<benchStats, BENCH_CMD_COUNT> &stats) {
+    benchConn conn{config.host, config.port};
+    benchGenerator gen{config, seed};
+    std::vector<std::string> args;
+    std::vector<size_t> cmds;
+    std::vector<bool> oks;
+    std::string out, body;
+    while (config.duration == 0 || std::chrono::steady_clock::now() < deadline) {
+        long long n = config.pipeline;
+        if (config.requests > 0) {
+            n = std::min(n, budget.fetch_sub(config.pipeline));
+            if (n <= 0) {
+                return;
+            }
+        }
+
+        out.clear();
+        body.clear();
+        cmds.clear();
+        for (long long i = 0; i < n; i++) {
+            cmds.push_back(gen.next(args));
+            config.protocol == BENCH_PROTOCOL_RESP ? appendResp(out, args) : appendText(body, args);
+        }
+        if (config.protocol == BENCH_PROTOCOL_HTTP) {
+            out = std::string("POST ") + (n > 1 ? "/batch" : "/") + " HTTP/1.1\r\nHost: " + config.host
+                  + "\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        conn.send(out);
+        if (config.protocol == BENCH_PROTOCOL_RESP) {
+            for (auto cmd: cmds) {
+                bool ok = conn.readResp();
+                stats[cmd].add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - start).count(), ok);
+            }
+        } else {
+            // the replies of a batch arrive together
+            auto reply = conn.readHttp();
+            uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start).count();
+            splitTextReplies(reply, oks);
+            if (oks.size() != cmds.size()) {
+                throw std::runtime_error("Expected " + std::to_string(cmds.size()) + " replies, got "
+                                         + std::to_string(oks.size()));
+            }
+            for (size_t i = 0; i < cmds.size(); i++) {
+                stats[cmds[i]].add(ns, oks[i]);
+            }
+        }
+    }
+}
+
+void printJsonStats(const benchStats &stats) {
+    printf("{\"calls\":%llu,\"errors\":%llu,\"p50_us\":%.3f,\"p90_us\":%.3f,\"p99_us\":%.3f,\"p999_us\":%.3f,"
+           "\"max_us\":%.3f}", (unsigned long long) stats.calls, (unsigned long long) stats.errors,
+           stats.percentileUs(0.5), stats.percentileUs(0.9), stats.percentileUs(0.99), stats.percentileUs(0.999),
+           (double) stats.max_ns / 1000);
+}
+
+void printTextStats(std::string_view name, const benchStats &stats, double seconds) {
+    printf("%-8.*s %10llu calls %8llu errors %12.1f ops/s  p50 %9.3f  p90 %9.3f  p99 %9.3f  p999 %9.3f  max %9.3f us\n",
+           (int) name.size(), name.data(), (unsigned long long) stats.calls, (unsigned long long) stats.errors,
+           (double) stats.calls / seconds, stats.percentileUs(0.5), stats.percentileUs(0.9),
+           stats.percentileUs(0.99), stats.percentileUs(0.999), (double) stats.max_ns / 1000);
+}
+
+int main(int argc, char **argv) {
+    benchConfig config;
+    try {
+        config = benchConfig::fromArgs(argc, argv);
+    } catch (const std::exception &e) {
+        std::cerr << "[BENCHMARK] " << e.what() << std::endl;
+        return 1;
+    }
+
+    uint64_t seed = config.seed != 0 ? config.seed : std::random_device{}();
+    std::atomic<long long> budget{config.requests};
+    std::vector<std::array<benchStats, BENCH_CMD_COUNT>> stats(config.clients);
+    std::vector<std::thread> clients;
+    std::atomic<bool> failed{false};
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + std::chrono::seconds(config.duration);
+    for (long long i = 0; i < config.clients; i++) {
+        clients.emplace_back([&, i] {
+            try {
+                runClient(config, seed + i, budget, deadline, stats[i]);
+            } catch (const std::exception &e) {
+                if (!failed.exchange(true)) {
+                    std::cerr << "[BENCHMARK] Client " << i << ": " << e.what() << std::endl;
+                }
+                budget = 0;
+            }
+        });
+    }
+    for (auto &t: clients) {
+        t.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (failed) {
+        return 1;
+    }
+
+    std::array<benchStats, BENCH_CMD_COUNT> cmds{};
+    benchStats total;
+    for (auto &client: stats) {
+        for (size_t cmd = 0; cmd < BENCH_CMD_COUNT; cmd++) {
+            cmds[cmd].merge(client[cmd]);
+            total.merge(client[cmd]);
+        }
+    }
+
+    if (config.json) {
+        printf("{\"protocol\":\"%s\",\"clients\":%lld,\"pipeline\":%lld,\"keyspace\":%lld,\"value_size\":%lld,"
+               "\"seconds\":%.6f,\"ops_per_sec\":%.1f,\"total\":",
+               config.protocol == BENCH_PROTOCOL_RESP ? "resp" : "http", config.clients, config.pipeline,
+               config.keyspace, config.value_size, seconds, (double) total.calls / seconds);
+        printJsonStats(total);
+        printf(",\"commands\":{");
+        bool first = true;
+        for (size_t cmd = 0; cmd < BENCH_CMD_COUNT; cmd++) {
+            if (cmds[cmd].calls == 0) {
+                continue;
+            }
+            printf("%s\"%.*s\":", first ? "" : ",", (int) BENCH_CMDS[cmd].size(), BENCH_CMDS[cmd].data());
+            printJsonStats(cmds[cmd]);
+            first = false;
+        }
+        printf("}}\n");
+    } else {
+        printf("%s, %lld clients, pipeline %lld, %.3f s\n", config.protocol == BENCH_PROTOCOL_RESP ? "RESP" : "HTTP",
+               config.clients, config.pipeline, seconds);
+        for (size_t cmd = 0; cmd < BENCH_CMD_COUNT; cmd++) {
+            if (cmds[cmd].calls > 0) {
+                printTextStats(BENCH_CMDS[cmd], cmds[cmd], seconds);
+            }
+        }
+        printTextStats("total", total, seconds);
+    }
+    return 0;
+}
@@ -0,0 +1,511 @@
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <new>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <filesystem>
+#include <unistd.h>
+
+#include "dbGate.h"
+
+/* In-process microbenchmarks of the engine: command parsing, ldsDb::execute per command type,
+ * set intersections, list ranges, snapshot save and restore, and shard lock contention.
+ * Each case reports ns/op, and heap allocations and bytes per op, counted by replacing operator new.
+ * Objects served by the slab pool are only counted when a new slab is carved.
+ * */
+
+#define MICRO_DEFAULT_OPS 200000
+#define MICRO_DEFAULT_KEYS 1000000
+
+// Allocations of every thread, including helpers such as the snapshot loaders, counted by the replaced operator new
+std::atomic<uint64_t> alloc_count{0};
+std::atomic<uint64_t> alloc_bytes{0};
+
+void countAlloc(size_t size) {
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+    alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+}
+
+void *countedAlloc(size_t size) {
+    countAlloc(size);
+    if (void *p = std::malloc(size == 0 ? 1 : size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void *countedAlignedAlloc(size_t size, std::align_val_t align) {
+    countAlloc(size);
+    auto a = std::max(sizeof(void *), (size_t) align);
+    if (void *p = std::aligned_alloc(a, (size + a - 1) / a * a)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new(size_t size) {
+    return countedAlloc(size);
+}
+
+void *operator new[](size_t size) {
+    return countedAlloc(size);
+}
+
+void *operator new(size_t size, std::align_val_t align) {
+    return countedAlignedAlloc(size, align);
+}
+
+void *operator new[](size_t size, std::align_val_t align) {
+    return countedAlignedAlloc(size, align);
+}
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, std::align_val_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void *p, std::align_val_t) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, size_t, std::align_val_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void *p, size_t, std::align_val_t) noexcept {
+    std::free(p);
+}
+
+struct microResult {
+    std::string name;
+    uint64_t ops;
+    double ns;
+    uint64_t allocs;
+    uint64_t bytes;
+};
+
+class microSuite {
+private:
+    std::string filter;
+    bool json;
+    std::vector<microResult> results;
+
+    void report(microResult &&res) {
+        if (json) {
+            printf("%s{\"name\":\"%s\",\"ops\":%llu,\"ns_per_op\":%.1f,\"allocs_per_op\":%.3f,\"bytes_per_op\":%.1f}",
+                   results.empty() ? "[" : ",\n ", res.name.c_str(), (unsigned long long) res.ops, res.ns / res.ops,
+                   (double) res.allocs / res.ops, (double) res.bytes / res.ops);
+        } else {
+            printf("%-44s %10llu ops %12.1f ns/op %10.3f allocs/op %12.1f B/op\n", res.name.c_str(),
+                   (unsigned long long) res.ops, res.ns / res.ops, (double) res.allocs / res.ops,
+                   (double) res.bytes / res.ops);
+        }
+        fflush(stdout);
+        results.push_back(std::move(res));
+    }
+
+public:
+    long long ops = MICRO_DEFAULT_OPS;
+    long long keys = MICRO_DEFAULT_KEYS;
+
+    microSuite(std::string filter, bool json) : filter(std::move(filter)), json(json) {}
+
+    ~microSuite() {
+        if (json) {
+            printf(results.empty() ? "[]\n" : "]\n");
+        }
+    }
+
+    bool selected(std::string_view name) const {
+        return name.find(filter) != std::string_view::npos;
+    }
+
+    /* Time n calls of f(i) on the current thread */
+    void run(const std::string &name, uint64_t n, const std::function<void(uint64_t)> &f) {
+        runOnce(name, n, [&] {
+            for (uint64_t i = 0; i < n; i++) {
+                f(i);
+            }
+        });
+    }
+
+    /* Time a single call of f doing ops operations */
+    void runOnce(const std::string &name, uint64_t ops, const std::function<void()> &f) {
+        if (!selected(name)) {
+            return;
+        }
+        auto allocs = alloc_count.load(), bytes = alloc_bytes.load();
+        auto start = std::chrono::steady_clock::now();
+        f();
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        report({name, ops, ns, alloc_count - allocs, alloc_bytes - bytes});
+    }
+
+    /* Run n calls of f(thread, i) on each of threads threads at once, ns/op is wall time over all calls */
+    void runThreads(const std::string &name, unsigned threads, uint64_t n,
+                    const std::function<void(unsigned, uint64_t)> &f) {
+        if (!selected(name)) {
+            return;
+        }
+        std::atomic<unsigned> ready{0};
+        std::atomic<bool> go{false};
+        std::vector<std::thread> workers;
+        for (unsigned t = 0; t < threads; t++) {
+            workers.emplace_back([&, t] {
+                ready++;
+                while (!go) {
+                    std::this_thread::yield();
+                }
+                for (uint64_t i = 0; i < n; i++) {
+                    f(t, i);
+                }
+            });
+        }
+        while (ready < threads) {
+            std::this_thread::yield();
+        }
+        auto allocs = alloc_count.load(), bytes = alloc_bytes.load();
+        auto start = std::chrono::steady_clock::now();
+        go = true;
+        for (auto &w: workers) {
+            w.join();
+        }
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        report({name, n * threads, ns, alloc_count - allocs, alloc_bytes - bytes});
+    }
+};
+
+/* Run a pre-parsed command through ldsDb::execute */
+void exec(ldsDb &db, const ldsCmd &cmd) {
+    ldsRet ret;
+    db.execute(cmd, ret);
+}
+
+void benchParse(microSuite &suite) {
+    std::string many = "sadd set";
+    for (int i = 0; i < 32; i++) {
+        many += " member" + std::to_string(i);
+    }
+    std::vector<std::pair<std::string, std::string>> lines = {
+            {"get",      "get key:000123"},
+            {"set",      "set key:000123 some-value-of-32-bytes-0123456789"},
+            {"lrange",   "LRANGE list 0 -1"},
+            {"sadd32",   many},
+    };
+    for (auto &[name, line]: lines) {
+        suite.run("parse/parseCmd/" + name, suite.ops, [&](uint64_t) {
+            auto cmd = parseCmd(line);
+            asm volatile("" : : "r"(&cmd) : "memory");
+        });
+    }
+    auto args = std::string_view{many}.substr(5);
+    suite.run("parse/tokenize/sadd32", suite.ops, [&](uint64_t) {
+        ldsArgs argv;
+        tokenize(args, argv);
+        asm volatile("" : : "r"(&argv) : "memory");
+    });
+}
+
+void benchExecute(microSuite &suite) {
+    ldsDb db;
+    uint64_t n = suite.ops;
+    std::vector<std::string> keys;
+    for (uint64_t i = 0; i < n; i++) {
+        keys.push_back("key:" + std::to_string(i));
+    }
+
+    std::vector<std::string> lines;
+    std::vector<ldsCmd> cmds;
+    auto prepare = [&](const std::function<std::string(uint64_t)> &make) {
+        lines.clear();
+        cmds.clear();
+        for (uint64_t i = 0; i < n; i++) {
+            lines.push_back(make(i));
+        }
+        for (auto &line: lines) {
+            cmds.push_back(parseCmd(line));
+        }
+    };
+    auto bench = [&](const std::string &name, const std::function<std::string(uint64_t)> &make) {
+        if (!suite.selected(name)) {
+            return;
+        }
+        prepare(make);
+        suite.run(name, n, [&](uint64_t i) { exec(db, cmds[i]); });
+    };
+
+    bench("execute/set", [&](uint64_t i) { return "set " + keys[i] + " value-" + std::to_string(i); });
+    bench("execute/set-overwrite", [&](uint64_t i) { return "set " + keys[i] + " other-" + std::to_string(i); });
+    bench("execute/get", [&](uint64_t i) { return "get " + keys[i]; });
+    bench("execute/get-miss", [&](uint64_t i) { return "get missing:" + std::to_string(i); });
+    bench("execute/expire", [&](uint64_t i) { return "expire " + keys[i] + " 1000"; });
+    bench("execute/ttl", [&](uint64_t i) { return "ttl " + keys[i]; });
+    bench("execute/del", [&](uint64_t i) { return "del " + keys[i]; });
+    bench("execute/lpush", [&](uint64_t i) { return "lpush list:" + std::to_string(i % 100) + " item" + std::to_string(i); });
+    bench("execute/rpush", [&](uint64_t i) { return "rpush list:" + std::to_string(i % 100) + " item" + std::to_string(i); });
+    bench("execute/llen", [&](uint64_t i) { return "llen list:" + std::to_string(i % 100); });
+    bench("execute/lrange-10", [&](uint64_t i) { return "lrange list:" + std::to_string(i % 100) + " 0 9"; });
+    bench("execute/lpop", [&](uint64_t i) { return "lpop list:" + std::to_string(i % 100); });
+    bench("execute/sadd", [&](uint64_t i) { return "sadd set:" + std::to_string(i % 100) + " m" + std::to_string(i); });
+    bench("execute/sadd-int", [&](uint64_t i) { return "sadd iset:" + std::to_string(i % 100) + " " + std::to_string(i); });
+    bench("execute/sismember", [&](uint64_t i) { return "sismember set:" + std::to_string(i % 100) + " m" + std::to_string(i); });
+    bench("execute/scard", [&](uint64_t i) { return "scard set:" + std::to_string(i % 100); });
+    bench("execute/srem", [&](uint64_t i) { return "srem set:" + std::to_string(i % 100) + " m" + std::to_string(i); });
+}
+
+/* Intersections of two sets of sizes a and b, sharing half of the smaller one.
+ * Integer members stay intsets, intersected by intersectInts, only up to SET_MAX_INTSET_ENTRIES,
+ * larger sets of integers are hash sets probed like any other.
+ * */
+void benchSetInter(microSuite &suite) {
+    struct shape {
+        size_t a, b;
+        bool ints;
+    };
+    for (auto [a, b, ints]: std::initializer_list<shape>{{10, 10000, false}, {10000, 10, false}, {1000, 1000, false},
+                                                         {100000, 100000, false}, {10, 10000, true},
+                                                         {10000, 10, true}, {100000, 100000, true},
+                                                         {SET_MAX_INTSET_ENTRIES, SET_MAX_INTSET_ENTRIES, true}}) {
+        bool intsets = ints && std::max(a, b) <= SET_MAX_INTSET_ENTRIES;
+        std::string name = "sinter/" + std::to_string(a) + "x" + std::to_string(b)
+                           + (intsets ? "/intset" : ints ? "/int-hash" : "/str");
+        if (!suite.selected(name)) {
+            continue;
+        }
+        ldsDb db;
+        auto member = [&](size_t i) { return ints ? std::to_string(i) : "m" + std::to_string(i); };
+        std::vector<std::string> ma, mb;
+        for (size_t i = 0; i < a; i++) {
+            ma.push_back(member(i));
+        }
+        // the second set holds every other member of the first, then members of its own
+        for (size_t i = 0; i < b; i++) {
+            mb.push_back(member(i < a ? 2 * i : a + i));
+        }
+        std::vector<std::string_view> va{ma.begin(), ma.end()}, vb{mb.begin(), mb.end()};
+        db.cmdSadd("a", va);
+        db.cmdSadd("b", vb);
+        std::string_view keys[] = {"a", "b"};
+        uint64_t n = std::max<uint64_t>(10, (uint64_t) suite.ops / std::max<uint64_t>(1, std::min(a, b)));
+        suite.run(name, n, [&](uint64_t) {
+            auto ret = db.cmdSetOp(keys, SETOP_INTER);
+            asm volatile("" : : "r"(&ret) : "memory");
+        });
+    }
+
+    // the intersection kernel alone, with and without AVX2, checked against each other:
+    // at the size of the largest intsets, and on arrays far larger than any intset to measure the kernel itself
+    if (!suite.selected("sinter/kernel/")) {
+        return;
+    }
+    for (size_t len: {(size_t) SET_MAX_INTSET_ENTRIES, (size_t) 100000}) {
+        std::vector<int64_t> a, b, scalar, simd;
+        for (size_t i = 0; i < len; i++) {
+            a.push_back(3 * i);
+            b.push_back(2 * i);
+        }
+        intersectInts(a.data(), len, b.data(), len, scalar, false);
+        intersectInts(a.data(), len, b.data(), len, simd, true);
+        if (simd != scalar) {
+            throw std::runtime_error("AVX2 intersection differs from the scalar one");
+        }
+        uint64_t n = std::max<uint64_t>(10, (uint64_t) suite.ops / len);
+        for (bool use_simd: {false, true}) {
+            if (use_simd && !cpuHasAvx2()) {
+                printf("sinter/kernel/avx2 skipped, the CPU does not support AVX2\n");
+                continue;
+            }
+            std::vector<int64_t> out;
+            out.reserve(len);
+            suite.run(std::string("sinter/kernel/") + std::to_string(len) + "x" + std::to_string(len)
+                      + (use_simd ? "/avx2" : "/scalar"), n, [&](uint64_t) {
+                out.clear();
+                intersectInts(a.data(), len, b.data(), len, out, use_simd);
+                asm volatile("" : : "r"(out.data()) : "memory");
+            });
+        }
+    }
+}
+
+/* Ranges of 10 items at varying offsets of a 100000 item list */
+void benchRangeList(microSuite &suite) {
+    const long long len = 100000;
+    ldsDb db;
+    std::vector<std::string> items;
+    for (long long i = 0; i < len; i++) {
+        items.push_back("item" + std::to_string(i));
+    }
+    std::vector<std::string_view> views{items.begin(), items.end()};
+    db.cmdPush("list", views, LBACK);
+    for (long long offset: {0LL, len / 100, len / 2, len - len / 100, len - 10}) {
+        suite.run("lrange/offset-" + std::to_string(offset), suite.ops / 10, [&](uint64_t) {
+            auto ret = db.cmdLrange("list", offset, offset + 9);
+            asm volatile("" : : "r"(&ret) : "memory");
+        });
+    }
+    suite.run("lrange/whole-100000", 20, [&](uint64_t) {
+        auto ret = db.cmdLrange("list", 0, -1);
+        asm volatile("" : : "r"(&ret) : "memory");
+    });
+}
+
+/* Save and restore a snapshot of suite.keys keys in the current directory */
+void benchSnapshotIn(microSuite &suite) {
+    auto *db = new ldsDb{};
+    for (long long i = 0; i < suite.keys; i++) {
+        auto key = "key:" + std::to_string(i);
+        if (i % 10 == 0) {
+            std::string_view items[] = {"a", "b", "c"};
+            db->cmdPush(key, items, LBACK);
+        } else {
+            db->cmdSet(key, "value-" + std::to_string(i));
+        }
+    }
+    ldsSnapshot snapshot;
+    suite.runOnce("snapshot/create", suite.keys, [&] {
+        if (!snapshot.createSnapshot(*db)) {
+            throw std::runtime_error("Failed to create snapshot");
+        }
+    });
+    delete db;
+    db = nullptr;
+    suite.runOnce("snapshot/restore", suite.keys, [&] {
+        db = snapshot.restoreSnapshot();
+    });
+    if (db == nullptr) {
+        throw std::runtime_error("Failed to restore snapshot");
+    }
+    delete db;
+}
+
+/* Save and restore a snapshot of suite.keys keys, reported per key.
+ * Snapshots are written to the current directory, so this runs in a private temporary one
+ * that is removed afterwards, leaving any snapshot where the benchmark was started untouched.
+ * */
+void benchSnapshot(microSuite &suite) {
+    if (!suite.selected("snapshot/")) {
+        return;
+    }
+    auto cwd = std::filesystem::current_path();
+    std::string tmpl = (std::filesystem::temp_directory_path() / "ledis_microbench.XXXXXX").string();
+    if (mkdtemp(tmpl.data()) == nullptr) {
+        throw std::runtime_error("Cannot create a temporary directory: " + std::string(strerror(errno)));
+    }
+    std::filesystem::path dir = tmpl;
+    std::filesystem::current_path(dir);
+    try {
+        benchSnapshotIn(suite);
+    } catch (...) {
+        std::filesystem::current_path(cwd);
+        std::filesystem::remove_all(dir);
+        throw;
+    }
+    std::filesystem::current_path(cwd);
+    std::filesystem::remove_all(dir);
+}
+
+/* Threads hammering one hot key, or keys spread over every shard, with a share of writes */
+void benchContention(microSuite &suite) {
+    unsigned max_threads = std::max(2u, std::thread::hardware_concurrency());
+    for (bool hot: {true, false}) {
+        for (unsigned writes: {0u, 10u, 100u}) {
+            for (unsigned threads = 1; threads <= max_threads; threads *= 2) {
+                std::string name = std::string("contention/") + (hot ? "hot-key" : "spread") + "/writes-"
+                                   + std::to_string(writes) + "pct/threads-" + std::to_string(threads);
+                if (!suite.selected(name)) {
+                    continue;
+                }
+                ldsDb db;
+                const uint64_t spread = 100000;
+                std::vector<ldsCmd> gets, sets;
+                std::vector<std::string> lines;
+                lines.reserve(2 * spread);
+                for (uint64_t i = 0; i < spread; i++) {
+                    auto key = hot ? std::string("hot") : "key:" + std::to_string(i);
+                    lines.push_back("get " + key);
+                    lines.push_back("set " + key + " value");
+                }
+                for (uint64_t i = 0; i < spread; i++) {
+                    gets.push_back(parseCmd(lines[2 * i]));
+                    sets.push_back(parseCmd(lines[2 * i + 1]));
+                    exec(db, sets.back());
+                }
+                suite.runThreads(name, threads, suite.ops / threads, [&](unsigned t, uint64_t i) {
+                    auto k = (i * 7919 + t * 104729) % spread;
+                    exec(db, (i * 37 + t) % 100 < writes ? sets[k] : gets[k]);
+                });
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    std::string filter;
+    bool json = false;
+    long long ops = MICRO_DEFAULT_OPS, keys = MICRO_DEFAULT_KEYS;
+    try {
+        for (int i = 1; i < argc; i += 2) {
+            std::string_view name = argv[i];
+            if (i + 1 >= argc) {
+                throw std::runtime_error("Missing value for option " + std::string(name));
+            }
+            std::string_view val = argv[i + 1];
+            name = name.substr(0, 2) == "--" ? name.substr(2) : name;
+            if (name == "filter") {
+                filter = val;
+            } else if (name == "format" && (val == "text" || val == "json")) {
+                json = val == "json";
+            } else if (name == "ops" || name == "keys") {
+                (name == "ops" ? ops : keys) = parseInt(val);
+                if ((name == "ops" ? ops : keys) <= 0) {
+                    throw std::runtime_error("Invalid value for " + std::string(name) + ": " + std::string(val));
+                }
+            } else {
+                throw std::runtime_error("Unknown option or invalid value: " + std::string(name));
+            }
+        }
+    } catch (const std::exception &e) {
+        std::cerr << "[MICROBENCH] " << e.what() << std::endl;
+        return 1;
+    }
+    LOGGER.setLevel(LOG_LEVEL_WARNING);
+
+    microSuite suite{filter, json};
+    suite.ops = ops;
+    suite.keys = keys;
+    try {
+        benchParse(suite);
+        benchExecute(suite);
+        benchSetInter(suite);
+        benchRangeList(suite);
+        benchSnapshot(suite);
+        benchContention(suite);
+    } catch (const std::exception &e) {
+        std::cerr << "[MICROBENCH] " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
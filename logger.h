@@ -2,27 +2,235 @@
 
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <vector>
+#include <array>
+#include <unistd.h>
 
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARNING 2
+#define LOG_LEVEL_ERROR 3
+
+// Lowest level compiled in, calls through the LOG_* macros below it compile to nothing
+#ifndef LEDIS_LOG_LEVEL
+#define LEDIS_LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+// Messages buffered per thread, further messages are dropped until the writer catches up
+#define LOG_RING_SLOTS 4096
+// Max delay before buffered messages are written
+#define LOG_FLUSH_INTERVAL_MS 50
+
+/* Asynchronous logger.
+ * Each thread appends its messages to its own single-producer single-consumer ring,
+ * without locking. A background writer drains every ring and writes the lines in batches,
+ * errors to stderr and everything else to stdout. Lines of one thread keep their order.
+ * */
 class logger {
+private:
+    struct message {
+        int level;
+        std::string text;
+    };
+
+    struct ring {
+        std::array<message, LOG_RING_SLOTS> slots;
+        // next slot to write, advanced by the owning thread
+        std::atomic<size_t> head{0};
+        // next slot to read, advanced by the writer
+        std::atomic<size_t> tail{0};
+        std::atomic<bool> closed{false};
+        std::string prefix;
+    };
+
+    /* Marks the ring of a thread as closed when the thread exits, the writer drops it once drained */
+    struct ringOwner {
+        std::shared_ptr<ring> r;
+
+        ~ringOwner() {
+            if (r) {
+                r->closed = true;
+            }
+        }
+    };
+
+    std::atomic<int> min_level;
+
+    std::mutex rings_mtx;
+    std::vector<std::shared_ptr<ring>> rings;
+    std::atomic<uint64_t> dropped{0};
+
+    std::thread writer;
+    std::mutex writer_mtx;
+    std::condition_variable writer_cv;
+    std::atomic<bool> pending{false};
+    bool stop = false;
+
+    static constexpr std::string_view LEVEL_TAGS[] = {"[DEBUG] ", "[INFO] ", "[WARNING] ", "[ERROR] "};
+
+    ring &localRing() {
+        thread_local ringOwner owner;
+        if (!owner.r) {
+            owner.r = std::make_shared<ring>();
+            owner.r->prefix = std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id())) + " ";
+            std::lock_guard<std::mutex> lck(rings_mtx);
+            rings.push_back(owner.r);
+        }
+        return *owner.r;
+    }
+
+    static void writeAll(int fd, const std::string &buf) {
+        size_t off = 0;
+        while (off < buf.size()) {
+            auto n = ::write(fd, buf.data() + off, buf.size() - off);
+            if (n <= 0) {
+                return;
+            }
+            off += n;
+        }
+    }
+
+    /* Write out everything buffered so far */
+    void drain() {
+        std::vector<std::shared_ptr<ring>> snapshot;
+        {
+            std::lock_guard<std::mutex> lck(rings_mtx);
+            snapshot = rings;
+        }
+
+        std::string out, err;
+        for (auto &r: snapshot) {
+            size_t tail = r->tail.load(std::memory_order_relaxed);
+            size_t head = r->head.load(std::memory_order_acquire);
+            for (; tail != head; tail++) {
+                auto &msg = r->slots[tail % LOG_RING_SLOTS];
+                auto &buf = msg.level >= LOG_LEVEL_ERROR ? err : out;
+                buf += r->prefix;
+                buf += LEVEL_TAGS[msg.level];
+                buf += msg.text;
+                buf += '\n';
+                msg.text = {};
+            }
+            r->tail.store(tail, std::memory_order_release);
+        }
+        if (auto n = dropped.exchange(0)) {
+            err += "[WARNING] Dropped " + std::to_string(n) + " log messages\n";
+        }
+
+        {
+            std::lock_guard<std::mutex> lck(rings_mtx);
+            std::erase_if(rings, [](const std::shared_ptr<ring> &r) {
+                return r->closed && r->tail.load() == r->head.load();
+            });
+        }
+
+        writeAll(STDOUT_FILENO, out);
+        writeAll(STDERR_FILENO, err);
+    }
+
+    void writerLoop() {
+        std::unique_lock<std::mutex> lck(writer_mtx);
+        while (!stop) {
+            writer_cv.wait_for(lck, std::chrono::milliseconds(LOG_FLUSH_INTERVAL_MS),
+                               [this] { return stop || pending; });
+            pending = false;
+            lck.unlock();
+            drain();
+            lck.lock();
+        }
+    }
+
 public:
-    bool debugMode = false;
-    std::string prefix = "";
+    explicit logger(int min_level = LOG_LEVEL_INFO) : min_level(min_level) {
+        writer = std::thread(&logger::writerLoop, this);
+    }
+
+    ~logger() {
+        {
+            std::lock_guard<std::mutex> lck(writer_mtx);
+            stop = true;
+        }
+        writer_cv.notify_all();
+        writer.join();
+        drain();
+    }
+
+    /* Check if messages of a level are kept, before building them */
+    bool enabled(int level) const {
+        return level >= min_level.load(std::memory_order_relaxed);
+    }
+
+    void setLevel(int level) {
+        min_level.store(level, std::memory_order_relaxed);
+    }
 
-    void info(const std::string &msg) const {
-        std::cout << prefix << "[INFO] " << msg << std::endl;
+    /* Queue a message on the ring of the current thread, never blocking */
+    void log(int level, std::string &&msg) {
+        auto &r = localRing();
+        size_t head = r.head.load(std::memory_order_relaxed);
+        size_t used = head - r.tail.load(std::memory_order_acquire);
+        if (used >= LOG_RING_SLOTS) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        r.slots[head % LOG_RING_SLOTS] = {level, std::move(msg)};
+        r.head.store(head + 1, std::memory_order_release);
+        // the writer wakes up periodically, earlier for errors and for rings filling up
+        if ((level >= LOG_LEVEL_ERROR || used >= LOG_RING_SLOTS / 2) && !pending.exchange(true)) {
+            writer_cv.notify_one();
+        }
     }
 
-    void warning(const std::string &msg) const {
-        std::cout << prefix << "[WARNING] " << msg << std::endl;
+    /* Write out everything logged so far by any thread */
+    void flush() {
+        drain();
     }
 
-    void error(const std::string &msg) const {
-        std::cerr << prefix << "[ERROR] " << msg << std::endl;
+    void info(std::string msg) {
+        if (enabled(LOG_LEVEL_INFO)) log(LOG_LEVEL_INFO, std::move(msg));
     }
 
-    void debug(const std::string &msg) const {
-        if (this->debugMode)
-            std::cout << prefix << "[DEBUG] " << msg << std::endl;
+    void warning(std::string msg) {
+        if (enabled(LOG_LEVEL_WARNING)) log(LOG_LEVEL_WARNING, std::move(msg));
     }
-} LOGGER{true, std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id())) + " "};
+
+    void error(std::string msg) {
+        if (enabled(LOG_LEVEL_ERROR)) log(LOG_LEVEL_ERROR, std::move(msg));
+    }
+
+    void debug(std::string msg) {
+        if (enabled(LOG_LEVEL_DEBUG)) log(LOG_LEVEL_DEBUG, std::move(msg));
+    }
+} LOGGER;
+
+// Log through LOGGER, building the message only if its level is enabled
+#define LOG_AT(level, msg) \
+    do { \
+        if (LOGGER.enabled(level)) LOGGER.log(level, msg); \
+    } while (0)
+
+#if LEDIS_LOG_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(msg) LOG_AT(LOG_LEVEL_DEBUG, msg)
+#else
+#define LOG_DEBUG(msg) do {} while (0)
+#endif
+
+#if LEDIS_LOG_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(msg) LOG_AT(LOG_LEVEL_INFO, msg)
+#else
+#define LOG_INFO(msg) do {} while (0)
+#endif
+
+#if LEDIS_LOG_LEVEL <= LOG_LEVEL_WARNING
+#define LOG_WARNING(msg) LOG_AT(LOG_LEVEL_WARNING, msg)
+#else
+#define LOG_WARNING(msg) do {} while (0)
+#endif
+
+#define LOG_ERROR(msg) LOG_AT(LOG_LEVEL_ERROR, msg)
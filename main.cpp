@@ -4,28 +4,54 @@
 
 #include "dbGate.h"
 #include "httpResource.h"
+#include "respServer.h"
 
 #define PORT 8080
+#define RESP_PORT 6379
 #define CONN_TIMEOUT 180
 #define MAX_THREADS 4
 
 extern logger LOGGER;
 
-int main() {
-    LOGGER.info("[MAIN] Initializing database...");
-    auto *db = new dbGate{};
-
-    LOGGER.info("[MAIN] Initializing web server...");
+int main(int argc, char **argv) {
+    ldsConfig config;
+    try {
+        config = ldsConfig::fromArgs(argc, argv);
+    } catch (const std::exception &e) {
+        LOG_ERROR("[MAIN] " + std::string(e.what()));
+        return 1;
+    }
+    LOGGER.setLevel(config.loglevel);
+
+    LOG_INFO("[MAIN] Initializing database...");
+    dbGate *db;
+    try {
+        db = new dbGate{config};
+    } catch (const std::exception &e) {
+        LOG_ERROR("[MAIN] Cannot load the database: " + std::string(e.what()));
+        return 1;
+    }
+
+    LOG_INFO("[MAIN] Initializing web server...");
     httpserver::webserver ws = httpserver::create_webserver(PORT)
             .connection_timeout(CONN_TIMEOUT)
             .start_method(httpserver::http::http_utils::INTERNAL_SELECT)
             .max_threads(MAX_THREADS)
             .debug();
 
+    LOG_INFO("[MAIN] Initializing RESP server...");
+    respServer rs{db, RESP_PORT, MAX_THREADS};
+    if (rs.start())
+        LOG_INFO("[MAIN] RESP server started. Listening on port " + std::to_string(RESP_PORT) + ".");
+
     dbQueryResource dqr{db};
     ws.register_resource("/", &dqr);
+    dbBatchResource dbr{db};
+    ws.register_resource("/batch", &dbr);
+    dbMetricsResource dmr{db};
+    ws.register_resource("/metrics", &dmr);
 
-    LOGGER.info("[MAIN] Web server started. Listening on port " + std::to_string(PORT) + ".");
+    LOG_INFO("[MAIN] Web server started. Listening on port " + std::to_string(PORT) + ".");
     ws.start(true);
 
     return 0;
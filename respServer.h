@@ -0,0 +1,370 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <thread>
+#include <unordered_map>
+#include <charconv>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "dbGate.h"
+#include "logger.h"
+
+extern logger LOGGER;
+
+#define RESP_MAX_EVENTS 256
+#define RESP_READ_CHUNK 16384
+#define RESP_MAX_QUERY (64 * 1024 * 1024)
+// Pending reply bytes above which a connection stops reading and running requests until the client catches up
+#define RESP_MAX_PENDING_OUTPUT (4 * 1024 * 1024)
+
+/* Redis RESP2 front-end over raw TCP.
+ * Each worker thread runs its own epoll loop on the shared listening socket,
+ * and executes pipelined requests in order, batching their replies into one write.
+ * */
+class respServer {
+private:
+    struct respConn {
+        int fd;
+        std::string client;
+        std::string rbuf;
+        size_t rpos = 0;
+        std::string wbuf;
+        size_t wpos = 0;
+        // epoll events currently registered
+        uint32_t events = EPOLLIN;
+        // complete requests were left in rbuf because the output was full
+        bool stalled = false;
+        bool closing = false;
+
+        respConn(int fd, std::string client) : fd(fd), client(std::move(client)) {}
+
+        bool outputFull() const {
+            return wbuf.size() - wpos > RESP_MAX_PENDING_OUTPUT;
+        }
+    };
+
+    enum parseResult {
+        PARSE_MORE, PARSE_OK, PARSE_ERR
+    };
+
+    dbGate *db;
+    int port;
+    int threads;
+    int listen_fd = -1;
+
+    /* Read a CRLF-terminated integer starting at pos, advance pos past the line */
+    static parseResult parseLineInt(const std::string &buf, size_t &pos, long long &val) {
+        auto end = buf.find("\r\n", pos);
+        if (end == std::string::npos) {
+            return buf.size() - pos > 32 ? PARSE_ERR : PARSE_MORE;
+        }
+        auto res = std::from_chars(buf.data() + pos, buf.data() + end, val);
+        if (res.ec != std::errc{} || res.ptr != buf.data() + end) {
+            return PARSE_ERR;
+        }
+        pos = end + 2;
+        return PARSE_OK;
+    }
+
+    /* Parse one request from conn.rbuf starting at conn.rpos, as views into conn.rbuf.
+     * An inline command is returned as its line, a multibulk one as its bulk strings in words,
+     * which may hold any bytes. On PARSE_OK the request is consumed; if both are empty there is nothing to run.
+     * */
+    static parseResult parseRequest(respConn &conn, std::string_view &line, ldsArgs &words) {
+        const auto &buf = conn.rbuf;
+        size_t pos = conn.rpos;
+        line = {};
+        words = {};
+
+        if (buf[pos] != '*') {
+            // inline command
+            auto end = buf.find('\n', pos);
+            if (end == std::string::npos) {
+                return buf.size() - pos > RESP_MAX_QUERY ? PARSE_ERR : PARSE_MORE;
+            }
+            line = std::string_view{buf}.substr(pos, end - pos);
+            if (!line.empty() && line.back() == '\r') {
+                line.remove_suffix(1);
+            }
+            conn.rpos = end + 1;
+            return PARSE_OK;
+        }
+
+        pos++;
+        long long argc;
+        auto res = parseLineInt(buf, pos, argc);
+        if (res != PARSE_OK) {
+            return res;
+        }
+        if (argc > 1024 * 1024) {
+            return PARSE_ERR;
+        }
+
+        for (long long i = 0; i < argc; i++) {
+            if (pos >= buf.size()) {
+                return PARSE_MORE;
+            }
+            if (buf[pos] != '$') {
+                return PARSE_ERR;
+            }
+            pos++;
+            long long len;
+            res = parseLineInt(buf, pos, len);
+            if (res != PARSE_OK) {
+                return res;
+            }
+            if (len < 0 || len > RESP_MAX_QUERY) {
+                return PARSE_ERR;
+            }
+            if (buf.size() - pos < (size_t) len + 2) {
+                return PARSE_MORE;
+            }
+            if (buf[pos + len] != '\r' || buf[pos + len + 1] != '\n') {
+                return PARSE_ERR;
+            }
+            words.push_back(std::string_view{buf.data() + pos, (size_t) len});
+            pos += len + 2;
+        }
+
+        conn.rpos = pos;
+        return PARSE_OK;
+    }
+
+    /* Run the complete requests in the read buffer until the pending output is full,
+     * return false if the connection must be closed
+     * */
+    bool processInput(respConn &conn) {
+        std::string_view line;
+        ldsArgs words;
+        while (!conn.closing && !conn.outputFull() && conn.rpos < conn.rbuf.size()) {
+            auto res = parseRequest(conn, line, words);
+            if (res == PARSE_MORE) {
+                break;
+            }
+            if (res == PARSE_ERR) {
+                conn.wbuf += "-ERR Protocol error\r\n";
+                conn.closing = true;
+                break;
+            }
+            if (line.empty() && words.empty()) {
+                continue;
+            }
+
+            ldsRet ret;
+            current_client = conn.client;
+            int rc;
+            if (words.empty()) {
+                rc = db->parseAndExecute(line, ret);
+            } else {
+                try {
+                    rc = db->execute(makeCmd(words.from(0)), ret);
+                } catch (const std::exception &e) {
+                    ret.setErr(e.what());
+                    LOG_ERROR("[ERROR] " + std::string(e.what()));
+                    rc = 0;
+                }
+            }
+            if (rc < 0) {
+                conn.wbuf += "+OK\r\n";
+                conn.closing = true;
+                break;
+            }
+            writeResp(ret, conn.wbuf);
+        }
+        conn.stalled = conn.outputFull() && conn.rpos < conn.rbuf.size();
+        conn.rbuf.erase(0, conn.rpos);
+        conn.rpos = 0;
+        return true;
+    }
+
+    /* Read everything available, running the requests of each chunk as it arrives,
+     * and stop early while the pending output is full.
+     * Return false if the peer is gone or a single request outgrows RESP_MAX_QUERY.
+     * */
+    bool onReadable(respConn &conn) {
+        char chunk[RESP_READ_CHUNK];
+        while (!conn.closing && !conn.outputFull()) {
+            auto n = read(conn.fd, chunk, sizeof(chunk));
+            if (n > 0) {
+                conn.rbuf.append(chunk, n);
+                if (!processInput(conn)) {
+                    return false;
+                }
+                // unless stalled, only a request still incomplete is left in rbuf
+                if (!conn.stalled && conn.rbuf.size() > RESP_MAX_QUERY) {
+                    LOG_WARNING("[RESP] Query buffer limit exceeded, closing " + conn.client);
+                    return false;
+                }
+                continue;
+            }
+            if (n == 0) {
+                return false;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        return true;
+    }
+
+    /* Write as much of the pending output as possible, return false on error */
+    static bool flushOutput(respConn &conn) {
+        while (conn.wpos < conn.wbuf.size()) {
+            auto n = send(conn.fd, conn.wbuf.data() + conn.wpos, conn.wbuf.size() - conn.wpos, MSG_NOSIGNAL);
+            if (n > 0) {
+                conn.wpos += n;
+                continue;
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                // drop the bytes already sent once they are most of the buffer
+                if (conn.wpos > conn.wbuf.size() / 2) {
+                    conn.wbuf.erase(0, conn.wpos);
+                    conn.wpos = 0;
+                }
+                return true;
+            }
+            return false;
+        }
+        conn.wbuf.clear();
+        conn.wpos = 0;
+        return true;
+    }
+
+    void acceptAll(int ep, std::unordered_map<int, respConn> &conns) const {
+        while (true) {
+            sockaddr_in addr{};
+            socklen_t len = sizeof(addr);
+            int fd = accept4(listen_fd, (sockaddr *) &addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    LOG_ERROR("[RESP] accept failed: " + std::string(strerror(errno)));
+                }
+                return;
+            }
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.fd = fd;
+            if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+                close(fd);
+                continue;
+            }
+            char ip[INET_ADDRSTRLEN] = {};
+            inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+            conns.insert_or_assign(fd, respConn{fd, std::string(ip) + ":" + std::to_string(ntohs(addr.sin_port))});
+        }
+    }
+
+    void loop() {
+        int ep = epoll_create1(EPOLL_CLOEXEC);
+        if (ep < 0) {
+            LOG_ERROR("[RESP] epoll_create1 failed: " + std::string(strerror(errno)));
+            return;
+        }
+        epoll_event lev{};
+        lev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        lev.data.fd = listen_fd;
+        epoll_ctl(ep, EPOLL_CTL_ADD, listen_fd, &lev);
+
+        std::unordered_map<int, respConn> conns;
+        epoll_event events[RESP_MAX_EVENTS];
+        while (true) {
+            int n = epoll_wait(ep, events, RESP_MAX_EVENTS, -1);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                LOG_ERROR("[RESP] epoll_wait failed: " + std::string(strerror(errno)));
+                break;
+            }
+            for (int i = 0; i < n; i++) {
+                int fd = events[i].data.fd;
+                if (fd == listen_fd) {
+                    acceptAll(ep, conns);
+                    continue;
+                }
+                auto it = conns.find(fd);
+                if (it == conns.end()) {
+                    continue;
+                }
+                auto &conn = it->second;
+
+                bool ok = true;
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    ok = onReadable(conn);
+                }
+                if (ok) {
+                    ok = flushOutput(conn);
+                }
+                // requests left in rbuf while the output was full run once it drained
+                while (ok && conn.stalled && !conn.outputFull()) {
+                    ok = processInput(conn) && flushOutput(conn);
+                }
+                bool pending = conn.wpos < conn.wbuf.size();
+                if (ok && conn.closing && !pending) {
+                    ok = false;
+                }
+                // stop reading while the output is full, the client has to read its replies first
+                uint32_t want = (conn.outputFull() ? 0u : (uint32_t) EPOLLIN) | (pending ? (uint32_t) EPOLLOUT : 0u);
+                if (ok && want != conn.events) {
+                    epoll_event ev{};
+                    ev.events = want;
+                    ev.data.fd = fd;
+                    epoll_ctl(ep, EPOLL_CTL_MOD, fd, &ev);
+                    conn.events = want;
+                }
+                if (!ok) {
+                    epoll_ctl(ep, EPOLL_CTL_DEL, fd, nullptr);
+                    close(fd);
+                    conns.erase(it);
+                }
+            }
+        }
+        close(ep);
+    }
+
+public:
+    respServer(dbGate *db, int port, int threads) : db(db), port(port), threads(threads) {}
+
+    /* Open the listening socket and spawn the event loop threads */
+    bool start() {
+        listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listen_fd < 0) {
+            LOG_ERROR("[RESP] socket failed: " + std::string(strerror(errno)));
+            return false;
+        }
+        int one = 1;
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(port);
+        if (bind(listen_fd, (sockaddr *) &addr, sizeof(addr)) < 0 || listen(listen_fd, SOMAXCONN) < 0) {
+            LOG_ERROR("[RESP] Cannot listen on port " + std::to_string(port) + ": " + strerror(errno));
+            close(listen_fd);
+            listen_fd = -1;
+            return false;
+        }
+
+        for (int i = 0; i < threads; i++) {
+            std::thread(&respServer::loop, this).detach();
+        }
+        return true;
+    }
+};